@@ -58,6 +58,11 @@ KVStatus Blackhole::Get(const string& key, string* value) {
     return NOT_FOUND;
 }
 
+KVStatus Blackhole::Get(void* context, const string& key, KVGetCallback* callback) {
+    LOG("Get in place for key=" << key.c_str());
+    return NOT_FOUND;
+}
+
 KVStatus Blackhole::Put(const string& key, const string& value) {
     LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
     return OK;
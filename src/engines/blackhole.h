@@ -52,6 +52,9 @@ class Blackhole : public KVEngine {
                  char* value) final;
     KVStatus Get(const string& key,                        // append value to std::string
                  string* value) final;
+    KVStatus Get(void* context,                            // pass value in place to callback
+                 const string& key,
+                 KVGetCallback* callback) final;
     KVStatus Put(const string& key,                        // copy value from std::string
                  const string& value) final;
     KVStatus Remove(const string& key) final;              // remove value for key
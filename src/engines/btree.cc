@@ -84,10 +84,24 @@ KVStatus BTreeEngine::Get(const string& key, string* value) {
     return OK;
 }
 
+// Values are stored within the leaf entries, so the callback reads them where they are.
+KVStatus BTreeEngine::Get(void* context, const string& key, KVGetCallback* callback) {
+    LOG("Get in place for key=" << key.c_str());
+    btree_type::iterator it = my_btree->find( pstring<MAX_KEY_SIZE>(key) );
+    if ( it == my_btree->end() ) {
+        LOG("Key=" << key.c_str() << " not found");
+        return NOT_FOUND;
+    }
+    callback(context, (int32_t) it->second.size(), it->second.c_str());
+    return OK;
+}
+
 KVStatus BTreeEngine::Put(const string& key, const string& value) {
     LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
     std::pair<typename btree_type::iterator, bool> res = my_btree->insert(std::make_pair(pstring<MAX_KEY_SIZE>(key), pstring<MAX_VALUE_SIZE>(value)));
-    if(!res.second) { // Key already exist.
+    if (res.second) {
+        key_count++;
+    } else { // Key already exist.
         // update value
         typename btree_type::value_type& entry = *res.first;
         transaction::manual tx( pmpool );
@@ -108,6 +122,14 @@ void BTreeEngine::Free() {
   // TODO impl
 }
 
+size_t BTreeEngine::TotalNumKeys() {
+    return key_count;
+}
+
+KVIterator* BTreeEngine::NewIterator() {
+    return new BTreeIterator(this);
+}
+
 PMEMoid BTreeEngine::GetRootOid() {
     return pmpool.get_root().raw();
 }
@@ -122,6 +144,7 @@ void BTreeEngine::Recover() {
     if ( root_data->btree_ptr ) {
         my_btree = root_data->btree_ptr.get();
         my_btree->garbage_collection();
+        key_count = my_btree->count();                      // one pass over leaves, not entries
     } 
     else {
         make_persistent_atomic<btree_type>(pmpool, root_data->btree_ptr);
@@ -129,5 +152,59 @@ void BTreeEngine::Recover() {
     }
 }
 
+// Entries are read in place, and leaves are followed through their persistent links, so a cursor
+// allocates nothing. A put can split the leaf under the cursor, so cursors are positioned again
+// after any put.
+BTreeIterator::BTreeIterator(BTreeEngine* engine) : tree(engine->my_btree), it(nullptr) {}
+
+bool BTreeIterator::Valid() {
+    return valid;
+}
+
+void BTreeIterator::SeekToFirst() {
+    it = tree->begin();
+    valid = it != tree->end();
+}
+
+void BTreeIterator::SeekToLast() {
+    it = tree->end();
+    valid = it != tree->begin();
+    if (valid) --it;
+}
+
+void BTreeIterator::Seek(const string& key) {
+    if (key.size() <= MAX_KEY_SIZE) {
+        it = tree->lower_bound(pstring<MAX_KEY_SIZE>(key));
+    } else {                                               // no stored key extends the prefix
+        const pstring<MAX_KEY_SIZE> prefix(key.substr(0, MAX_KEY_SIZE));
+        it = tree->lower_bound(prefix);
+        if (it != tree->end() && it->first == prefix) ++it;
+    }
+    valid = it != tree->end();
+}
+
+void BTreeIterator::Next() {
+    if (!valid) return;
+    ++it;
+    valid = it != tree->end();
+}
+
+void BTreeIterator::Prev() {
+    if (!valid) return;
+    if (it == tree->begin()) {
+        valid = false;
+    } else {
+        --it;
+    }
+}
+
+std::string_view BTreeIterator::key() {
+    return std::string_view(it->first.c_str(), it->first.size());
+}
+
+std::string_view BTreeIterator::value() {
+    return std::string_view(it->second.c_str(), it->second.size());
+}
+
 } // namespace btree
 } // namespace pmemkv
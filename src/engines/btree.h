@@ -68,6 +68,9 @@ class BTreeEngine : public KVEngine {
                  char* value) final;
     KVStatus Get(const string& key,                             // append value to std::string
                  string* value) final;
+    KVStatus Get(void* context,                                 // pass value in place to callback
+                 const string& key,
+                 KVGetCallback* callback) final;
     KVStatus Put(const string& key,                             // copy value from std::string
                  const string& value) final;
     KVStatus Remove(const string& key) final;                   // remove value for key
@@ -79,13 +82,34 @@ class BTreeEngine : public KVEngine {
 
     void ListAllKeyValuePairs(vector<string>& kv_pairs) final {return;}  
     void ListAllKeys(vector<string>& keys) final {return;}
-    size_t TotalNumKeys() final {return 0;}
+    size_t TotalNumKeys() final;                                // get total number of keys
+
+    KVIterator* NewIterator() final;                            // new cursor over leaves
 
   private:
+    friend class BTreeIterator;
     void Recover();
 
     pool<RootData> pmpool;                                      // pool for persistent root
     btree_type* my_btree;
+    size_t key_count = 0;                                       // entries, counted when opened
+};
+
+class BTreeIterator final : public KVIterator {                 // cursor over linked leaves
+  public:
+    explicit BTreeIterator(BTreeEngine* engine);
+    bool Valid() final;                                         // positioned at a pair
+    void SeekToFirst() final;                                   // position at lowest key
+    void SeekToLast() final;                                    // position at highest key
+    void Seek(const string& key) final;                         // position at first key not below key
+    void Next() final;                                          // move to next higher key
+    void Prev() final;                                          // move to next lower key
+    std::string_view key() final;                               // key in place, valid until put
+    std::string_view value() final;                             // value in place, valid until put
+  private:
+    BTreeEngine::btree_type* const tree;                        // tree walked by cursor
+    BTreeEngine::btree_type::iterator it;                       // entry at position
+    bool valid = false;                                         // entry is not past either end
 };
 
 } // namespace btree
@@ -257,6 +257,20 @@ namespace internal {
             return const_iterator( this, 0 );
         }
 
+        /**
+        * Return iterator to the last entry.
+        */
+        iterator last() {
+            return iterator( this, consistent()->_size - 1 );
+        }
+
+        /**
+        * Return const_iterator to the last entry.
+        */
+        const_iterator last() const {
+            return const_iterator( this, consistent()->_size - 1 );
+        }
+
         /**
         * Return end iterator on an array of indexs.
         */
@@ -986,11 +1000,37 @@ namespace internal {
             return const_iterator( leaf, leaf_it );
         }
         
+        /**
+         * Return iterator to the first entry with key not less than the given one.
+         */
+        iterator lower_bound( const key_type& key ) {
+            leaf_node_type* leaf = find_leaf_node( key );
+            if (leaf == nullptr) return end();
+
+            typename leaf_node_type::iterator leaf_it = std::lower_bound( leaf->begin(), leaf->end(), key, [] ( const_reference entry, const TKey& key ) {
+                return entry.first < key;
+            } );
+            if (leaf->end() == leaf_it && leaf->get_next() != nullptr) return iterator( leaf->get_next().get() );
+
+            return iterator( leaf, leaf_it );
+        }
+
         void garbage_collection();
+
+        /**
+         * Return the number of entries, summing the sizes of the linked leaves.
+         */
+        size_t count() const {
+            size_t entries = 0;
+            for (const leaf_node_type* leaf = head.get(); leaf; leaf = leaf->get_next().get()) {
+                entries += leaf->size();
+            }
+            return entries;
+        }
         
         iterator begin() {
 			leaf_node_type* leaf = head.get();
-            return iterator(leaf);
+            return leaf ? iterator(leaf) : iterator(nullptr);
         }
 
         iterator end() {
@@ -1000,7 +1040,7 @@ namespace internal {
 
         const_iterator begin() const {
 			const leaf_node_type* leaf = head.get();
-            return const_iterator(leaf);
+            return leaf ? const_iterator(leaf) : const_iterator(nullptr);
         }
 
         const_iterator end() const {
@@ -1176,7 +1216,9 @@ public:
     using base_type::begin;
     using base_type::end;
     using base_type::find;
+    using base_type::lower_bound;
     using base_type::insert;
+    using base_type::count;
 
     // Type definitions
     typedef Key key_type;
@@ -33,9 +33,15 @@
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <functional>
 #include <iostream>
-#include <list>
+#include <iterator>
+#include <thread>
 #include <unistd.h>
+#include <libpmemobj.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "kvtree2.h"
 
 #define DO_LOG 0
@@ -62,6 +68,7 @@ KVTree::KVTree(const string& path, const size_t size, const string layout) : pmp
 
 KVTree::~KVTree() {
     LOG("Closing");
+    SaveSnapshot();
     pmpool.close();
     LOG("Closed ok");
 }
@@ -76,30 +83,100 @@ void KVTree::Analyze(KVTreeAnalysis& analysis) {
     analysis.leaf_prealloc = leaves_prealloc.size();
     analysis.leaf_total = 0;
     analysis.path = pmpath;
+    analysis.slab_buffers = 0;
+    analysis.inline_records = 0;
+    size_t slab_used = 0;
+    size_t slab_held = 0;
 
     // iterate persistent leaves for stats
     auto leaf = pmpool.get_root()->head;
     while (leaf) {
         bool empty = true;
         for (int slot = LEAF_KEYS; slot--;) {
-            if (!leaf->slots[slot].get_rw().empty()) {
-                empty = false;
-                break;
+            auto& kvslot = leaf->slots[slot].get_rw();
+            if (kvslot.empty()) continue;
+            empty = false;
+            if (kvslot.inlined()) {
+                analysis.inline_records++;
+            } else if (SlabFlags(kvslot.keysize(), kvslot.valsize()) != 0) {
+                analysis.slab_buffers++;
+                slab_used += KVSlot::buffer_size(kvslot.keysize(), kvslot.valsize());
+                slab_held += kvslot.usable_size();
             }
         }
         if (empty) analysis.leaf_empty++;
         analysis.leaf_total++;
         leaf = leaf->next;  // advance to next linked leaf
     }
+
+    // walk volatile nodes for depth & memory stats
+    analysis.inner_depth = 0;
+    analysis.inner_total = 0;
+    KVNode* node = tree_top.get();
+    while (node && !node->is_leaf) {
+        node = ((KVInnerNode*) node)->children[0].get();
+        analysis.inner_depth++;
+    }
+    size_t dram_bytes = 0;
+    size_t keys = 0;
+    vector<KVNode*> pending;
+    if (tree_top) pending.push_back(tree_top.get());
+    while (!pending.empty()) {
+        auto next = pending.back();
+        pending.pop_back();
+        if (next->is_leaf) {
+            auto leafnode = (KVLeafNode*) next;
+            dram_bytes += leafnode->dram_bytes();
+            for (int slot = LEAF_KEYS; slot--;) if (leafnode->hashes[slot] != 0) keys++;
+            continue;
+        }
+        auto inner = (KVInnerNode*) next;
+        analysis.inner_total++;
+        dram_bytes += sizeof(KVInnerNode) + inner->arena.capacity();
+        for (int i = 0; i <= inner->keycount; i++) pending.push_back(inner->children[i].get());
+    }
+    analysis.dram_per_key = keys > 0 ? dram_bytes / keys : 0;
+    analysis.slab_fill_percent = slab_held > 0 ? slab_used * 100 / slab_held : 0;
+
+    // heap statistics for space held by runs but not allocated
+    analysis.compact_passes = compact_passes;
+    analysis.compact_relocated = compact_relocated;
+    uint64_t run_allocated = 0;
+    uint64_t run_active = 0;
+    pmemobj_ctl_get(pmpool.get_handle(), "stats.heap.run_allocated", &run_allocated);
+    pmemobj_ctl_get(pmpool.get_handle(), "stats.heap.run_active", &run_active);
+    analysis.fragmentation_percent = run_active > run_allocated ? 100 - run_allocated * 100 / run_active : 0;
     LOG("Analyzed ok");
 }
+
+// Each call moves on through the persistent list of leaves from where the last one stopped, and
+// returns after offering at least the given number of objects, so callers decide how much work
+// goes between their own operations. A pass ends when the list does, and the next call starts
+// over from the head.
+bool KVTree::Compact(const size_t objects) {
+    LOG("Compacting, objects=" << objects);
+    size_t offered = 0;
+    while (offered < objects) {
+        auto& link = compact_prev ? compact_prev->next : pmpool.get_root()->head;
+        if (!link) {
+            LOG("   finished pass, relocated=" << compact_relocated);
+            compact_prev = nullptr;
+            compact_passes++;
+            return true;
+        }
+        offered += CompactLeaf(link);
+        compact_prev = link;                                             // as relocated
+    }
+    LOG("Compacted ok");
+    return false;
+}
 void KVTree::ListAllKeyValuePairs(vector<string>& kv_pairs) {
     LOG("Listing");
     // iterate persistent leaves for stats
     auto leaf = pmpool.get_root()->head;
     while (leaf) {
         for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
+            auto& kvslot = leaf->slots[slot].get_rw();
             if (!kvslot.empty()) {
               kv_pairs.push_back(string(kvslot.key(), kvslot.keysize()));
               kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
@@ -116,7 +193,7 @@ void KVTree::ListAllKeys(vector<string>& keys) {
     auto leaf = pmpool.get_root()->head;
     while (leaf) {
         for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
+            auto& kvslot = leaf->slots[slot].get_rw();
             if (!kvslot.empty()) {
               keys.push_back(string(kvslot.key(), kvslot.keysize()));
             }
@@ -126,22 +203,55 @@ void KVTree::ListAllKeys(vector<string>& keys) {
     LOG("List ok");
 }
 
-size_t KVTree::TotalNumKeys() {
-    size_t size = 0;
-    LOG("Getting size");
-    // iterate persistent leaves for stats
-    auto leaf = pmpool.get_root()->head;
-    while (leaf) {
-        for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
-            if (!kvslot.empty()) {
-              ++size;
+void KVTree::ListKeyValuePairsBetween(const string& from, const string& to,
+                                      vector<string>& kv_pairs) {
+    LOG("Listing from=" << from << ", to=" << to);
+    uint8_t slots[LEAF_KEYS];
+    for (auto leafnode = LeafSearch(from); leafnode; leafnode = leafnode->next) {
+        const int count = leafnode->sorted_slots(slots);
+        for (int i = 0; i < count; i++) {
+            const std::string_view key = leafnode->key(slots[i]);
+            if (key.compare(from) < 0) continue;
+            if (key.compare(to) >= 0) {
+                LOG("List ok");
+                return;
             }
+            auto& kvslot = leafnode->leaf->slots[slots[i]].get_ro();
+            kv_pairs.push_back(string(key));
+            kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
         }
-        leaf = leaf->next;  // advance to next linked leaf
     }
-    LOG("Getting size ok");
-    return size;
+    LOG("List ok");
+}
+
+// Counted as slots are filled and cleared, and again from the leaves whenever the index is built.
+size_t KVTree::TotalNumKeys() {
+    return total_keys;
+}
+
+KVIterator* KVTree::NewIterator() {
+    return new KVTreeIterator(this);
+}
+
+void KVTree::Each(void* context, KVEachCallback* callback) {
+    LOG("Each");
+    EachInRange(nullptr, nullptr, context, callback);
+}
+
+void KVTree::EachAbove(void* context, const string& key, KVEachCallback* callback) {
+    LOG("Each above key=" << key);
+    EachInRange(&key, nullptr, context, callback);
+}
+
+void KVTree::EachBelow(void* context, const string& key, KVEachCallback* callback) {
+    LOG("Each below key=" << key);
+    EachInRange(nullptr, &key, context, callback);
+}
+
+void KVTree::EachBetween(void* context, const string& key1, const string& key2,
+                         KVEachCallback* callback) {
+    LOG("Each between key1=" << key1 << ", key2=" << key2);
+    EachInRange(&key1, &key2, context, callback);
 }
 
 KVStatus KVTree::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
@@ -151,20 +261,19 @@ KVStatus KVTree::Get(const int32_t limit, const int32_t keybytes, int32_t* value
     auto leafnode = LeafSearch(ckey);
     if (leafnode) {
         const uint8_t hash = PearsonHash(key, (size_t) keybytes);
-        for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->hashes[slot] == hash) {
-                if (leafnode->keys[slot].compare(ckey) == 0) {
-                    auto kv = leafnode->leaf->slots[slot].get_ro();
-                    auto vs = kv.valsize();
-                    *valuebytes = vs;
-                    if (vs <= limit) {
-                        LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
-                        memcpy(value, kv.val(), vs);
-                        return OK;
-                    } else {
-                        LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
-                        return FAILED;
-                    }
+        for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+            const int slot = __builtin_ctzll(mask);
+            if (leafnode->key(slot) == ckey) {
+                auto& kv = leafnode->leaf->slots[slot].get_ro();
+                auto vs = kv.valsize();
+                *valuebytes = vs;
+                if (vs <= limit) {
+                    LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
+                    memcpy(value, kv.val(), vs);
+                    return OK;
+                } else {
+                    LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
+                    return FAILED;
                 }
             }
         }
@@ -178,14 +287,13 @@ KVStatus KVTree::Get(const string& key, string* value) {
     auto leafnode = LeafSearch(key);
     if (leafnode) {
         const uint8_t hash = PearsonHash(key.c_str(), key.size());
-        for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->hashes[slot] == hash) {
-                if (leafnode->keys[slot].compare(key) == 0) {
-                    auto kv = leafnode->leaf->slots[slot].get_ro();
-                    LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
-                    value->append(kv.val(), kv.valsize());
-                    return OK;
-                }
+        for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+            const int slot = __builtin_ctzll(mask);
+            if (leafnode->key(slot) == key) {
+                auto& kv = leafnode->leaf->slots[slot].get_ro();
+                LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
+                value->append(kv.val(), kv.valsize());
+                return OK;
             }
         }
     }
@@ -193,35 +301,64 @@ KVStatus KVTree::Get(const string& key, string* value) {
     return NOT_FOUND;
 }
 
+// The value is passed straight from its slot, so it is only valid until the callback returns,
+// and the callback must not change the tree.
+KVStatus KVTree::Get(void* context, const string& key, KVGetCallback* callback) {
+    LOG("Get in place for key=" << key.c_str());
+    auto leafnode = LeafSearch(key);
+    auto kvslot = leafnode ? LeafFindSlotForKey(leafnode, PearsonHash(key.c_str(), key.size()), key)
+                           : nullptr;
+    if (!kvslot) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+    }
+    LOG("   found value, size=" << to_string(kvslot->valsize()));
+    callback(context, (int32_t) kvslot->valsize(), kvslot->val());
+    return OK;
+}
+
+// Keys are looked up MULTIGET_GROUP at a time, and every key of a group takes each step before
+// any key takes the next one: down a level of inner nodes, then to its slot, then to its buffer.
+// Each step prefetches what the next one reads, so the cache misses of a group overlap rather
+// than following one another. Leaves are all at the same depth, so keys descend together.
+void KVTree::MultiGet(const vector<string>& keys, vector<string>& values,
+                      vector<KVStatus>& statuses) {
+    LOG("MultiGet for keys=" << keys.size());
+    values.assign(keys.size(), string());
+    statuses.assign(keys.size(), NOT_FOUND);
+    KVNode* nodes[MULTIGET_GROUP];
+    const KVSlot* kvslots[MULTIGET_GROUP];
+    for (size_t first = 0; tree_top && first < keys.size(); first += MULTIGET_GROUP) {
+        const size_t count = std::min<size_t>(MULTIGET_GROUP, keys.size() - first);
+        const string* group = &keys[first];
+        for (size_t i = 0; i < count; i++) nodes[i] = tree_top.get();
+        while (!nodes[0]->is_leaf) {
+            for (size_t i = 0; i < count; i++) {
+                auto inner = (KVInnerNode*) nodes[i];
+                nodes[i] = inner->children[inner->lower_bound(group[i])].get();
+                __builtin_prefetch(nodes[i]);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t hash = PearsonHash(group[i].c_str(), group[i].size());
+            kvslots[i] = LeafFindSlotForKey((KVLeafNode*) nodes[i], hash, group[i]);
+            if (kvslots[i]) __builtin_prefetch(kvslots[i]);              // slot with buffer pointer
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (kvslots[i]) __builtin_prefetch(kvslots[i]->key());       // buffer with sizes & key
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!kvslots[i]) continue;
+            values[first + i].assign(kvslots[i]->val(), kvslots[i]->valsize());
+            statuses[first + i] = OK;
+        }
+    }
+}
+
 KVStatus KVTree::Put(const string& key, const string& value) {
     LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
     try {
-        const uint8_t hash = PearsonHash(key.c_str(), key.size());
-        auto leafnode = LeafSearch(key);
-        if (!leafnode) {
-            LOG("   adding head leaf");
-            unique_ptr<KVLeafNode> new_node(new KVLeafNode());
-            new_node->is_leaf = true;
-            transaction::exec_tx(pmpool, [&] {
-                if (!leaves_prealloc.empty()) {
-                    new_node->leaf = leaves_prealloc.back();
-                    leaves_prealloc.pop_back();
-                } else {
-                    auto root = pmpool.get_root();
-                    auto old_head = root->head;
-                    auto new_leaf = make_persistent<KVLeaf>();
-                    root->head = new_leaf;
-                    new_leaf->next = old_head;
-                    new_node->leaf = new_leaf;
-                }
-                LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
-            });
-            tree_top = move(new_node);
-        } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
-            // nothing else to do
-        } else {
-            LeafSplitFull(leafnode, hash, key, value);
-        }
+        PutKey(key, value);
         return OK;
     } catch (pmem::transaction_alloc_error) {
         return FAILED;
@@ -232,27 +369,34 @@ KVStatus KVTree::Put(const string& key, const string& value) {
 
 KVStatus KVTree::Remove(const string& key) {
     LOG("Remove key=" << key.c_str());
-    auto leafnode = LeafSearch(key);
-    if (!leafnode) {
-        LOG("   head not present");
+    try {
+        RemoveKey(key);
         return OK;
+    } catch (pmem::transaction_error) {                                  // includes alloc errors
+        return FAILED;
     }
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
-    for (int slot = LEAF_KEYS; slot--;) {
-        if (leafnode->hashes[slot] == hash) {
-            if (leafnode->keys[slot].compare(key) == 0) {
-                LOG("   freeing slot=" << slot);
-                leafnode->hashes[slot] = 0;
-                leafnode->keys[slot].clear();
-                auto leaf = leafnode->leaf;
-                transaction::exec_tx(pmpool, [&] {
-                    leaf->slots[slot].get_rw().clear();
-                });
-                break;  // no duplicate keys allowed
+}
+
+// Every operation joins one transaction, so either the whole batch is applied or none of it.
+// Volatile nodes change as the batch goes along, so after an abort they are rebuilt from leaves.
+KVStatus KVTree::Write(const KVWriteBatch& batch) {
+    LOG("Write batch of " << batch.Count() << " operations");
+    try {
+        transaction::exec_tx(pmpool, [&] {
+            for (auto& op : batch.Ops()) {
+                if (op.remove) {
+                    RemoveKey(op.key);
+                } else {
+                    PutKey(op.key, op.value);
+                }
             }
-        }
+        });
+        return OK;
+    } catch (pmem::transaction_error) {                                  // includes alloc errors
+        LOG("   batch aborted, rebuilding index");
+        RebuildIndex();
+        return FAILED;
     }
-    return OK;
 }
 
 
@@ -273,92 +417,185 @@ PMEMobjpool* KVTree::GetPool() {
 // PROTECTED LEAF METHODS
 // ===============================================================================================
 
+void KVTree::PutKey(const string& key, const string& value) {
+    version++;                                                           // reposition cursors
+    const uint8_t hash = PearsonHash(key.c_str(), key.size());
+    auto leafnode = LeafSearch(key);
+    if (!leafnode) {
+        LOG("   adding head leaf");
+        unique_ptr<KVLeafNode> new_node(new KVLeafNode());
+        new_node->is_leaf = true;
+        LeafAddTx([&] {
+            if (!leaves_prealloc.empty()) {
+                new_node->leaf = leaves_prealloc.back();
+                leaves_prealloc.pop_back();
+            } else {
+                auto root = pmpool.get_root();
+                auto old_head = root->head;
+                auto new_leaf = make_persistent<KVLeaf>();
+                root->head = new_leaf;
+                new_leaf->next = old_head;
+                new_node->leaf = new_leaf;
+            }
+            LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
+        });
+        tree_top = move(new_node);
+    } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
+        // nothing else to do
+    } else {
+        LeafSplitFull(leafnode, hash, key, value);
+    }
+}
+
+void KVTree::RemoveKey(const string& key) {
+    version++;                                                           // reposition cursors
+    auto leafnode = LeafSearch(key);
+    if (!leafnode) {
+        LOG("   head not present");
+        return;
+    }
+    const uint8_t hash = PearsonHash(key.c_str(), key.size());
+    for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+        const int slot = __builtin_ctzll(mask);
+        if (leafnode->key(slot) == key) {
+            LOG("   freeing slot=" << slot);
+            LeafAddTx([&] {                                              // with any merge
+                leafnode->leaf->slots[slot].get_rw().clear();
+                leafnode->hashes[slot] = 0;
+                leafnode->clear_key(slot);
+                total_keys--;
+#if LEAF_MERGE
+                LeafMergeSparse(leafnode);                               // may delete leafnode
+#endif
+            });
+            break;  // no duplicate keys allowed
+        }
+    }
+}
+
 KVLeafNode* KVTree::LeafSearch(const string& key) {
     KVNode* node = tree_top.get();
     if (node == nullptr) return nullptr;
-    bool matched;
     while (!node->is_leaf) {
-        matched = false;
         auto inner = (KVInnerNode*) node;
 #ifndef NDEBUG
         inner->assert_invariants();
 #endif
-        const uint8_t keycount = inner->keycount;
-        for (uint8_t idx = 0; idx < keycount; idx++) {
-            node = inner->children[idx].get();
-            if (key.compare(inner->keys[idx]) <= 0) {
-                matched = true;
-                break;
-            }
-        }
-        if (!matched) node = inner->children[keycount].get();
+        node = inner->children[inner->lower_bound(key)].get();
     }
     return (KVLeafNode*) node;
 }
 
+KVLeafNode* KVTree::LeafEdge(const bool highest) {
+    KVNode* node = tree_top.get();
+    while (node && !node->is_leaf) {
+        auto inner = (KVInnerNode*) node;
+        node = inner->children[highest ? inner->keycount : 0].get();
+    }
+    return (KVLeafNode*) node;
+}
+
+const KVSlot* KVTree::LeafFindSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
+                                         const string& key) {
+    for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+        const int slot = __builtin_ctzll(mask);
+        if (leafnode->key(slot) == key) return &leafnode->leaf->slots[slot].get_ro();
+    }
+    return nullptr;
+}
+
+// Pairs are passed straight from their slots, in key order, following the links between leaves.
+// The callback must not change the tree.
+void KVTree::EachInRange(const string* above, const string* below, void* context,
+                         KVEachCallback* callback) {
+    uint8_t slots[LEAF_KEYS];
+    for (auto leafnode = above ? LeafSearch(*above) : LeafEdge(false); leafnode;
+         leafnode = leafnode->next) {
+        const int count = leafnode->sorted_slots(slots);
+        for (int i = 0; i < count; i++) {
+            const std::string_view key = leafnode->key(slots[i]);
+            if (above && key.compare(*above) <= 0) continue;
+            if (below && key.compare(*below) >= 0) return;
+            auto& kvslot = leafnode->leaf->slots[slots[i]].get_ro();
+            callback(context, (int32_t) key.size(), (int32_t) kvslot.valsize(), key.data(),
+                     kvslot.val());
+        }
+    }
+}
+
 void KVTree::LeafFillEmptySlot(KVLeafNode* leafnode, const uint8_t hash,
                                const string& key, const string& value) {
-    for (int slot = LEAF_KEYS; slot--;) {
-        if (leafnode->hashes[slot] == 0) {
-            LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-            return;
-        }
+    const uint64_t empty = LeafHashMask(leafnode->hashes, 0);
+    if (empty) {
+        const int slot = 63 - __builtin_clzll(empty);                   // highest unoccupied slot
+        LeafFillSpecificSlot(leafnode, hash, key, value, slot);
     }
 }
 
 bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
                                 const string& key, const string& value) {
-    // scan for empty/matching slots
-    int last_empty_slot = -1;
-    int key_match_slot = -1;
-    for (int slot = LEAF_KEYS; slot--;) {
-        auto slot_hash = leafnode->hashes[slot];
-        if (slot_hash == 0) {
-            last_empty_slot = slot;
-        } else if (slot_hash == hash) {
-            if (leafnode->keys[slot].compare(key) == 0) {
-                key_match_slot = slot;
-                break;  // no duplicate keys allowed
-            }
+    // scan for matching slot, only comparing keys where hashes match
+    int slot = -1;
+    for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+        const int match = __builtin_ctzll(mask);
+        if (leafnode->key(match) == key) {
+            slot = match;
+            break;  // no duplicate keys allowed
         }
     }
 
-    // update suitable slot if found
-    int slot = key_match_slot >= 0 ? key_match_slot : last_empty_slot;
+    // overwrite matching slot in its own buffer if possible, else swap buffers atomically
     if (slot >= 0) {
-        LOG("   filling slot=" << slot);
-        transaction::exec_tx(pmpool, [&] {
-            LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-        });
+        LOG("   overwriting slot=" << slot);
+        auto& kvslot = leafnode->leaf->slots[slot].get_rw();
+        if (kvslot.fits(value)) {
+            transaction::exec_tx(pmpool, [&] {
+                kvslot.set_in_place(value);
+            });
+        } else {
+            kvslot.set_atomic(pmpool.get_handle(), hash, key, value, SlabFlags(key.size(), value.size()));
+        }
+        return true;
     }
-    return slot >= 0;
+
+    // otherwise publish into lowest empty slot, which needs no transaction
+    const uint64_t empty = LeafHashMask(leafnode->hashes, 0);
+    if (!empty) return false;
+    slot = __builtin_ctzll(empty);
+    LOG("   filling slot=" << slot);
+    leafnode->leaf->slots[slot].get_rw().set_atomic(pmpool.get_handle(), hash, key, value,
+                                                    SlabFlags(key.size(), value.size()));
+    leafnode->hashes[slot] = hash;
+    leafnode->set_key(slot, key);
+    total_keys++;
+    return true;
 }
 
 void KVTree::LeafFillSpecificSlot(KVLeafNode* leafnode, const uint8_t hash,
                                   const string& key, const string& value, const int slot) {
-    if (leafnode->hashes[slot] == 0) {
+    const bool added = leafnode->hashes[slot] == 0;
+    if (added) {
         leafnode->hashes[slot] = hash;
-        leafnode->keys[slot] = key;
+        leafnode->set_key(slot, key);
     }
-    leafnode->leaf->slots[slot].get_rw().set(hash, key, value);
+    leafnode->leaf->slots[slot].get_rw().set(hash, key, value, SlabFlags(key.size(), value.size()));
+    if (added) total_keys++;
 }
 
 void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
                            const string& key, const string& value) {
-    string keys[LEAF_KEYS + 1];
+    std::string_view keys[LEAF_KEYS + 1];
     keys[LEAF_KEYS] = key;
-    for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->keys[slot];
-    std::sort(std::begin(keys), std::end(keys), [](const string& lhs, const string& rhs) {
-        return lhs.compare(rhs) < 0;
-    });
-    string split_key = keys[LEAF_KEYS_MIDPOINT];
+    for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->key(slot);
+    std::sort(std::begin(keys), std::end(keys));
+    string split_key(keys[LEAF_KEYS_MIDPOINT]);
     LOG("   splitting leaf at key=" << split_key);
 
     // split leaf into two leaves, moving slots that sort above split key to new leaf
     unique_ptr<KVLeafNode> new_leafnode(new KVLeafNode());
     new_leafnode->parent = leafnode->parent;
     new_leafnode->is_leaf = true;
-    transaction::exec_tx(pmpool, [&] {
+    LeafAddTx([&] {
         persistent_ptr<KVLeaf> new_leaf;
         if (!leaves_prealloc.empty()) {
             new_leaf = leaves_prealloc.back();
@@ -373,18 +610,24 @@ void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
             new_leafnode->leaf = new_leaf;
         }
         for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->keys[slot].compare(split_key) > 0) {
-                new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
+            if (leafnode->key(slot).compare(split_key) > 0) {
                 new_leafnode->hashes[slot] = leafnode->hashes[slot];
-                new_leafnode->keys[slot] = leafnode->keys[slot];
+                new_leafnode->set_key(slot, leafnode->key(slot));        // before slot moves
+                new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
                 leafnode->hashes[slot] = 0;
-                leafnode->keys[slot].clear();
+                leafnode->clear_key(slot);
             }
         }
         auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
         LeafFillEmptySlot(target, hash, key, value);
     });
 
+    // link new leaf as right neighbour, keeping volatile leaves in key order
+    new_leafnode->prev = leafnode;
+    new_leafnode->next = leafnode->next;
+    if (leafnode->next) leafnode->next->prev = new_leafnode.get();
+    leafnode->next = new_leafnode.get();
+
     // recursively update volatile parents outside persistent transaction
     InnerUpdateAfterSplit(leafnode, move(new_leafnode), &split_key);
 }
@@ -394,8 +637,7 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
         assert(node == tree_top.get());
         LOG("   creating new top node for split_key=" << *split_key);
         unique_ptr<KVInnerNode> top(new KVInnerNode());
-        top->keycount = 1;
-        top->keys[0] = *split_key;
+        top->insert_key(0, *split_key);
         node->parent = top.get();
         new_node->parent = top.get();
         top->children[0] = move(tree_top);
@@ -410,16 +652,13 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
     LOG("   updating parents for split_key=" << *split_key);
     KVInnerNode* inner = node->parent;
     { // insert split_key and new_node into inner node in sorted order
-        const uint8_t keycount = inner->keycount;
-        int idx = 0;  // position where split_key should be inserted
-        while (idx < keycount && inner->keys[idx].compare(*split_key) <= 0) idx++;
-        for (int i = keycount - 1; i >= idx; i--) inner->keys[i + 1] = move(inner->keys[i]);
+        const uint16_t keycount = inner->keycount;
+        const uint16_t idx = inner->upper_bound(*split_key);  // position where split_key goes
         for (int i = keycount; i > idx; i--) inner->children[i + 1] = move(inner->children[i]);
-        inner->keys[idx] = *split_key;
+        inner->insert_key(idx, *split_key);
         inner->children[idx + 1] = move(new_node);
-        inner->keycount = (uint8_t) (keycount + 1);
     }
-    const uint8_t keycount = inner->keycount;
+    const uint16_t keycount = inner->keycount;
     if (keycount <= INNER_KEYS) {
 #ifndef NDEBUG
         inner->assert_invariants();
@@ -430,16 +669,15 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
     // split inner node at the midpoint, update parents as needed
     unique_ptr<KVInnerNode> ni(new KVInnerNode());                       // create new inner node
     ni->parent = inner->parent;                                          // set parent reference
-    for (int i = INNER_KEYS_UPPER; i < keycount; i++) {                  // move all upper keys
-        ni->keys[i - INNER_KEYS_UPPER] = move(inner->keys[i]);           // move key string
+    for (int i = INNER_KEYS_UPPER; i < keycount; i++) {                  // copy all upper keys
+        ni->insert_key(i - INNER_KEYS_UPPER, inner->key(i));             // append to new arena
     }
     for (int i = INNER_KEYS_UPPER; i < keycount + 1; i++) {              // move all upper children
         ni->children[i - INNER_KEYS_UPPER] = move(inner->children[i]);   // move child reference
         ni->children[i - INNER_KEYS_UPPER]->parent = ni.get();           // set parent reference
     }
-    ni->keycount = INNER_KEYS_MIDPOINT;                                  // always half the keys
-    string new_split_key = inner->keys[INNER_KEYS_MIDPOINT];             // save for recursion
-    inner->keycount = INNER_KEYS_MIDPOINT;                               // half of keys remain
+    string new_split_key(inner->key(INNER_KEYS_MIDPOINT));               // save for recursion
+    inner->truncate_keys(INNER_KEYS_MIDPOINT);                           // half of keys remain
 
     // perform deep check on modified inner nodes
 #ifndef NDEBUG
@@ -450,75 +688,519 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
     InnerUpdateAfterSplit(inner, move(ni), &new_split_key);              // recursive update
 }
 
+// A sparse leaf is merged with the neighbour under the same parent that leaves the fewest keys,
+// as long as the result stays below LEAF_KEYS_MERGED, so a merged leaf takes a good number of
+// inserts before it splits again. Slots move from the sparser leaf into free slots of the other,
+// and the emptied persistent leaf stays linked where it is but goes back to the unused leaves.
+void KVTree::LeafMergeSparse(KVLeafNode* leafnode) {
+    const int count = leafnode->key_count();
+    KVInnerNode* inner = leafnode->parent;
+    if (count >= LEAF_KEYS_UNDERFLOW || !inner) return;                 // top leaf is kept
+    uint16_t idx = 0;
+    while (inner->children[idx].get() != leafnode) idx++;
+    int lower_idx = -1;                                                  // first of merged pair
+    int best = LEAF_KEYS_MERGED + 1;
+    if (idx > 0) {
+        const int merged = count + ((KVLeafNode*) inner->children[idx - 1].get())->key_count();
+        if (merged < best) {
+            best = merged;
+            lower_idx = idx - 1;
+        }
+    }
+    if (idx < inner->keycount) {
+        const int merged = count + ((KVLeafNode*) inner->children[idx + 1].get())->key_count();
+        if (merged < best) {
+            best = merged;
+            lower_idx = idx;
+        }
+    }
+    if (lower_idx < 0) return;
+    auto lower = (KVLeafNode*) inner->children[lower_idx].get();
+    auto upper = (KVLeafNode*) inner->children[lower_idx + 1].get();
+    const bool into_lower = lower->key_count() >= upper->key_count();
+    auto source = into_lower ? upper : lower;
+    auto target = into_lower ? lower : upper;
+    LOG("   merging leaves, keys=" << best);
+
+    LeafAddTx([&] {
+        uint64_t empty = LeafHashMask(target->hashes, 0);
+        for (int slot = LEAF_KEYS; slot--;) {
+            if (source->hashes[slot] == 0) continue;
+            const int free_slot = __builtin_ctzll(empty);
+            empty &= empty - 1;
+            target->hashes[free_slot] = source->hashes[slot];
+            target->set_key(free_slot, source->key(slot));               // before slot moves
+            target->leaf->slots[free_slot].swap(source->leaf->slots[slot]);
+            source->hashes[slot] = 0;
+            source->clear_key(slot);
+        }
+        leaves_prealloc.push_back(source->leaf);
+    });
+
+    // unlink emptied leaf, keeping merged leaf in place of the lower one
+    if (source->prev) source->prev->next = source->next;
+    if (source->next) source->next->prev = source->prev;
+    if (!into_lower) inner->children[lower_idx].swap(inner->children[lower_idx + 1]);
+    InnerUpdateAfterMerge(inner, (uint16_t) lower_idx);
+}
+
+// Drops the key at idx and the child after it, which has already been merged into the child
+// before it. Sparse inner nodes are merged in turn with a neighbour, pulling down the key that
+// separated them, and a top node left with a single child is replaced by that child.
+void KVTree::InnerUpdateAfterMerge(KVInnerNode* inner, const uint16_t idx) {
+    const uint16_t keycount = inner->keycount;
+    for (int i = idx + 1; i < keycount; i++) inner->children[i] = move(inner->children[i + 1]);
+    inner->children[keycount].reset();
+    inner->erase_key(idx);
+#ifndef NDEBUG
+    inner->assert_invariants();
+#endif
+
+    KVInnerNode* parent = inner->parent;
+    if (!parent) {
+        assert(inner == tree_top.get());
+        while (!tree_top->is_leaf && ((KVInnerNode*) tree_top.get())->keycount == 0) {
+            LOG("   collapsing top node");
+            unique_ptr<KVNode> child = move(((KVInnerNode*) tree_top.get())->children[0]);
+            child->parent = nullptr;
+            tree_top = move(child);                                      // assign new top node
+        }
+        return;                                                          // end recursion
+    }
+    if (inner->keycount >= INNER_KEYS_UNDERFLOW) return;                 // end recursion
+
+    uint16_t pos = 0;
+    while (parent->children[pos].get() != inner) pos++;
+    int lower_idx = -1;                                                  // first of merged pair
+    int best = INNER_KEYS_MERGED + 1;
+    if (pos > 0) {
+        const int merged = inner->keycount + 1 + ((KVInnerNode*) parent->children[pos - 1].get())->keycount;
+        if (merged < best) {
+            best = merged;
+            lower_idx = pos - 1;
+        }
+    }
+    if (pos < parent->keycount) {
+        const int merged = inner->keycount + 1 + ((KVInnerNode*) parent->children[pos + 1].get())->keycount;
+        if (merged < best) {
+            best = merged;
+            lower_idx = pos;
+        }
+    }
+    if (lower_idx < 0) return;                                           // end recursion
+    LOG("   merging inner nodes, keys=" << best);
+    auto lower = (KVInnerNode*) parent->children[lower_idx].get();
+    auto upper = (KVInnerNode*) parent->children[lower_idx + 1].get();
+    const uint16_t base = lower->keycount + 1;                           // first child moved over
+    lower->insert_key(lower->keycount, parent->key(lower_idx));          // pull down separator
+    for (int i = 0; i < upper->keycount; i++) lower->insert_key(lower->keycount, upper->key(i));
+    for (int i = 0; i <= upper->keycount; i++) {                         // move all upper children
+        lower->children[base + i] = move(upper->children[i]);            // move child reference
+        lower->children[base + i]->parent = lower;                       // set parent reference
+    }
+    InnerUpdateAfterMerge(parent, (uint16_t) lower_idx);                 // recursive update
+}
+
 // ===============================================================================================
 // PROTECTED LIFECYCLE METHODS
 // ===============================================================================================
 
+// Runs task(0) .. task(count - 1) concurrently, using the calling thread for the last one.
+static void RunInParallel(const size_t count, const std::function<void(size_t)>& task) {
+    vector<std::thread> workers;
+    for (size_t i = 0; i + 1 < count; i++) workers.emplace_back(task, i);
+    if (count > 0) task(count - 1);
+    for (auto& worker : workers) worker.join();
+}
+
 void KVTree::Recover() {
     LOG("Recovering");
+    SlabRegister();
+    auto stats = POBJ_STATS_ENABLED_TRANSIENT;                           // for fragmentation
+    pmemobj_ctl_set(pmpool.get_handle(), "stats.enabled", &stats);
+    vector<KVRecoveredLeaf> leaves;
+    if (!RecoverSnapshot(leaves)) RecoverLeaves(leaves);
+    DiscardSnapshot();                                                   // crash needs full scan
+    InnerBulkLoad(leaves);
+    LOG("Recovered ok");
+}
 
-    // traverse persistent leaves to build list of leaves to recover
-    std::list<KVRecoveredLeaf> leaves;
-    auto leaf = pmpool.get_root()->head;
-    while (leaf) {
-        unique_ptr<KVLeafNode> leafnode(new KVLeafNode());
-        leafnode->leaf = leaf;
-        leafnode->is_leaf = true;
+// Persistent leaves are always complete, so volatile nodes left ahead of them by an aborted
+// batch are dropped and recovered again with a full scan.
+void KVTree::RebuildIndex() {
+    version++;
+    tree_top.reset();
+    leaves_prealloc.clear();
+    vector<KVRecoveredLeaf> leaves;
+    RecoverLeaves(leaves);
+    InnerBulkLoad(leaves);
+}
 
-        // find highest sorting key in leaf, while recovering all hashes
-        bool empty_leaf = true;
-        string max_key;
-        for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_ro();
-            if (kvslot.empty()) continue;
-            leafnode->hashes[slot] = kvslot.hash();
-            if (leafnode->hashes[slot] == 0) continue;
-            const char* key = kvslot.key();
+// Adding or merging a leaf moves it to or from preallocated leaves and moves keys in volatile
+// nodes as it goes, so if the transaction aborts, volatile nodes are rebuilt to match the leaves
+// rolled back. Nested in a batch or a removal, the abort is only rolled back once the outermost
+// transaction ends, and that rebuilds instead.
+template <typename F>
+void KVTree::LeafAddTx(F&& body) {
+    try {
+        transaction::exec_tx(pmpool, body);
+    } catch (pmem::transaction_error) {                                  // includes alloc errors
+        if (pmemobj_tx_stage() == TX_STAGE_NONE) {
+            LOG("   adding leaf aborted, rebuilding index");
+            RebuildIndex();
+        }
+        throw;
+    }
+}
+
+void KVTree::RecoverLeaves(vector<KVRecoveredLeaf>& leaves) {
+    // collect persistent leaves so they can be divided into contiguous runs
+    vector<persistent_ptr<KVLeaf>> chain;
+    for (auto leaf = pmpool.get_root()->head; leaf; leaf = leaf->next) chain.push_back(leaf);
+    size_t threads = RECOVERY_THREADS > 0 ? RECOVERY_THREADS : std::thread::hardware_concurrency();
+    threads = std::max<size_t>(1, std::min(threads, chain.size() / RECOVERY_LEAVES_PER_THREAD));
+    LOG("   recovering leaves=" << chain.size() << ", threads=" << threads);
+
+    // recover each run of leaves on its own thread, sorting the run by highest key
+    const auto by_max_key = [](const KVRecoveredLeaf& lhs, const KVRecoveredLeaf& rhs) {
+        return lhs.max_key.compare(rhs.max_key) < 0;
+    };
+    vector<vector<KVRecoveredLeaf>> runs(threads);
+    vector<vector<persistent_ptr<KVLeaf>>> empties(threads);
+    RunInParallel(threads, [&](const size_t run) {
+        const size_t end = chain.size() * (run + 1) / threads;
+        for (size_t i = chain.size() * run / threads; i < end; i++) {
+            auto leaf = chain[i];
+            unique_ptr<KVLeafNode> leafnode(new KVLeafNode());
+            leafnode->leaf = leaf;
+            leafnode->is_leaf = true;
+
+            // find highest sorting key in leaf, while recovering all hashes
+            bool empty_leaf = true;
+            string max_key;
+            for (int slot = LEAF_KEYS; slot--;) {
+                auto& kvslot = leaf->slots[slot].get_ro();
+                if (kvslot.empty()) continue;
+                leafnode->hashes[slot] = kvslot.hash();
+                if (leafnode->hashes[slot] == 0) continue;
+                const char* key = kvslot.key();
+                if (empty_leaf) {
+                    max_key = string(kvslot.key(), kvslot.get_ks());
+                    empty_leaf = false;
+                } else if (max_key.compare(0, string::npos, kvslot.key(), kvslot.get_ks()) < 0) {
+                    max_key = string(kvslot.key(), kvslot.get_ks());
+                }
+                leafnode->set_key(slot, std::string_view(key, kvslot.get_ks()));
+            }
+
+            // use highest sorting key to decide how to recover the leaf
             if (empty_leaf) {
-                max_key = string(kvslot.key(), kvslot.get_ks());
-                empty_leaf = false;
-            } else if (max_key.compare(0, string::npos, kvslot.key(), kvslot.get_ks()) < 0) {
-                max_key = string(kvslot.key(), kvslot.get_ks());
+                empties[run].push_back(leaf);
+            } else {
+                runs[run].push_back({move(leafnode), max_key});
             }
-            leafnode->keys[slot] = string(key, kvslot.get_ks());
         }
+        std::sort(runs[run].begin(), runs[run].end(), by_max_key);
+    });
+    for (auto& empty : empties) leaves_prealloc.insert(leaves_prealloc.end(), empty.begin(), empty.end());
 
-        // use highest sorting key to decide how to recover the leaf
-        if (empty_leaf) {
-            leaves_prealloc.push_back(leaf);
-        } else {
-            leaves.push_back({move(leafnode), max_key});
+    // merge sorted runs pairwise until all recovered leaves are in ascending key order
+    while (runs.size() > 1) {
+        vector<vector<KVRecoveredLeaf>> merged((runs.size() + 1) / 2);
+        RunInParallel(merged.size(), [&](const size_t pair) {
+            auto& lhs = runs[pair * 2];
+            if (pair * 2 + 1 == runs.size()) {
+                merged[pair] = move(lhs);                                // odd run out
+                return;
+            }
+            auto& rhs = runs[pair * 2 + 1];
+            merged[pair].reserve(lhs.size() + rhs.size());
+            std::merge(std::make_move_iterator(lhs.begin()), std::make_move_iterator(lhs.end()),
+                       std::make_move_iterator(rhs.begin()), std::make_move_iterator(rhs.end()),
+                       std::back_inserter(merged[pair]), by_max_key);
+        });
+        runs = move(merged);
+    }
+    leaves = move(runs.front());
+}
+
+// Every open of a pool, by any version of pmemkv or by other tools, advances its run id by two.
+// A leaf directory written in the run just before this one therefore describes the leaves as
+// they are now, while one written earlier may have missed changes made by code that ignores it.
+static uint64_t PoolRunId(PMEMobjpool* pop) {
+    PMEMvlt vlt = {0};
+    int unused;
+    pmemobj_volatile(pop, &vlt, &unused, sizeof(unused), [](void*, void*) { return 0; }, nullptr);
+    return vlt.runid;
+}
+
+// The leaf directory lists empty leaves, then every other leaf in key order with its hashes,
+// highest key and (when leaf keys are kept in DRAM) the key of each occupied slot. Reading it
+// back is one sequential pass, rather than following every slot into its key/value buffer.
+bool KVTree::RecoverSnapshot(vector<KVRecoveredLeaf>& leaves) {
+#if RECOVERY_SNAPSHOT
+    auto directory = pmpool.get_root()->directory;
+    if (directory == nullptr) return false;
+    if (directory->format != SNAPSHOT_FORMAT || !directory->contents) return false;
+    if (directory->run_id + 2 != PoolRunId(pmpool.get_handle())) return false;
+    LOG("   loading leaf directory, size=" << directory->size);
+    const char* p = directory->contents.get();
+    const auto read = [&p](void* dest, const size_t bytes) {
+        memcpy(dest, p, bytes);
+        p += bytes;
+    };
+    uint64_t empty_count, leaf_count;
+    read(&empty_count, sizeof(empty_count));
+    read(&leaf_count, sizeof(leaf_count));
+    for (uint64_t i = 0; i < empty_count; i++) {
+        PMEMoid oid;
+        read(&oid, sizeof(oid));
+        leaves_prealloc.push_back(persistent_ptr<KVLeaf>(oid));
+    }
+    leaves.reserve(leaf_count);
+    for (uint64_t i = 0; i < leaf_count; i++) {
+        PMEMoid oid;
+        read(&oid, sizeof(oid));
+        unique_ptr<KVLeafNode> leafnode(new KVLeafNode());
+        leafnode->leaf = persistent_ptr<KVLeaf>(oid);
+        leafnode->is_leaf = true;
+        read(leafnode->hashes, sizeof(leafnode->hashes));
+        uint32_t size;
+        read(&size, sizeof(size));
+        string max_key(p, size);
+        p += size;
+#if KVTREE2_LEAF_ARENA
+        for (int slot = 0; slot < LEAF_KEYS; slot++) {
+            if (leafnode->hashes[slot] == 0) continue;
+            read(&size, sizeof(size));
+            leafnode->set_key(slot, std::string_view(p, size));
+            p += size;
         }
+#endif
+        leaves.push_back({move(leafnode), move(max_key)});
+    }
+    assert(p == directory->contents.get() + directory->size);
+    return true;
+#else
+    return false;
+#endif
+}
 
-        leaf = leaf->next;  // advance to next linked leaf
+void KVTree::SaveSnapshot() {
+#if RECOVERY_SNAPSHOT
+    LOG("   saving leaf directory");
+    string directory;
+    const auto write = [&directory](const void* src, const size_t bytes) {
+        directory.append((const char*) src, bytes);
+    };
+    vector<KVLeafNode*> ordered;                                         // leaves in key order
+    vector<persistent_ptr<KVLeaf>> empties(leaves_prealloc);
+    vector<KVNode*> pending;
+    if (tree_top) pending.push_back(tree_top.get());
+    while (!pending.empty()) {
+        auto next = pending.back();
+        pending.pop_back();
+        if (next->is_leaf) {
+            auto leafnode = (KVLeafNode*) next;
+            if (std::all_of(std::begin(leafnode->hashes), std::end(leafnode->hashes),
+                            [](const uint8_t hash) { return hash == 0; })) {
+                empties.push_back(leafnode->leaf);
+            } else {
+                ordered.push_back(leafnode);
+            }
+            continue;
+        }
+        auto inner = (KVInnerNode*) next;
+        for (int i = inner->keycount + 1; i--;) pending.push_back(inner->children[i].get());
+    }
+    const uint64_t empty_count = empties.size();
+    const uint64_t leaf_count = ordered.size();
+    write(&empty_count, sizeof(empty_count));
+    write(&leaf_count, sizeof(leaf_count));
+    for (auto& leaf : empties) {
+        const PMEMoid oid = leaf.raw();
+        write(&oid, sizeof(oid));
+    }
+    for (auto leafnode : ordered) {
+        const PMEMoid oid = leafnode->leaf.raw();
+        write(&oid, sizeof(oid));
+        write(leafnode->hashes, sizeof(leafnode->hashes));
+        std::string_view max_key;
+        bool found = false;
+        for (int slot = 0; slot < LEAF_KEYS; slot++) {
+            if (leafnode->hashes[slot] == 0) continue;
+            if (!found || max_key.compare(leafnode->key(slot)) < 0) max_key = leafnode->key(slot);
+            found = true;
+        }
+        const uint32_t size = (uint32_t) max_key.size();
+        write(&size, sizeof(size));
+        write(max_key.data(), max_key.size());
+#if KVTREE2_LEAF_ARENA
+        for (int slot = 0; slot < LEAF_KEYS; slot++) {
+            if (leafnode->hashes[slot] == 0) continue;
+            const std::string_view key = leafnode->key(slot);
+            const uint32_t keysize = (uint32_t) key.size();
+            write(&keysize, sizeof(keysize));
+            write(key.data(), key.size());
+        }
+#endif
     }
 
-    // sort recovered leaves in ascending key order
-    leaves.sort([](const KVRecoveredLeaf& lhs, const KVRecoveredLeaf& rhs) {
-        return (lhs.max_key.compare(rhs.max_key) < 0);
+    // a full pool just means the next open scans every leaf
+    try {
+        transaction::exec_tx(pmpool, [&] {
+            DiscardSnapshot();
+            auto saved = make_persistent<KVDirectory>();
+            saved->contents = make_persistent<char[]>(directory.size());
+            memcpy(saved->contents.get(), directory.data(), directory.size());
+            saved->size = directory.size();
+            saved->run_id = PoolRunId(pmpool.get_handle());
+            saved->format = SNAPSHOT_FORMAT;
+            pmpool.get_root()->directory = saved;
+        });
+    } catch (pmem::transaction_alloc_error) {
+        LOG("   could not save leaf directory");
+    } catch (pmem::transaction_error) {
+        LOG("   could not save leaf directory");
+    }
+#endif
+}
+
+void KVTree::DiscardSnapshot() {
+    auto root = pmpool.get_root();
+    if (root->directory == nullptr) return;
+    transaction::exec_tx(pmpool, [&] {
+        auto directory = root->directory;
+        if (directory->contents) delete_persistent<char[]>(directory->contents, directory->size);
+        delete_persistent<KVDirectory>(directory);
+        root->directory = nullptr;
     });
+}
+
+// Slot buffers of up to SLAB_MAX_SIZE bytes get their own allocation classes, spaced a quarter
+// power of two apart, so each is carved from a run of equal units without a per-object header.
+// Free units are tracked by the pool in DRAM and classes are runtime state, so they are registered
+// on every open. An id already registered with the same unit size (by another tree sharing the
+// pool) is reused, and any other conflict leaves buffers in the default classes.
+void KVTree::SlabRegister() {
+    slab_classes.clear();
+#if SLAB_MAX_SIZE > 0
+    unsigned class_id = SLAB_CLASS_ID_FIRST;
+    for (size_t unit = SLAB_MIN_SIZE, step = SLAB_MIN_SIZE / 4; unit <= SLAB_MAX_SIZE; unit += step) {
+        if (unit == step * 8) step *= 2;                                 // quarter of a power of two
+        pobj_alloc_class_desc desc = {};
+        desc.unit_size = unit;
+        desc.units_per_block = SLAB_UNITS_PER_BLOCK;
+        desc.header_type = POBJ_HEADER_NONE;
+        desc.class_id = class_id;
+        const string query = "heap.alloc_class." + to_string(class_id) + ".desc";
+        if (pmemobj_ctl_set(pmpool.get_handle(), query.c_str(), &desc) != 0) {
+            pobj_alloc_class_desc existing = {};
+            if (pmemobj_ctl_get(pmpool.get_handle(), query.c_str(), &existing) != 0 ||
+                existing.unit_size != unit || existing.header_type != POBJ_HEADER_NONE) {
+                LOG("   slab classes unavailable, class_id=" << class_id);
+                slab_classes.clear();
+                return;
+            }
+        }
+        slab_classes.push_back({unit, class_id++});
+    }
+#endif
+}
 
-    // reconstruct top/inner nodes using adjacent pairs of recovered leaves
-    tree_top.reset(nullptr);
+uint64_t KVTree::SlabFlags(const size_t ksize, const size_t vsize) {
+    const size_t size = KVSlot::buffer_size(ksize, vsize);
+    for (auto& slab : slab_classes) if (size <= slab.unit_size) return POBJ_CLASS_ID(slab.class_id);
+    return 0;                                                            // default classes
+}
 
-    if (!leaves.empty()) {
-        tree_top = move(leaves.front().leafnode);
-        auto max_key = leaves.front().max_key;
-        leaves.pop_front();
+// Slot buffers are relocated first, as their only references are the slots of the leaf. The leaf
+// is then referenced from the list (by the previous leaf or the root) and from DRAM, by its leaf
+// node or the unused leaves, and it is found through any key it holds. An empty leaf still in
+// the tree has no key to find it by, so it stays where it is.
+size_t KVTree::CompactLeaf(persistent_ptr<KVLeaf>& link) {
+    vector<PMEMoid*> references;
+    const KVSlot* first = nullptr;                                       // any occupied slot
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+        auto& kvslot = link->slots[slot].get_rw();
+        if (kvslot.empty()) continue;
+        if (!first) first = &kvslot;
+        if (!kvslot.inlined()) references.push_back(kvslot.buffer_oid());
+    }
+    const size_t buffers = references.size();
+    CompactObjects(references);
 
-        auto prevnode = tree_top.get();
-        while (!leaves.empty()) {
-            string split_key = string(max_key);
-            auto nextnode = leaves.front().leafnode.get();
-            nextnode->parent = prevnode->parent;
-            InnerUpdateAfterSplit(prevnode, move(leaves.front().leafnode), &split_key);
-            max_key = leaves.front().max_key;
-            leaves.pop_front();
-            prevnode = nextnode;
-        }
+    references.clear();
+    references.push_back(link.raw_ptr());
+    if (first) {
+        auto leafnode = LeafSearch(string(first->key(), first->keysize()));
+        if (leafnode && leafnode->leaf == link) references.push_back(leafnode->leaf.raw_ptr());
+    } else {
+        for (auto& leaf : leaves_prealloc) if (leaf == link) references.push_back(leaf.raw_ptr());
     }
+    if (references.size() > 1) CompactObjects(references);
+    return buffers + 1;
+}
 
-    LOG("Recovered ok");
+// The pool moves whichever of the objects sit in sparsely used runs into denser ones, and updates
+// every reference passed in (whether in the pool or in DRAM) in the same redo-logged step, so a
+// crash leaves each object either where it was or fully moved. A pool too full to move objects
+// just keeps them in place.
+void KVTree::CompactObjects(vector<PMEMoid*>& references) {
+    if (references.empty()) return;
+    pobj_defrag_result result = {};
+    if (pmemobj_defrag(pmpool.get_handle(), references.data(), references.size(), &result) != 0) {
+        LOG("   could not relocate objects, count=" << references.size());
+        return;
+    }
+    compact_relocated += result.relocated;
+    if (result.relocated > 0) version++;                                 // reposition cursors
+}
+
+// Builds inner levels one at a time from the sorted leaves, giving each new inner node an even
+// share of the level below, but no more than RECOVERY_FILL_PERCENT of INNER_KEYS keys. The keys
+// between adjacent groups are passed up to separate the new nodes in the level above. Keys are
+// counted on the way, so TotalNumKeys never has to visit the leaves.
+void KVTree::InnerBulkLoad(vector<KVRecoveredLeaf>& leaves) {
+    vector<unique_ptr<KVNode>> nodes;
+    vector<string> split_keys;                                           // between adjacent nodes
+    for (size_t i = 1; i < leaves.size(); i++) {                         // link neighbouring leaves
+        leaves[i].leafnode->prev = leaves[i - 1].leafnode.get();
+        leaves[i - 1].leafnode->next = leaves[i].leafnode.get();
+    }
+    total_keys = 0;
+    for (size_t i = 0; i < leaves.size(); i++) {
+        total_keys += leaves[i].leafnode->key_count();
+        nodes.push_back(move(leaves[i].leafnode));
+        if (i + 1 < leaves.size()) split_keys.push_back(move(leaves[i].max_key));
+    }
+    const size_t fanout = std::max(2, INNER_KEYS * RECOVERY_FILL_PERCENT / 100 + 1);
+    while (nodes.size() > 1) {
+        const size_t count = nodes.size();
+        const size_t groups = std::min((count + fanout - 1) / fanout, count / 2);
+        vector<unique_ptr<KVNode>> uppers;
+        vector<string> upper_keys;
+        size_t begin = 0;
+        for (size_t group = 0; group < groups; group++) {
+            const size_t end = count * (group + 1) / groups;             // at least two children
+            unique_ptr<KVInnerNode> inner(new KVInnerNode());
+            for (size_t i = begin; i < end; i++) {
+                if (i > begin) inner->insert_key(inner->keycount, split_keys[i - 1]);
+                nodes[i]->parent = inner.get();
+                inner->children[i - begin] = move(nodes[i]);
+            }
+#ifndef NDEBUG
+            inner->assert_invariants();
+#endif
+            if (end < count) upper_keys.push_back(move(split_keys[end - 1]));
+            uppers.push_back(move(inner));
+            begin = end;
+        }
+        nodes = move(uppers);
+        split_keys = move(upper_keys);
+        LOG("   packed inner level, nodes=" << nodes.size());
+    }
+    tree_top.reset(nodes.empty() ? nullptr : nodes.front().release());
 }
 
 // ===============================================================================================
@@ -557,59 +1239,308 @@ uint8_t KVTree::PearsonHash(const char* data, const size_t size) {
     // MODIFICATION END
 }
 
+// ===============================================================================================
+// FINGERPRINT METHODS
+// ===============================================================================================
+
+// Compares all leaf hashes against the given one, returning a mask where bit N is set when
+// hashes[N] matches. Keys then only need comparing for set bits, which is rare except for
+// the slot actually holding the key.
+uint64_t KVTree::LeafHashMask(const uint8_t* hashes, const uint8_t hash) {
+    uint64_t mask = 0;
+    int slot = 0;
+#if defined(__AVX2__)
+    const __m256i wide = _mm256_set1_epi8((char) hash);
+    for (; slot + 32 <= LEAF_KEYS; slot += 32) {
+        auto chunk = _mm256_loadu_si256((const __m256i*) (hashes + slot));
+        mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, wide)) << slot;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i narrow = _mm_set1_epi8((char) hash);
+    for (; slot + 16 <= LEAF_KEYS; slot += 16) {
+        auto chunk = _mm_loadu_si128((const __m128i*) (hashes + slot));
+        mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, narrow)) << slot;
+    }
+#endif
+    for (; slot < LEAF_KEYS; slot++) {                                   // scalar fallback
+        if (hashes[slot] == hash) mask |= (uint64_t) 1 << slot;
+    }
+    return mask;
+}
+
 // ===============================================================================================
 // SLOT CLASS METHODS
 // ===============================================================================================
 
-bool KVSlot::empty() {
-    if (kv)
+bool KVSlot::empty() const {
+    if (kv || inlined())
         return false;
     else
         return true;
 }
 
+// Must run inside a transaction. The cell hash is cleared even when a buffer is set, as a crash
+// while a record moves between cell and buffer can leave a stale hash behind the buffer.
 void KVSlot::clear() {
     if (kv) {
-        char* p = kv.get();
-        set_ph_direct(p, 0);
-        set_ks_direct(p, 0);
-        set_vs_direct(p, 0);
+        char* p = kv.get();                                               // left intact if tx aborts
         delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
                                       get_vs_direct(p) + 2);
         kv = nullptr;
     }
+#if LEAF_INLINE_SIZE > 0
+    clear_cell();
+#endif
 }
 
-void KVSlot::set(const uint8_t hash, const string& key, const string& value) {
+void KVSlot::set(const uint8_t hash, const string& key, const string& value, const uint64_t flags) {
     if (kv) {
         char* p = kv.get();
         delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
                                       get_vs_direct(p) + 2);
     }
-    size_t ksize;
-    size_t vsize;
-    ksize = key.size();
-    vsize = value.size();
-    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    kv = make_persistent<char[]>(size);
-    char* p = kv.get();
-    set_ph_direct(p, hash);
+    const size_t size = buffer_size(key.size(), value.size());
+#if LEAF_INLINE_SIZE > 0
+    if (size <= LEAF_INLINE_SIZE) {
+        if (kv) kv = nullptr;
+        if (pmemobj_tx_add_range_direct(cell, size) != 0) {
+            throw pmem::transaction_error("failed to add cell to transaction");
+        }
+        fill_direct(cell, hash, key, value);
+        return;
+    }
+    clear_cell();
+#endif
+    const PMEMoid oid = pmemobj_tx_xalloc(size, 0, flags);
+    if (OID_IS_NULL(oid)) throw pmem::transaction_alloc_error("failed to allocate slot buffer");
+    kv = oid;
+    fill_direct(kv.get(), hash, key, value);
+}
+
+// An overwrite keeps the current buffer when the new value fits its usable size, as long as at
+// least half of the buffer stays in use, so shrinking a large value still releases the space.
+// Records small enough for the cell always stay in it, or move into it.
+bool KVSlot::fits(const string& value) const {
+    const size_t size = buffer_size(get_ks(), value.size());
+#if LEAF_INLINE_SIZE > 0
+    if (!kv) return size <= LEAF_INLINE_SIZE;
+    if (size <= LEAF_INLINE_SIZE) return false;
+#endif
+    const size_t usable = usable_size();
+    return size <= usable && usable <= size * 2;
+}
+
+// Only the value size and the value bytes being written are undo logged, so this must run
+// inside a transaction. Key and hash are unchanged.
+void KVSlot::set_in_place(const string& value) {
+    char* p = data();
+    char* vp = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t) + get_ks_direct(p) + 1;
+    const size_t vsize = value.size();
+    if (pmemobj_tx_add_range_direct(p + sizeof(uint32_t), sizeof(uint32_t)) != 0 ||
+        pmemobj_tx_add_range_direct(vp, vsize + 1) != 0) {
+        throw pmem::transaction_error("failed to add value to transaction");
+    }
+    set_vs_direct(p, (uint32_t) vsize);
+    memcpy(vp, value.data(), vsize);
+    vp[vsize] = 0;
+}
+
+// Fills a slot without a transaction. The new buffer is reserved, filled and persisted first,
+// then a single publish points the slot at it (and frees any old buffer), so after a crash the
+// slot holds either the old state or the new buffer, and no buffer is left unreferenced.
+// A small record is written to the cell with its hash last, which makes it visible unless a
+// buffer is still set, and the same publish then frees that buffer and clears the pointer.
+// Within an open transaction, as for a batch, the slot is filled transactionally instead.
+void KVSlot::set_atomic(PMEMobjpool* pop, const uint8_t hash, const string& key, const string& value,
+                        const uint64_t flags) {
+    if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+        set(hash, key, value, flags);
+        return;
+    }
+    const size_t size = buffer_size(key.size(), value.size());
+    pobj_action actions[3];
+    int count = 0;
+#if LEAF_INLINE_SIZE > 0
+    if (size <= LEAF_INLINE_SIZE) {
+        assert(!inlined());                                              // overwritten in place
+        char* hp = cell + sizeof(uint32_t) + sizeof(uint32_t);
+        fill_direct(cell, 0, key, value);
+        pmemobj_persist(pop, cell, size);
+        *hp = hash;
+        pmemobj_persist(pop, hp, sizeof(uint8_t));
+        if (!kv) return;
+        pmemobj_defer_free(pop, kv.raw(), &actions[count++]);
+        pmemobj_set_value(pop, &actions[count++], &kv.raw_ptr()->off, 0);
+        if (pmemobj_publish(pop, actions, count) != 0) {
+            pmemobj_cancel(pop, actions, count);
+            throw pmem::transaction_error("failed to publish slot cell");
+        }
+        return;
+    }
+#endif
+    const PMEMoid oid = pmemobj_xreserve(pop, &actions[count++], size, 0, flags);
+    if (OID_IS_NULL(oid)) throw pmem::transaction_alloc_error("failed to reserve slot buffer");
+    char* p = (char*) pmemobj_direct(oid);
+    fill_direct(p, hash, key, value);
+    pmemobj_persist(pop, p, size);
+    if (kv) {
+        pmemobj_defer_free(pop, kv.raw(), &actions[count++]);
+    } else {
+        pmemobj_set_value(pop, &actions[count++], &kv.raw_ptr()->pool_uuid_lo, oid.pool_uuid_lo);
+    }
+    pmemobj_set_value(pop, &actions[count++], &kv.raw_ptr()->off, oid.off);
+    if (pmemobj_publish(pop, actions, count) != 0) {
+        pmemobj_cancel(pop, actions, count);
+        throw pmem::transaction_error("failed to publish slot buffer");
+    }
+}
+
+#if LEAF_INLINE_SIZE > 0
+// Zeroing the hash is enough to mark the cell unused. Must run inside a transaction.
+void KVSlot::clear_cell() {
+    char* hp = cell + sizeof(uint32_t) + sizeof(uint32_t);
+    if (*hp == 0) return;
+    if (pmemobj_tx_add_range_direct(hp, sizeof(uint8_t)) != 0) {
+        throw pmem::transaction_error("failed to add cell to transaction");
+    }
+    *hp = 0;
+}
+#endif
+
+size_t KVSlot::usable_size() const {
+    return pmemobj_alloc_usable_size(kv.raw());
+}
+
+size_t KVSlot::buffer_size(const size_t ksize, const size_t vsize) {
+    return ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+}
+
+void KVSlot::fill_direct(char* p, const uint8_t hash, const string& key, const string& value) {
+    const size_t ksize = key.size();
+    const size_t vsize = value.size();
     set_ks_direct(p, (uint32_t) ksize);
     set_vs_direct(p, (uint32_t) vsize);
+    set_ph_direct(p, hash);
     char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
     memcpy(kvptr, key.data(), ksize);                                       // copy key into buffer
+    kvptr[ksize] = 0;
     kvptr += ksize + 1;                                                     // advance ptr past key
     memcpy(kvptr, value.data(), vsize);                                     // copy value into buffer
+    kvptr[vsize] = 0;
 }
 
 // ===============================================================================================
-// Node invariants
+// INNER NODE METHODS
 // ===============================================================================================
 
+// Separator keys in a node usually share their leading bytes, so each node tracks how many
+// bytes all of its keys have in common and keeps the next 8 bytes of every key as a big-endian
+// integer. Searches compare those integers and only touch the key arena when they tie.
+int KVInnerNode::compare(const int idx, const uint64_t kp, std::string_view k) const {
+    if (prefixes[idx] != kp) return prefixes[idx] < kp ? -1 : 1;
+    return key(idx).compare(k);
+}
+
+// Fixed-step binary search over the prefixes. The loop always runs log2(keycount) times and
+// picks the next half without an early exit, so the compiler can use a conditional move.
+uint16_t KVInnerNode::lower_bound(std::string_view k) const {
+    if (keycount == 0) return 0;
+    const int shared = k.substr(0, prefix_len).compare(key(0).substr(0, prefix_len));
+    if (shared != 0) return (uint16_t) (shared < 0 ? 0 : keycount);     // k outside node range
+    const uint64_t kp = normalize(k, prefix_len);
+    uint16_t base = 0;
+    uint16_t n = keycount;
+    while (n > 1) {
+        const uint16_t half = n / 2;
+        base = (compare(base + half, kp, k) < 0) ? base + half : base;
+        n -= half;
+    }
+    return base + (compare(base, kp, k) < 0);
+}
+
+uint16_t KVInnerNode::upper_bound(std::string_view k) const {
+    if (keycount == 0) return 0;
+    const int shared = k.substr(0, prefix_len).compare(key(0).substr(0, prefix_len));
+    if (shared != 0) return (uint16_t) (shared < 0 ? 0 : keycount);     // k outside node range
+    const uint64_t kp = normalize(k, prefix_len);
+    uint16_t base = 0;
+    uint16_t n = keycount;
+    while (n > 1) {
+        const uint16_t half = n / 2;
+        base = (compare(base + half, kp, k) <= 0) ? base + half : base;
+        n -= half;
+    }
+    return base + (compare(base, kp, k) <= 0);
+}
+
+void KVInnerNode::insert_key(const int idx, std::string_view k) {
+    for (int i = keycount; i > idx; i--) {
+        prefixes[i] = prefixes[i - 1];
+        offsets[i] = offsets[i - 1];
+        sizes[i] = sizes[i - 1];
+    }
+    offsets[idx] = (uint32_t) arena.size();                              // keys are only appended
+    sizes[idx] = (uint32_t) k.size();
+    arena.append(k.data(), k.size());
+    keycount++;
+    if (keycount == 1 || k.substr(0, prefix_len) != key(idx == 0 ? 1 : 0).substr(0, prefix_len)) {
+        refresh_prefixes();                                              // shared bytes shrank
+    } else {
+        prefixes[idx] = normalize(k, prefix_len);
+    }
+}
+
+void KVInnerNode::erase_key(const int idx) {
+    for (int i = idx; i + 1 < keycount; i++) {
+        prefixes[i] = prefixes[i + 1];
+        offsets[i] = offsets[i + 1];
+        sizes[i] = sizes[i + 1];
+    }
+    truncate_keys(keycount - 1);                                         // compacts arena too
+}
+
+void KVInnerNode::truncate_keys(const uint16_t count) {
+    string compacted;
+    for (int i = 0; i < count; i++) {
+        const uint32_t offset = (uint32_t) compacted.size();
+        compacted.append(arena, offsets[i], sizes[i]);
+        offsets[i] = offset;
+    }
+    arena = move(compacted);
+    keycount = count;
+    refresh_prefixes();                                                  // shared bytes may grow
+}
+
+void KVInnerNode::refresh_prefixes() {
+    prefix_len = 0;
+    if (keycount > 0) {                                                  // first & last share least
+        const std::string_view first = key(0);
+        const std::string_view last = key(keycount - 1);
+        const size_t limit = std::min(first.size(), last.size());
+        while (prefix_len < limit && first[prefix_len] == last[prefix_len]) prefix_len++;
+    }
+    for (int i = 0; i < keycount; i++) prefixes[i] = normalize(key(i), prefix_len);
+}
+
+// Loads up to 8 key bytes starting at offset, zero-padded, so that comparing the results as
+// integers orders keys the same way as comparing their bytes (with ties for equal bytes).
+uint64_t KVInnerNode::normalize(std::string_view k, const uint32_t offset) {
+    uint64_t word = 0;
+    if (offset < k.size()) memcpy(&word, k.data() + offset, std::min<size_t>(8, k.size() - offset));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
 void KVInnerNode::assert_invariants() {
     assert(keycount <= INNER_KEYS);
     for (auto i = 0; i < keycount; ++i) {
-        assert(keys[i].size() > 0);
+        assert(sizes[i] > 0);
+        assert(offsets[i] + sizes[i] <= arena.size());
+        assert(prefixes[i] == normalize(key(i), prefix_len));
+        assert(i == 0 || key(i - 1).compare(key(i)) <= 0);
         assert(children[i] != nullptr);
     }
     assert(children[keycount] != nullptr);
@@ -617,5 +1548,177 @@ void KVInnerNode::assert_invariants() {
         assert(children[i] == nullptr);
 }
 
+// ===============================================================================================
+// CURSOR METHODS
+// ===============================================================================================
+
+// A cursor follows leaf nodes through their neighbour links and keeps a copy of the slot order of
+// the current leaf. Puts and removes may reorder, split or merge leaves, and compaction may move
+// leaves and buffers, so each bumps the tree version, and a cursor that sees a new version seeks
+// its key again. If that key was removed in
+// the meantime, the cursor is at the next higher key, which Next then keeps and Prev steps back
+// from, so that neither skips a key.
+bool KVTreeIterator::Valid() {
+    Sync();
+    return leafnode != nullptr;
+}
+
+void KVTreeIterator::SeekToFirst() {
+    LoadLeaf(tree->LeafEdge(false), false);
+}
+
+void KVTreeIterator::SeekToLast() {
+    LoadLeaf(tree->LeafEdge(true), true);
+}
+
+void KVTreeIterator::Seek(const string& key) {
+    auto found = tree->LeafSearch(key);
+    if (!found) {
+        LoadLeaf(nullptr, false);
+        return;
+    }
+    const int found_count = found->sorted_slots(slots);
+    const auto first = std::lower_bound(slots, slots + found_count, key,
+                                        [found](const uint8_t slot, const string& k) {
+                                            return found->key(slot).compare(k) < 0;
+                                        });
+    if (first == slots + found_count) {                                  // all keys lower
+        LoadLeaf(found->next, false);
+        return;
+    }
+    version = tree->version;
+    leafnode = found;
+    count = found_count;
+    pos = (int) (first - slots);
+    current.assign(leafnode->key(slots[pos]));
+}
+
+void KVTreeIterator::Next() {
+    if (!leafnode || !Sync()) return;                                    // passed removed key
+    if (++pos < count) {
+        current.assign(leafnode->key(slots[pos]));
+    } else {
+        LoadLeaf(leafnode->next, false);
+    }
+}
+
+void KVTreeIterator::Prev() {
+    if (!leafnode) return;
+    if (!Sync() && !leafnode) {                                          // removed highest key
+        SeekToLast();
+        return;
+    }
+    if (pos > 0) {
+        current.assign(leafnode->key(slots[--pos]));
+    } else {
+        LoadLeaf(leafnode->prev, true);
+    }
+}
+
+std::string_view KVTreeIterator::key() {
+    Sync();
+    return current;
+}
+
+std::string_view KVTreeIterator::value() {
+    Sync();
+    auto& kvslot = leafnode->leaf->slots[slots[pos]].get_ro();
+    return std::string_view(kvslot.val(), kvslot.valsize());
+}
+
+bool KVTreeIterator::Sync() {
+    if (version == tree->version) return true;
+    version = tree->version;
+    if (!leafnode) return true;
+    string key;
+    key.swap(current);
+    Seek(key);
+    return leafnode && current == key;
+}
+
+// Leaves left empty (the top leaf, or any leaf without LEAF_MERGE) are passed over.
+void KVTreeIterator::LoadLeaf(KVLeafNode* first, const bool backward) {
+    version = tree->version;
+    for (leafnode = first; leafnode; leafnode = backward ? leafnode->prev : leafnode->next) {
+        count = leafnode->sorted_slots(slots);
+        if (count == 0) continue;
+        pos = backward ? count - 1 : 0;
+        current.assign(leafnode->key(slots[pos]));
+        return;
+    }
+}
+
+// ===============================================================================================
+// LEAF NODE METHODS
+// ===============================================================================================
+
+// With KVTREE2_LEAF_ARENA the keys of a leaf are packed into one string, so lookups never touch
+// pmem until a key matches. Without it only hashes live in DRAM and keys are read from the slots.
+std::string_view KVLeafNode::key(const int slot) const {
+#if KVTREE2_LEAF_ARENA
+    return std::string_view(arena.data() + offsets[slot], sizes[slot]);
+#else
+    auto& kvslot = leaf->slots[slot].get_ro();
+    return std::string_view(kvslot.key(), kvslot.keysize());
+#endif
+}
+
+void KVLeafNode::set_key(const int slot, std::string_view k) {
+    order_count = -1;
+#if KVTREE2_LEAF_ARENA
+    if (arena.size() + k.size() > arena.capacity()) {                    // drop cleared keys first
+        string compacted;
+        compacted.reserve(arena.size());
+        for (int i = 0; i < LEAF_KEYS; i++) {
+            if (i == slot || hashes[i] == 0) {
+                offsets[i] = sizes[i] = 0;
+                continue;
+            }
+            const uint32_t offset = (uint32_t) compacted.size();
+            compacted.append(arena, offsets[i], sizes[i]);
+            offsets[i] = offset;
+        }
+        arena = move(compacted);
+    }
+    offsets[slot] = (uint32_t) arena.size();
+    sizes[slot] = (uint32_t) k.size();
+    arena.append(k.data(), k.size());
+#endif
+}
+
+void KVLeafNode::clear_key(const int slot) {
+    order_count = -1;
+#if KVTREE2_LEAF_ARENA
+    offsets[slot] = sizes[slot] = 0;                                     // bytes reclaimed later
+#endif
+}
+
+int KVLeafNode::key_count() const {
+    int count = 0;
+    for (int slot = 0; slot < LEAF_KEYS; slot++) if (hashes[slot] != 0) count++;
+    return count;
+}
+
+int KVLeafNode::sorted_slots(uint8_t* slots) {
+    if (order_count < 0) {                                               // sort again after changes
+        int count = 0;
+        for (int slot = 0; slot < LEAF_KEYS; slot++) if (hashes[slot] != 0) order[count++] = slot;
+        std::sort(order, order + count, [this](const uint8_t lhs, const uint8_t rhs) {
+            return key(lhs).compare(key(rhs)) < 0;
+        });
+        order_count = count;
+    }
+    memcpy(slots, order, order_count);
+    return order_count;
+}
+
+size_t KVLeafNode::dram_bytes() const {
+#if KVTREE2_LEAF_ARENA
+    return sizeof(KVLeafNode) + arena.capacity();
+#else
+    return sizeof(KVLeafNode);
+#endif
+}
+
 } // namespace kvtree
 } // namespace pmemkv
@@ -32,6 +32,7 @@
 
 #pragma once
 
+#include <string_view>
 #include <vector>
 #include "../pmemkv.h"
 
@@ -51,50 +52,138 @@ namespace kvtree2 {
 
 const string ENGINE = "kvtree2";                           // engine identifier
 
-#define INNER_KEYS 4                                       // maximum keys for inner nodes
+#ifndef INNER_KEYS
+#define INNER_KEYS 64                                      // maximum keys for inner nodes
+#endif
 #define INNER_KEYS_MIDPOINT (INNER_KEYS / 2)               // halfway point within the node
 #define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
 #define LEAF_KEYS 48                                       // maximum keys in tree nodes
 #define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)                 // halfway point within the node
 
+#ifndef LEAF_MERGE
+#define LEAF_MERGE 1                                       // merge sparse leaves after removes
+#endif
+#define LEAF_KEYS_UNDERFLOW (LEAF_KEYS / 4)                // fewer keys make a leaf sparse
+#define LEAF_KEYS_MERGED (LEAF_KEYS * 3 / 4)               // most keys in a merged leaf
+#define INNER_KEYS_UNDERFLOW (INNER_KEYS / 4)              // fewer keys make an inner node sparse
+#define INNER_KEYS_MERGED (INNER_KEYS * 3 / 4)             // most keys in a merged inner node
+
+#ifndef RECOVERY_THREADS
+#define RECOVERY_THREADS 0                                 // threads used by recovery (0 for all cores)
+#endif
+#define RECOVERY_LEAVES_PER_THREAD 256                     // fewest leaves worth another thread
+#ifndef RECOVERY_SNAPSHOT
+#define RECOVERY_SNAPSHOT 1                                // save leaf directory on clean close
+#endif
+#ifndef RECOVERY_FILL_PERCENT
+#define RECOVERY_FILL_PERCENT 80                           // share of inner keys filled by recovery
+#endif
+
+#ifndef KVTREE2_LEAF_ARENA
+#define KVTREE2_LEAF_ARENA 1                               // copy leaf keys to DRAM (0 reads pmem)
+#endif
+
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 1024                                 // largest slot buffer in a size class (0 off)
+#endif
+#define SLAB_MIN_SIZE 32                                   // smallest size class for slot buffers
+#define SLAB_UNITS_PER_BLOCK 1024                          // units carved from each slab run
+#define SLAB_CLASS_ID_FIRST 200                            // first pool allocation class id used
+
+#ifndef LEAF_INLINE_SIZE
+#define LEAF_INLINE_SIZE 0                                 // bytes for records kept in slots (0 off)
+#endif
+
+#ifndef COMPACT_STEP_OBJECTS
+#define COMPACT_STEP_OBJECTS 256                           // objects offered by each compact step
+#endif
+
+#ifndef MULTIGET_GROUP
+#define MULTIGET_GROUP 16                                  // keys looked up in lockstep by MultiGet
+#endif
+
+static_assert(LEAF_KEYS <= 64, "leaf hash masks are limited to 64 slots");
+static_assert(INNER_KEYS >= 2 && INNER_KEYS < 0xFFFF, "inner key count must fit in uint16_t");
+static_assert(RECOVERY_FILL_PERCENT > 0 && RECOVERY_FILL_PERCENT <= 100, "fill must be a percentage");
+static_assert(LEAF_INLINE_SIZE % 8 == 0, "inline cells keep slots 8-byte aligned");
+static_assert(MULTIGET_GROUP > 0, "lookups need a group of at least one key");
+static_assert((SLAB_MIN_SIZE & (SLAB_MIN_SIZE - 1)) == 0, "size classes start at a power of two");
+
 class KVSlot {
   public:
     uint8_t hash() const { return get_ph(); }
     uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))); }
-    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    const char* key() const { return (data() + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
     const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
     const uint32_t keysize() const { return get_ks(); }
     const uint32_t keysize_direct(char *p) const { return *((uint32_t *)(p)); }
-    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
+    const char* val() const { return (data() + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
     const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
     const uint32_t valsize() const { return get_vs(); }
     const uint32_t valsize_direct(char *p) const { return *((uint32_t *)(p + sizeof(uint32_t))); }
     void clear();
-    void set(const uint8_t hash, const string& key, const string& value);
-    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set(const uint8_t hash, const string& key, const string& value, const uint64_t flags);
+    bool fits(const string& value) const;
+    void set_in_place(const string& value);
+    void set_atomic(PMEMobjpool* pop, const uint8_t hash, const string& key, const string& value,
+                    const uint64_t flags);
+    void set_ph(uint8_t v) {*((uint8_t *)(data() + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
     void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
-    void set_ks(uint32_t v) {*((uint32_t *)(kv.get())) = v;}
+    void set_ks(uint32_t v) {*((uint32_t *)(data())) = v;}
     void set_ks_direct(char * p, uint32_t v) {*((uint32_t *)(p)) = v;}
-    void set_vs(uint32_t v) {*((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t))) = v;}
+    void set_vs(uint32_t v) {*((uint32_t *)(data() + sizeof(uint32_t))) = v;}
     void set_vs_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t))) = v;}
-    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint8_t get_ph() const {return *((uint8_t *)(data() + sizeof(uint32_t) + sizeof(uint32_t)));}
     uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
-    uint32_t get_ks() const {return *((uint32_t *)(kv.get()));}
+    uint32_t get_ks() const {return *((uint32_t *)(data()));}
     uint32_t get_ks_direct(char *p) const {return *((uint32_t *)(p));}
-    uint32_t get_vs() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t)));}
+    uint32_t get_vs() const {return *((uint32_t *)(data() + sizeof(uint32_t)));}
     uint32_t get_vs_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t)));}
-    bool empty();
+    bool empty() const;
+    bool inlined() const;
+    size_t usable_size() const;
+    PMEMoid* buffer_oid() { return kv.raw_ptr(); }         // only reference to buffer
+    static size_t buffer_size(size_t ksize, size_t vsize);
   private:
+    void fill_direct(char* p, uint8_t hash, const string& key, const string& value);
+    char* data() const;                                    // key & value, inline or out of line
+#if LEAF_INLINE_SIZE > 0
+    void clear_cell();                                     // mark inline record unused
+#endif
     persistent_ptr<char[]> kv;                             // buffer for key & value
+#if LEAF_INLINE_SIZE > 0
+    char cell[LEAF_INLINE_SIZE] = {};                      // small key & value stored in slot
+#endif
 };
 
+#if LEAF_INLINE_SIZE > 0
+// A record is inline when no buffer is set and the hash in its cell is not zero. A buffer takes
+// precedence, so a stale cell is ignored until the slot is next cleared.
+inline bool KVSlot::inlined() const { return !kv && cell[sizeof(uint32_t) + sizeof(uint32_t)] != 0; }
+inline char* KVSlot::data() const { return kv ? kv.get() : (char*) cell; }
+#else
+inline bool KVSlot::inlined() const { return false; }
+inline char* KVSlot::data() const { return kv.get(); }
+#endif
+
 struct KVLeaf {
     p<KVSlot> slots[LEAF_KEYS];                            // array of slot containers
     persistent_ptr<KVLeaf> next;                           // next leaf in unsorted list
 };
 
+const uint64_t SNAPSHOT_FORMAT =                           // identifies current leaf directory
+    (0x534E4150ULL << 32) | (LEAF_KEYS << 8) | KVTREE2_LEAF_ARENA;
+
+struct KVDirectory {                                       // leaf directory from clean close
+    p<uint64_t> format;                                    // SNAPSHOT_FORMAT when written
+    p<uint64_t> run_id;                                    // pool run that wrote it
+    p<uint64_t> size;                                      // bytes in contents
+    persistent_ptr<char[]> contents;                       // serialized leaf directory
+};
+
 struct KVRoot {                                            // persistent root object
     persistent_ptr<KVLeaf> head;                           // head of linked list of leaves
+    persistent_ptr<KVDirectory> directory;                 // saved leaf directory, or null
 };
 
 struct KVInnerNode;
@@ -106,16 +195,48 @@ struct KVNode {                                            // volatile nodes of
 };
 
 struct KVInnerNode final : KVNode {                        // volatile inner nodes of the tree
-    uint8_t keycount;                                      // count of keys in this node
-    string keys[INNER_KEYS + 1];                           // child keys plus one overflow slot
+    uint16_t keycount = 0;                                 // count of keys in this node
+    uint32_t prefix_len = 0;                               // leading bytes shared by all keys
+    uint64_t prefixes[INNER_KEYS + 1];                     // next 8 key bytes after shared ones
+    uint32_t offsets[INNER_KEYS + 1];                      // key offsets into arena plus overflow
+    uint32_t sizes[INNER_KEYS + 1];                        // key sizes plus one overflow slot
+    string arena;                                          // contiguous bytes of all keys
     unique_ptr<KVNode> children[INNER_KEYS + 2];           // child nodes plus one overflow slot
+    std::string_view key(int idx) const {                  // key at index, backed by arena
+        return std::string_view(arena.data() + offsets[idx], sizes[idx]);
+    }
+    int compare(int idx,                                   // order of key at index against k
+                uint64_t kp,
+                std::string_view k) const;
+    uint16_t lower_bound(std::string_view k) const;        // index of first key not less than k
+    uint16_t upper_bound(std::string_view k) const;        // index of first key greater than k
+    void insert_key(int idx, std::string_view k);          // insert key at index, shifting up
+    void erase_key(int idx);                               // remove key at index, shifting down
+    void truncate_keys(uint16_t count);                    // keep lowest keys, compacting arena
+    void refresh_prefixes();                               // recompute shared length & prefixes
+    static uint64_t normalize(std::string_view k,          // big-endian integer of 8 key bytes
+                              uint32_t offset);
     void assert_invariants();
 };
 
 struct KVLeafNode final : KVNode {                         // volatile leaf nodes of the tree
     uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
-    string keys[LEAF_KEYS];                                // keys stored in this leaf
+#if KVTREE2_LEAF_ARENA
+    uint32_t offsets[LEAF_KEYS];                           // key offsets into arena
+    uint32_t sizes[LEAF_KEYS];                             // key sizes (zero when unused)
+    string arena;                                          // contiguous bytes of leaf keys
+#endif
     persistent_ptr<KVLeaf> leaf;                           // pointer to persistent leaf
+    KVLeafNode* prev = nullptr;                            // neighbouring leaf with lower keys
+    KVLeafNode* next = nullptr;                            // neighbouring leaf with higher keys
+    uint8_t order[LEAF_KEYS];                              // occupied slots in key order
+    int8_t order_count = -1;                               // slots in order (-1 when stale)
+    std::string_view key(int slot) const;                  // key for occupied slot
+    void set_key(int slot, std::string_view k);            // remember key for slot
+    void clear_key(int slot);                              // forget key for slot
+    int key_count() const;                                 // count of occupied slots
+    size_t dram_bytes() const;                             // volatile bytes held by this leaf
+    int sorted_slots(uint8_t* slots);                      // copy order of slots, return count
 };
 
 struct KVRecoveredLeaf {                                   // temporary wrapper used for recovery
@@ -123,10 +244,24 @@ struct KVRecoveredLeaf {                                   // temporary wrapper
     string max_key;                                        // highest sorting key present
 };
 
+struct KVSlabClass {                                       // allocation class for slot buffers
+    size_t unit_size;                                      // bytes in every unit of the class
+    unsigned class_id;                                     // id registered with the pool
+};
+
 struct KVTreeAnalysis {                                    // tree analysis structure
     size_t leaf_empty;                                     // count of persisted leaves w/o keys
     size_t leaf_prealloc;                                  // count of persisted but unused leaves
     size_t leaf_total;                                     // count of all persisted leaves
+    size_t inner_depth;                                    // count of inner levels above leaves
+    size_t inner_total;                                    // count of volatile inner nodes
+    size_t dram_per_key;                                   // volatile tree bytes per key
+    size_t slab_buffers;                                   // count of slot buffers in size classes
+    size_t slab_fill_percent;                              // share of their units holding data
+    size_t inline_records;                                 // count of records kept in slot cells
+    size_t compact_passes;                                 // compaction passes over all leaves
+    size_t compact_relocated;                              // objects moved by compaction
+    size_t fragmentation_percent;                          // share of active runs not allocated
     string path;                                           // path when constructed
 };
 
@@ -145,9 +280,16 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
                  char* value) final;
     KVStatus Get(const string& key,                        // append value to std::string
                  string* value) final;
+    KVStatus Get(void* context,                            // pass value in place to callback
+                 const string& key,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // get values for many keys at once
+                  vector<string>& values,
+                  vector<KVStatus>& statuses) final;
     KVStatus Put(const string& key,                        // copy value from std::string
                  const string& value) final;
     KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Write(const KVWriteBatch& batch) final;       // apply batch in one transaction
 
     void Free() final;
 
@@ -155,15 +297,50 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
     PMEMobjpool* GetPool() final;
 
     void Analyze(KVTreeAnalysis& analysis);                // report on internal state & stats
+    bool Compact(size_t objects = COMPACT_STEP_OBJECTS);   // relocate some objects, true at end
 
     void ListAllKeyValuePairs(vector<string>& kv_pairs) final;      // list all the key value pairs
 
     void ListAllKeys(vector<string>& keys) final;      // list all the keys
 
-    size_t TotalNumKeys() final;
+    void ListKeyValuePairsBetween(const string& from,      // list pairs from <= key < to
+                                  const string& to,
+                                  vector<string>& kv_pairs) final;
+
+    size_t TotalNumKeys() final;                           // get total number of keys
+
+    KVIterator* NewIterator() final;                       // new cursor over leaves in key order
+
+    void Each(void* context,                               // pass every pair to callback
+              KVEachCallback* callback) final;
+    void EachAbove(void* context,                          // pass pairs with key above given key
+                   const string& key,
+                   KVEachCallback* callback) final;
+    void EachBelow(void* context,                          // pass pairs with key below given key
+                   const string& key,
+                   KVEachCallback* callback) final;
+    void EachBetween(void* context,                        // pass pairs with key1 < key < key2
+                     const string& key1,
+                     const string& key2,
+                     KVEachCallback* callback) final;
 
   protected:
+    friend class KVTreeIterator;
+    void PutKey(const string& key,                         // put without catching failures
+                const string& value);
+    void RemoveKey(const string& key);                     // remove without catching failures
+    void RebuildIndex();                                   // rebuild volatile nodes from leaves
+    template <typename F>
+    void LeafAddTx(F&& body);                              // run body, rebuilding if it aborts
     KVLeafNode* LeafSearch(const string& key);             // find node for key
+    KVLeafNode* LeafEdge(bool highest);                    // find node for lowest or highest keys
+    const KVSlot* LeafFindSlotForKey(KVLeafNode* leafnode, // find slot for matching key if present
+                                     uint8_t hash,
+                                     const string& key);
+    void EachInRange(const string* above,                  // pass pairs between keys (null open)
+                     const string* below,
+                     void* context,
+                     KVEachCallback* callback);
     void LeafFillEmptySlot(KVLeafNode* leafnode,           // write first unoccupied slot found
                            uint8_t hash,
                            const string& key,
@@ -184,9 +361,23 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
     void InnerUpdateAfterSplit(KVNode* node,               // update parents after leaf split
                                unique_ptr<KVNode> newnode,
                                string* split_key);
+    void LeafMergeSparse(KVLeafNode* leafnode);            // merge leaf into neighbour if sparse
+    void InnerUpdateAfterMerge(KVInnerNode* inner,         // update parents after merging nodes
+                               uint16_t idx);
+    void InnerBulkLoad(vector<KVRecoveredLeaf>& leaves);   // pack sorted leaves bottom-up
     uint8_t PearsonHash(const char* data,                  // calculate 1-byte hash for string
                         size_t size);
+    uint64_t LeafHashMask(const uint8_t* hashes,           // bitmask of slots matching hash
+                          uint8_t hash);
     void Recover();                                        // reload state from persistent pool
+    void RecoverLeaves(vector<KVRecoveredLeaf>& leaves);   // scan persistent leaves
+    bool RecoverSnapshot(vector<KVRecoveredLeaf>& leaves); // load leaf directory if valid
+    void SaveSnapshot();                                   // write leaf directory on close
+    void DiscardSnapshot();                                // invalidate leaf directory
+    void SlabRegister();                                   // register size classes with pool
+    uint64_t SlabFlags(size_t ksize, size_t vsize);        // allocation flags for slot buffer
+    size_t CompactLeaf(persistent_ptr<KVLeaf>& link);      // relocate leaf & buffers, return count
+    void CompactObjects(vector<PMEMoid*>& references);     // relocate objects with all references
   private:
     KVTree(const KVTree&);                                 // prevent copying
     void operator=(const KVTree&);                         // prevent assigning
@@ -194,6 +385,36 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
     const string pmpath;                                   // path when constructed
     pool<KVRoot> pmpool;                                   // pool for persistent root
     unique_ptr<KVNode> tree_top;                           // pointer to uppermost inner node
+    vector<KVSlabClass> slab_classes;                      // size classes by unit, empty if off
+    persistent_ptr<KVLeaf> compact_prev;                   // leaf compacted last (null at start)
+    size_t compact_passes = 0;                             // compaction passes finished
+    size_t compact_relocated = 0;                          // objects moved by compaction
+    uint64_t version = 0;                                  // bumped by every change to nodes
+    size_t total_keys = 0;                                 // occupied slots in volatile leaves
+};
+
+class KVTreeIterator final : public KVIterator {           // cursor over volatile leaf nodes
+  public:
+    explicit KVTreeIterator(KVTree* tree) : tree(tree) {}
+    bool Valid() final;                                    // positioned at a pair
+    void SeekToFirst() final;                              // position at lowest key
+    void SeekToLast() final;                               // position at highest key
+    void Seek(const string& key) final;                    // position at first key not below key
+    void Next() final;                                     // move to next higher key
+    void Prev() final;                                     // move to next lower key
+    std::string_view key() final;                          // key at position, valid until moved
+    std::string_view value() final;                        // value in place, valid until changed
+  private:
+    bool Sync();                                           // seek key again, false if removed
+    void LoadLeaf(KVLeafNode* first,                       // position at edge of leaf with keys
+                  bool backward);
+    KVTree* const tree;                                    // tree walked by cursor
+    KVLeafNode* leafnode = nullptr;                        // leaf at position, null when invalid
+    uint8_t slots[LEAF_KEYS];                              // occupied slots of leaf in key order
+    int count = 0;                                         // count of slots in order
+    int pos = 0;                                           // position within slots
+    uint64_t version = 0;                                  // tree version when positioned
+    string current;                                        // key at position
 };
 
 } // namespace kvtree
@@ -32,10 +32,17 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
+#include <functional>
 #include <iostream>
-#include <list>
+#include <iterator>
+#include <thread>
 #include <unistd.h>
+#include <libpmemobj.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "mvtree.h"
 
 #define DO_LOG 0
@@ -46,6 +53,12 @@ namespace mvtree {
 
 
 static const string PMPATH_NO_PATH = "nopath";
+
+struct ReadersExcluded {                                                 // ends ReadersExclude
+  std::atomic<bool> &writing;                                            // flag it set
+  ~ReadersExcluded() { writing.store(false, std::memory_order_release); }
+};
+
 // ===============================================================================================
 // MVTree METHODS
 // ===============================================================================================
@@ -55,15 +68,16 @@ static const string PMPATH_NO_PATH = "nopath";
 MVTree::MVTree (const string& path, size_t size, const string& layout): pmpath(path) {
   if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
     LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
-    pool<MVRoot> pop = pool<MVRoot>::create(path.c_str(), layout, size, S_IRWXU);
+    pool<MVPoolRoot> pop = pool<MVPoolRoot>::create(path.c_str(), layout, size, S_IRWXU);
     pmpool = pop;
-    kv_root = pop.get_root();
+    pool_root = pop.get_root();
   } else {
     LOG("Opening pool, path=" << path);
-    pool<MVRoot> pop = pool<MVRoot>::open(path.c_str(), layout);
+    pool<MVPoolRoot> pop = pool<MVPoolRoot>::open(path.c_str(), layout);
     pmpool = pop;
-    kv_root = pop.get_root();
+    pool_root = pop.get_root();
   }
+  kv_root = pool_root.raw();                                             // tree is first member
   Recover();
   LOG("Opened ok");
 }
@@ -74,8 +88,9 @@ MVTree::MVTree (PMEMobjpool* pop): pmpool(pop), pmpath(PMPATH_NO_PATH) {
   assert(pop != nullptr);
 
   LOG("retrieve or create root object of pmem"); 
-  pool<MVRoot> popMV(pmpool);
-  kv_root = popMV.get_root();
+  pool<MVPoolRoot> popMV(pmpool);
+  pool_root = popMV.get_root();
+  kv_root = pool_root.raw();                                             // tree is first member
   LOG("pop=" << pop << ", oid=" << kv_root.raw().off);
 
   Recover();
@@ -105,6 +120,9 @@ MVTree::MVTree (PMEMobjpool* pop, const PMEMoid& oid): pmpool(pop), pmpath(PMPAT
 
 MVTree::~MVTree() {
   LOG("Closing");
+  CompactInBackground(0);
+  WaitForRecovery();
+  if (kv_root != nullptr) SaveSnapshot();                                // unless freed
   if(PMPATH_NO_PATH != pmpath) {
     pmpool.close();
   }
@@ -131,213 +149,391 @@ PMEMobjpool* MVTree::GetPool() {
 
 void MVTree::Analyze(MVTreeAnalysis &analysis) {
   LOG("Analyzing");
-  
-  std::shared_lock<std::shared_mutex> lock(shared_mutex);
+  WaitForRecovery();
+  std::unique_lock<std::shared_mutex> lock(shared_mutex);                // leaf writers share it
   analysis.leaf_empty = 0;
   analysis.leaf_prealloc = leaves_prealloc.size();
   analysis.leaf_total = 0;
   analysis.path = pmpath;
+  analysis.slab_buffers = 0;
+  analysis.inline_records = 0;
+  analysis.combined_commits = combine_commits;
+  analysis.combined_writes = combine_writes;
+  size_t slab_used = 0;
+  size_t slab_held = 0;
 
   // iterate persistent leaves for stats
   auto leaf = kv_root->head;
   while (leaf) {
     bool empty = true;
     for (int slot = LEAF_KEYS; slot--;) {
-      if (!leaf->slots[slot].get_rw().empty()) {
-        empty = false;
-        break;
+      auto& kvslot = leaf->slots[slot].get_rw();
+      if (kvslot.empty()) continue;
+      empty = false;
+      if (kvslot.inlined()) {
+        analysis.inline_records++;
+      } else if (SlabFlags(kvslot.keysize(), kvslot.valsize()) != 0) {
+        analysis.slab_buffers++;
+        slab_used += MVSlot::buffer_size(kvslot.keysize(), kvslot.valsize());
+        slab_held += kvslot.usable_size();
       }
     }
     if (empty) analysis.leaf_empty++;
     analysis.leaf_total++;
     leaf = leaf->next;  // advance to next linked leaf
   }
+
+  // walk volatile nodes for depth & memory stats
+  analysis.inner_depth = 0;
+  analysis.inner_total = 0;
+  MVNode *node = tree_top.get();
+  while (node && !node->is_leaf) {
+    node = ((MVInnerNode *) node)->children[0].get();
+    analysis.inner_depth++;
+  }
+  size_t dram_bytes = 0;
+  size_t keys = 0;
+  vector<MVNode *> pending;
+  if (tree_top) pending.push_back(tree_top.get());
+  while (!pending.empty()) {
+    auto next = pending.back();
+    pending.pop_back();
+    if (next->is_leaf) {
+      auto leafnode = (MVLeafNode *) next;
+      dram_bytes += leafnode->dram_bytes();
+      for (int slot = LEAF_KEYS; slot--;) if (leafnode->hashes[slot] != 0) keys++;
+      continue;
+    }
+    auto inner = (MVInnerNode *) next;
+    analysis.inner_total++;
+    dram_bytes += sizeof(MVInnerNode) + inner->arena.capacity();
+    for (int i = 0; i <= inner->keycount; i++) pending.push_back(inner->children[i].get());
+  }
+  analysis.dram_per_key = keys > 0 ? dram_bytes / keys : 0;
+  analysis.slab_fill_percent = slab_held > 0 ? slab_used * 100 / slab_held : 0;
+
+  // heap statistics for space held by runs but not allocated
+  analysis.compact_passes = compact_passes;
+  analysis.compact_relocated = compact_relocated;
+  uint64_t run_allocated = 0;
+  uint64_t run_active = 0;
+  pmemobj_ctl_get(pmpool.get_handle(), "stats.heap.run_allocated", &run_allocated);
+  pmemobj_ctl_get(pmpool.get_handle(), "stats.heap.run_active", &run_active);
+  analysis.fragmentation_percent = run_active > run_allocated ? 100 - run_allocated * 100 / run_active : 0;
   LOG("Analyzed ok");
 }
 
+// Each call moves on through the persistent list of leaves from where the last one stopped, and
+// returns after offering at least the given number of objects. The unique lock is taken for one
+// leaf at a time, and lock-free readers are turned away while it is held, so writers and readers
+// get in between leaves. A pass ends when the list does, and the next call starts over.
+bool MVTree::Compact(const size_t objects) {
+  LOG("Compacting, objects=" << objects);
+  WaitForRecovery();
+  size_t offered = 0;
+  while (offered < objects) {
+    std::unique_lock<std::shared_mutex> lock(shared_mutex);
+    ReadersExclude(tree_writing, nullptr);
+    ReadersExcluded excluded{tree_writing};
+    if (kv_root == nullptr) return true;                                 // freed
+    auto &link = compact_prev ? compact_prev->next : kv_root->head;
+    if (!link) {
+      LOG("   finished pass, relocated=" << compact_relocated);
+      compact_prev = nullptr;
+      compact_passes++;
+      return true;
+    }
+    offered += CompactLeaf(link);
+    compact_prev = link;                                                 // as relocated
+  }
+  LOG("Compacted ok");
+  return false;
+}
+
+// Starts a thread that calls Compact for COMPACT_STEP_OBJECTS objects at a time, sleeping between
+// steps so that no more than the given number of objects are offered per second on average.
+// A rate of zero stops the thread. Not to be called by several threads at once.
+void MVTree::CompactInBackground(const size_t objects_per_second) {
+  LOG("Compacting in background, objects_per_second=" << objects_per_second);
+  {
+    std::lock_guard<std::mutex> lock(compact_mutex);
+    compact_rate = objects_per_second;
+  }
+  compact_wake.notify_all();
+  if (objects_per_second == 0) {
+    if (compact_thread.joinable()) compact_thread.join();
+  } else if (!compact_thread.joinable()) {
+    compact_thread = std::thread([this] { CompactLoop(); });
+  }
+}
+
 
  
+// Volatile leaves are walked under the shared tree lock, each under its own leaf lock, as for
+// ListKeyValuePairsBetween, so only writers that change the shape of the tree wait. Pairs come in
+// leaf order, but slot order within each leaf.
 void MVTree::ListAllKeyValuePairs(vector<string>& kv_pairs) {
     LOG("Listing");
-
+    WaitForRecovery();
     std::shared_lock<std::shared_mutex> lock(shared_mutex);
-    // iterate persistent leaves for stats
-    auto leaf = kv_root->head;
-    while (leaf) {
+    for (auto leafnode = LeafEdge(false); leafnode; leafnode = leafnode->next) {
+        std::shared_lock<std::shared_mutex> leaflock(leafnode->mutex);
         for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
-            if (!kvslot.empty()) {
-              kv_pairs.push_back(string(kvslot.key(), kvslot.keysize()));
-              kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
-            }
+            if (leafnode->hashes[slot] == 0) continue;
+            auto& kvslot = leafnode->leaf->slots[slot].get_ro();
+            kv_pairs.push_back(string(leafnode->key(slot)));
+            kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
         }
-        leaf = leaf->next;  // advance to next linked leaf
     }
     LOG("List ok");
 }
 
 void MVTree::ListAllKeys(vector<string>& keys) {
     LOG("Listing");
-
+    WaitForRecovery();
     std::shared_lock<std::shared_mutex> lock(shared_mutex);
-    // iterate persistent leaves for stats
-    auto leaf = kv_root->head;
-    while (leaf) {
+    for (auto leafnode = LeafEdge(false); leafnode; leafnode = leafnode->next) {
+        std::shared_lock<std::shared_mutex> leaflock(leafnode->mutex);
         for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
-            if (!kvslot.empty()) {
-              keys.push_back(string(kvslot.key(), kvslot.keysize()));
-            }
+            if (leafnode->hashes[slot] != 0) keys.push_back(string(leafnode->key(slot)));
         }
-        leaf = leaf->next;  // advance to next linked leaf
     }
     LOG("List ok");
 }
 
-size_t MVTree::TotalNumKeys() {
-    size_t size = 0;
-
+void MVTree::ListKeyValuePairsBetween(const string& from, const string& to,
+                                      vector<string>& kv_pairs) {
+    LOG("Listing from=" << from << ", to=" << to);
+    WaitForRecovery();
     std::shared_lock<std::shared_mutex> lock(shared_mutex);
-    LOG("Getting size");
-    // iterate persistent leaves for stats
-    auto leaf = kv_root->head;
-    while (leaf) {
-        for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
-            if (!kvslot.empty()) {
-              ++size;
+    uint8_t slots[LEAF_KEYS];
+    for (auto leafnode = LeafSearch(from); leafnode; leafnode = leafnode->next) {
+        std::shared_lock<std::shared_mutex> leaflock(leafnode->mutex);
+        const int count = leafnode->sorted_slots(slots);
+        for (int i = 0; i < count; i++) {
+            const std::string_view key = leafnode->key(slots[i]);
+            if (key.compare(from) < 0) continue;
+            if (key.compare(to) >= 0) {
+                LOG("List ok");
+                return;
             }
+            auto& kvslot = leafnode->leaf->slots[slots[i]].get_ro();
+            kv_pairs.push_back(string(key));
+            kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
         }
-        leaf = leaf->next;  // advance to next linked leaf
     }
-    LOG("Getting size ok");
-    return size;
+    LOG("List ok");
 }
 
+// Counted as slots are filled and cleared, and again from the leaves whenever the index is built,
+// so no lock is needed. Writers in flight may or may not be counted yet.
+size_t MVTree::TotalNumKeys() {
+  WaitForRecovery();
+  return total_keys;
+}
+
+KVIterator* MVTree::NewIterator() {
+    return new MVTreeIterator(this);
+}
+
+void MVTree::Each(void* context, KVEachCallback* callback) {
+  LOG("Each");
+  EachInRange(nullptr, nullptr, context, callback);
+}
+
+void MVTree::EachAbove(void* context, const string& key, KVEachCallback* callback) {
+  LOG("Each above key=" << key);
+  EachInRange(&key, nullptr, context, callback);
+}
+
+void MVTree::EachBelow(void* context, const string& key, KVEachCallback* callback) {
+  LOG("Each below key=" << key);
+  EachInRange(nullptr, &key, context, callback);
+}
+
+void MVTree::EachBetween(void* context, const string& key1, const string& key2,
+                         KVEachCallback* callback) {
+  LOG("Each between key1=" << key1 << ", key2=" << key2);
+  EachInRange(&key1, &key2, context, callback);
+}
 
 KVStatus MVTree::Get(const int32_t limit, const int32_t keybytes, int32_t *valuebytes,
                          const char *key, char *value) {
 
-  std::shared_lock<std::shared_mutex> lock(shared_mutex);
   auto ckey = std::string(key, keybytes);
   LOG("Get for key=" << ckey);
-  auto leafnode = LeafSearch(ckey);
-  if (leafnode) {
-    const uint8_t hash = PearsonHash(key, (size_t) keybytes);
-    for (int slot = LEAF_KEYS; slot--;) {
-      if (leafnode->hashes[slot] == hash) {
-        if (leafnode->keys[slot].compare(ckey) == 0) {
-          auto kv = leafnode->leaf->slots[slot].get_ro();
-          auto vs = kv.valsize();
-          *valuebytes = vs;
-          if (vs <= limit) {
-            LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
-            memcpy(value, kv.val(), vs);
-            return OK;
-          } else {
-            LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
-            return FAILED;
-          }
-        }
-      }
+  KVStatus status = NOT_FOUND;
+  const auto read = [&](const MVSlot *kvslot) {
+    if (!kvslot) return;
+    auto vs = kvslot->valsize();
+    *valuebytes = vs;
+    if (vs <= limit) {
+      LOG("   found value, size=" << to_string(vs));
+      memcpy(value, kvslot->val(), vs);
+      status = OK;
+    } else {
+      LOG("   buffer too small, size=" << to_string(vs));
+      status = FAILED;
     }
+  };
+  if (!SlotRead(ckey, read)) {
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    std::shared_lock<std::shared_mutex> leaflock;
+    read(SlotSearch(ckey, leaflock));
   }
-  LOG("   could not find key");
-  return NOT_FOUND;
+  if (status == NOT_FOUND) LOG("   could not find key");
+  return status;
 }
 
 KVStatus MVTree::Get(const string &key, string *value) {
   LOG("Get for key=" << key.c_str());
 
+  KVStatus status = NOT_FOUND;
+  const auto read = [&](const MVSlot *kvslot) {
+    if (!kvslot) return;
+    LOG("   found value, size=" << to_string(kvslot->valsize()));
+    value->append(kvslot->val(), kvslot->valsize());
+    status = OK;
+  };
+  if (!SlotRead(key, read)) {
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    std::shared_lock<std::shared_mutex> leaflock;
+    read(SlotSearch(key, leaflock));
+  }
+  if (status == NOT_FOUND) LOG("   could not find key");
+  return status;
+}
+
+// The callback runs while the value is read, so it sees the value in its slot without a copy.
+// Lock-free readers keep their announcement and locked readers keep the leaf lock until it
+// returns, which holds back writers to that leaf, so the callback must be short and must not call
+// the tree at all. Even a read from it may wait on a writer that is waiting for this reader.
+KVStatus MVTree::Get(void *context, const string &key, KVGetCallback *callback) {
+  LOG("Get in place for key=" << key.c_str());
+
+  KVStatus status = NOT_FOUND;
+  const auto read = [&](const MVSlot *kvslot) {
+    if (!kvslot) return;
+    LOG("   found value, size=" << to_string(kvslot->valsize()));
+    callback(context, (int32_t) kvslot->valsize(), kvslot->val());
+    status = OK;
+  };
+  if (!SlotRead(key, read)) {
+    std::shared_lock<std::shared_mutex> lock(shared_mutex);
+    std::shared_lock<std::shared_mutex> leaflock;
+    read(SlotSearch(key, leaflock));
+  }
+  if (status == NOT_FOUND) LOG("   could not find key");
+  return status;
+}
+
+// Keys are looked up MULTIGET_GROUP at a time under one shared tree lock, and every key of a
+// group takes each step before any key takes the next one: down a level of inner nodes, then to
+// its slot, then to its buffer. Each step prefetches what the next one reads, so the cache misses
+// of a group overlap. The leaves of a group are locked together, in address order so that two
+// batches never wait on each other, and released before the next group.
+void MVTree::MultiGet(const vector<string> &keys, vector<string> &values,
+                      vector<KVStatus> &statuses) {
+  LOG("MultiGet for keys=" << keys.size());
+  values.assign(keys.size(), string());
+  statuses.assign(keys.size(), NOT_FOUND);
   std::shared_lock<std::shared_mutex> lock(shared_mutex);
-  auto leafnode = LeafSearch(key);
-  if (leafnode) {
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
-    for (int slot = LEAF_KEYS; slot--;) {
-      if (leafnode->hashes[slot] == hash) {
-        if (leafnode->keys[slot].compare(key) == 0) {
-          auto kv = leafnode->leaf->slots[slot].get_ro();
-          LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
-          value->append(kv.val(), kv.valsize());
-          return OK;
-        }
+  if (!recovered) {                                                      // leaves scanned instead
+    for (size_t i = 0; i < keys.size(); i++) {
+      std::shared_lock<std::shared_mutex> leaflock;
+      auto kvslot = SlotSearch(keys[i], leaflock);
+      if (!kvslot) continue;
+      values[i].assign(kvslot->val(), kvslot->valsize());
+      statuses[i] = OK;
+    }
+    return;
+  }
+  MVNode *nodes[MULTIGET_GROUP];
+  MVLeafNode *leaves[MULTIGET_GROUP];
+  const MVSlot *kvslots[MULTIGET_GROUP];
+  for (size_t first = 0; tree_top && first < keys.size(); first += MULTIGET_GROUP) {
+    const size_t count = std::min<size_t>(MULTIGET_GROUP, keys.size() - first);
+    const string *group = &keys[first];
+    for (size_t i = 0; i < count; i++) nodes[i] = tree_top.get();
+    while (!nodes[0]->is_leaf) {
+      for (size_t i = 0; i < count; i++) {
+        auto inner = (MVInnerNode *) nodes[i];
+        nodes[i] = inner->children[inner->lower_bound(group[i])].get();
+        __builtin_prefetch(nodes[i]);
       }
     }
+    for (size_t i = 0; i < count; i++) leaves[i] = (MVLeafNode *) nodes[i];
+    std::sort(leaves, leaves + count);
+    const size_t distinct = std::unique(leaves, leaves + count) - leaves;
+    std::shared_lock<std::shared_mutex> leaflocks[MULTIGET_GROUP];
+    for (size_t l = 0; l < distinct; l++) {
+      leaflocks[l] = std::shared_lock<std::shared_mutex>(leaves[l]->mutex);
+    }
+    for (size_t i = 0; i < count; i++) {
+      const uint8_t hash = PearsonHash(group[i].c_str(), group[i].size());
+      kvslots[i] = LeafFindSlotForKey((MVLeafNode *) nodes[i], hash, group[i]);
+      if (kvslots[i]) __builtin_prefetch(kvslots[i]);                    // slot with buffer pointer
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (kvslots[i]) __builtin_prefetch(kvslots[i]->key());             // buffer with sizes & key
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (!kvslots[i]) continue;
+      values[first + i].assign(kvslots[i]->val(), kvslots[i]->valsize());
+      statuses[first + i] = OK;
+    }
   }
-  LOG("   could not find key");
-  return NOT_FOUND;
 }
 
 KVStatus MVTree::Put(const string &key, const string &value) {
   LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
-  std::unique_lock<std::shared_mutex> lock(shared_mutex);
-  try {
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
-    auto leafnode = LeafSearch(key);
-    if (!leafnode) {
-      LOG("   adding head leaf");
-      unique_ptr<MVLeafNode> new_node(new MVLeafNode());
-      new_node->is_leaf = true;
-      transaction::exec_tx(pmpool, [&] {
-                                     if (!leaves_prealloc.empty()) {
-                                       new_node->leaf = leaves_prealloc.back();
-                                       leaves_prealloc.pop_back();
-                                     } else {
-                                       auto root = kv_root;
-                                       auto old_head = root->head;
-                                       auto new_leaf = make_persistent<MVLeaf>();
-                                       root->head = new_leaf;
-                                       new_leaf->next = old_head;
-                                       new_node->leaf = new_leaf;
-                                     }
-                                     LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
-                                   });
-      tree_top = move(new_node);
-    } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
-      // nothing else to do
-    } else {
-      LeafSplitFull(leafnode, hash, key, value);
-    }
-    return OK;
-  } catch (pmem::transaction_alloc_error) {
-    return FAILED;
-  } catch (pmem::transaction_error) {
-    return FAILED;
-  }
+  WaitForRecovery();
+  MVWriteRequest request{key, &value};
+  return Combine(request);
 }
 
 KVStatus MVTree::Remove(const string &key) {
   LOG("Remove key=" << key.c_str());
+  WaitForRecovery();
+  MVWriteRequest request{key, nullptr};
+  return Combine(request);
+}
+
+// Every operation joins one transaction, so either the whole batch is applied or none of it.
+// Volatile nodes change as the batch goes along, so after an abort they are rebuilt from leaves.
+KVStatus MVTree::Write(const KVWriteBatch &batch) {
+  LOG("Write batch of " << batch.Count() << " operations");
+  WaitForRecovery();
   std::unique_lock<std::shared_mutex> lock(shared_mutex);
-  auto leafnode = LeafSearch(key);
-  if (!leafnode) {
-    LOG("   head not present");
-    return OK;
-  }
-  const uint8_t hash = PearsonHash(key.c_str(), key.size());
-  for (int slot = LEAF_KEYS; slot--;) {
-    if (leafnode->hashes[slot] == hash) {
-      if (leafnode->keys[slot].compare(key) == 0) {
-        LOG("   freeing slot=" << slot);
-        leafnode->hashes[slot] = 0;
-        leafnode->keys[slot].clear();
-        auto leaf = leafnode->leaf;
-        transaction::exec_tx(pmpool, [&] {
-                                       leaf->slots[slot].get_rw().clear();
-                                     });
-        break;  // no duplicate keys allowed
+  ReadersExclude(tree_writing, nullptr);
+  ReadersExcluded excluded{tree_writing};
+  try {
+    transaction::exec_tx(pmpool, [&] {
+      for (auto &op : batch.Ops()) {
+        if (op.remove) {
+          RemoveKey(op.key);
+        } else {
+          PutKey(op.key, op.value);
+        }
       }
-    }
+    });
+    return OK;
+  } catch (pmem::transaction_error) {                                    // includes alloc errors
+    LOG("   batch aborted, rebuilding index");
+    RebuildIndex();
+    return FAILED;
   }
-  return OK;
 }
 
 
 void MVTree::Free() {
   LOG("Free the tree"); 
   // TODO impl
+  WaitForRecovery();
   if(kv_root != nullptr) {
     std::unique_lock<std::shared_mutex> lock(shared_mutex);
+    ReadersExclude(tree_writing, nullptr);
+    ReadersExcluded excluded{tree_writing};
     persistent_ptr<MVLeaf> pLeaf = kv_root->head;
     while(pLeaf != nullptr) {
       persistent_ptr<MVLeaf> pt = pLeaf->next;
@@ -345,6 +541,9 @@ void MVTree::Free() {
       pLeaf = pt;
     }
     delete_persistent_atomic<MVRoot>(kv_root);
+    pool_root = nullptr;
+    compact_prev = nullptr;
+    total_keys = 0;
   }
 }
 
@@ -353,92 +552,381 @@ void MVTree::Free() {
 // PROTECTED LEAF METHODS
 // ===============================================================================================
 
+// Writers share the tree lock while they find their leaf, and publish requests to that leaf. The
+// first writer free to combine takes all requests pending for the leaf, applies them under the
+// leaf lock in a single transaction, and wakes the others. Requests published while it works are
+// taken by the next combiner, so writers to the same leaf share lock hand-offs and commits, while
+// writers to other leaves proceed in parallel. Requests stay on the stack of their writer, which
+// waits until done. Leaves only split under the unique tree lock, which is taken afterwards by
+// writers whose key did not fit, so no leaf changes shape while requests are pending for it.
+KVStatus MVTree::Combine(MVWriteRequest &request) {
+  std::shared_lock<std::shared_mutex> lock(shared_mutex);
+  auto leafnode = LeafSearch(request.key);
+  if (leafnode) {
+#if MVTREE_COMBINING
+    std::unique_lock<std::mutex> guard(leafnode->combine_mutex);
+    leafnode->combine_pending.push_back(&request);
+    while (!request.done) {
+      if (leafnode->combining) {
+        leafnode->combine_applied.wait(guard);
+        continue;
+      }
+      leafnode->combining = true;
+      vector<MVWriteRequest*> requests;
+      requests.swap(leafnode->combine_pending);
+      guard.unlock();
+      CombineApply(leafnode, requests);
+      guard.lock();
+      for (auto r : requests) r->done = true;
+      leafnode->combining = false;
+      leafnode->combine_applied.notify_all();
+    }
+#else
+    vector<MVWriteRequest*> requests{&request};
+    CombineApply(leafnode, requests);
+#endif
+    if (!request.split) return request.status;
+  }
+  lock.unlock();
+  LOG("   taking tree lock to add leaf");
+  std::unique_lock<std::shared_mutex> exclusive(shared_mutex);
+  ReadersExclude(tree_writing, nullptr);
+  ReadersExcluded excluded{tree_writing};
+  combine_commits++;
+  if (!request.split) combine_writes++;                                  // else counted by leaf
+  return CombineApplyOne(request);
+}
+
+// A lone request runs just as an uncombined write would, so a single writer pays nothing extra.
+// If the shared transaction aborts, only this leaf has volatile state ahead of its persistent
+// slots, so it is reloaded and each request is applied on its own. That way only the requests
+// that fail by themselves report FAILED.
+void MVTree::CombineApply(MVLeafNode *leafnode, vector<MVWriteRequest*> &requests) {
+  LOG("Applying " << requests.size() << " combined requests");
+  std::unique_lock<std::shared_mutex> leaflock(leafnode->mutex);
+  ReadersExclude(leafnode->writing, leafnode);
+  ReadersExcluded excluded{leafnode->writing};
+  const auto apply_alone = [&](MVWriteRequest *r) {
+    r->split = false;
+    try {
+      CombineApplyToLeaf(leafnode, *r);
+    } catch (pmem::transaction_error) {                                  // includes alloc errors
+      r->status = FAILED;
+      total_keys -= leafnode->key_count();                               // removes clear early
+      leafnode->reload();
+      total_keys += leafnode->key_count();
+    }
+    if (!r->split) combine_commits++;
+  };
+  combine_writes += requests.size();
+  if (requests.size() == 1) {
+    apply_alone(requests[0]);
+    return;
+  }
+  try {
+    combine_commits++;
+    transaction::exec_tx(pmpool, [&] {
+      for (auto r : requests) CombineApplyToLeaf(leafnode, *r);
+    });
+  } catch (pmem::transaction_error) {                                    // includes alloc errors
+    LOG("   combined requests aborted, applying one at a time");
+    total_keys -= leafnode->key_count();
+    leafnode->reload();
+    total_keys += leafnode->key_count();
+    for (auto r : requests) apply_alone(r);
+  }
+}
+
+// Puts that need a new slot in a full leaf are only marked to split, and leave the leaf unchanged.
+void MVTree::CombineApplyToLeaf(MVLeafNode *leafnode, MVWriteRequest &request) {
+  const uint8_t hash = PearsonHash(request.key.c_str(), request.key.size());
+  if (!request.value) {
+    LeafClearSlotForKey(leafnode, hash, request.key);
+  } else if (!LeafFillSlotForKey(leafnode, hash, request.key, *request.value)) {
+    request.split = true;
+    return;
+  }
+  request.status = OK;
+}
+
+KVStatus MVTree::CombineApplyOne(const MVWriteRequest &request) {
+  try {
+    if (request.value) {
+      PutKey(request.key, *request.value);
+    } else {
+      RemoveKey(request.key);
+    }
+    return OK;
+  } catch (pmem::transaction_error) {                                    // includes alloc errors
+    return FAILED;
+  }
+}
+
+void MVTree::PutKey(const string &key, const string &value) {
+  const uint8_t hash = PearsonHash(key.c_str(), key.size());
+  auto leafnode = LeafSearch(key);
+  if (!leafnode) {
+    LOG("   adding head leaf");
+    unique_ptr<MVLeafNode> new_node(new MVLeafNode());
+    new_node->is_leaf = true;
+    LeafAddTx([&] {
+                                   if (!leaves_prealloc.empty()) {
+                                     new_node->leaf = leaves_prealloc.back();
+                                     leaves_prealloc.pop_back();
+                                   } else {
+                                     auto root = kv_root;
+                                     auto old_head = root->head;
+                                     auto new_leaf = make_persistent<MVLeaf>();
+                                     root->head = new_leaf;
+                                     new_leaf->next = old_head;
+                                     new_node->leaf = new_leaf;
+                                   }
+                                   LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
+                                 });
+    tree_top = move(new_node);
+  } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
+    // nothing else to do
+  } else {
+    LeafSplitFull(leafnode, hash, key, value);
+  }
+}
+
+void MVTree::RemoveKey(const string &key) {
+  auto leafnode = LeafSearch(key);
+  if (!leafnode) {
+    LOG("   head not present");
+    return;
+  }
+  LeafClearSlotForKey(leafnode, PearsonHash(key.c_str(), key.size()), key);
+}
+
 MVLeafNode *MVTree::LeafSearch(const string &key) {
   MVNode *node = tree_top.get();
   if (node == nullptr) return nullptr;
-  bool matched;
   while (!node->is_leaf) {
-    matched = false;
     auto inner = (MVInnerNode *) node;
 #ifndef NDEBUG
     inner->assert_invariants();
 #endif
-    const uint8_t keycount = inner->keycount;
-    for (uint8_t idx = 0; idx < keycount; idx++) {
-      node = inner->children[idx].get();
-      if (key.compare(inner->keys[idx]) <= 0) {
-        matched = true;
-        break;
+    node = inner->children[inner->lower_bound(key)].get();
+  }
+  return (MVLeafNode *) node;
+}
+
+MVLeafNode *MVTree::LeafEdge(const bool highest) {
+  MVNode *node = tree_top.get();
+  while (node && !node->is_leaf) {
+    auto inner = (MVInnerNode *) node;
+    node = inner->children[highest ? inner->keycount : 0].get();
+  }
+  return (MVLeafNode *) node;
+}
+
+// Pairs are copied one leaf at a time by a cursor, which holds the tree and leaf locks only while
+// it copies, so no lock is held while the callback runs. The callback may then call the engine,
+// writes included, and writers never wait for it. Like any cursor, the scan sees each leaf as of
+// one moment and searches the tree again for the pairs above the last one passed.
+void MVTree::EachInRange(const string *above, const string *below, void *context,
+                         KVEachCallback *callback) {
+  MVTreeIterator it(this);
+  if (above) {
+    it.Seek(*above);
+    if (it.Valid() && it.key() == *above) it.Next();                     // strictly above
+  } else {
+    it.SeekToFirst();
+  }
+  for (; it.Valid(); it.Next()) {
+    const std::string_view key = it.key();
+    if (below && key.compare(*below) >= 0) return;
+    const std::string_view value = it.value();
+    callback(context, (int32_t) key.size(), (int32_t) value.size(), key.data(), value.data());
+  }
+}
+
+// Until recovery has rebuilt the index, readers look in every leaf. Leaves already scanned are
+// checked through the hashes and keys of their nodes, and only those still to be scanned are read
+// from persistent memory, so lookups get cheaper as RECOVERY_LAZY recovery goes on. While a leaf
+// directory loads, which is one sequential read, every persistent leaf is read. Writers wait for
+// the index. The caller holds the shared tree lock, and keeps the leaf lock for the slot found.
+const MVSlot *MVTree::SlotSearch(const string &key, std::shared_lock<std::shared_mutex> &leaflock) {
+  const uint8_t hash = PearsonHash(key.c_str(), key.size());
+  if (!recovered) {
+    const auto scan = [&](const persistent_ptr<MVLeaf> &leaf) -> const MVSlot * {
+      for (int slot = LEAF_KEYS; slot--;) {
+        auto &kvslot = leaf->slots[slot].get_rw();
+        if (kvslot.empty() || kvslot.hash() != hash) continue;
+        if (key.compare(0, string::npos, kvslot.key(), kvslot.keysize()) == 0) return &kvslot;
       }
+      return nullptr;
+    };
+    const size_t scanning = recovery_leaves.load(std::memory_order_acquire);
+    if (scanning == 0) {
+      for (auto leaf = kv_root->head; leaf; leaf = leaf->next) {
+        if (auto kvslot = scan(leaf)) return kvslot;
+      }
+      return nullptr;
+    }
+    for (size_t i = 0; i < scanning; i++) {
+      auto leafnode = recovery_nodes[i].load(std::memory_order_acquire);
+      auto kvslot = leafnode ? LeafFindSlotForKey(leafnode, hash, key) : scan(recovery_chain[i]);
+      if (kvslot) return kvslot;
     }
-    if (!matched) node = inner->children[keycount].get();
+    return nullptr;
   }
-  return (MVLeafNode *) node;
+  auto leafnode = LeafSearch(key);
+  if (!leafnode) return nullptr;
+  leaflock = std::shared_lock<std::shared_mutex>(leafnode->mutex);
+  return LeafFindSlotForKey(leafnode, hash, key);
+}
+
+// Lock-free readers each announce what they read in a slot of their own, so reads never write
+// memory shared with other readers. The tree is announced while searching it and then the leaf
+// found. Writers flag the leaf, or the whole tree for structural changes, and wait until no slot
+// announces it before changing anything, so slot buffers and volatile nodes outlive the readers
+// of them. A reader that finds a flag set, or whose slot is taken by another thread, returns
+// false to retry with locks.
+static std::atomic<size_t> reader_threads{0};                            // threads seen reading
+static thread_local const size_t reader_id = reader_threads++;           // slot of this thread
+
+template <typename F>
+bool MVTree::SlotRead(const string &key, F &&read) {
+#if MVTREE_READER_SLOTS > 0
+  auto &announced = reader_slots[reader_id % MVTREE_READER_SLOTS].node;
+  const void *none = nullptr;
+  if (!announced.compare_exchange_strong(none, this)) return false;
+  bool done = false;
+  if (!tree_writing.load() && recovered) {
+    auto leafnode = LeafSearch(key);
+    if (!leafnode) {
+      read(nullptr);
+      done = true;
+    } else {
+      announced.store(leafnode);
+      if (!leafnode->writing.load()) {
+        read(LeafFindSlotForKey(leafnode, PearsonHash(key.c_str(), key.size()), key));
+        done = true;
+      }
+    }
+  }
+  announced.store(nullptr, std::memory_order_release);
+  return done;
+#else
+  return false;
+#endif
+}
+
+// Sets the flag before reading announcements, just as readers announce before reading flags,
+// so either the writer waits for a reader or the reader sees the flag. A null node waits for
+// every reader. The caller clears the flag when it is done.
+void MVTree::ReadersExclude(std::atomic<bool> &writing, const void *node) {
+  writing.store(true);
+#if MVTREE_READER_SLOTS > 0
+  for (auto &slot : reader_slots) {
+    for (const void *n = slot.node.load(); n && (!node || n == node); n = slot.node.load()) {
+      std::this_thread::yield();
+    }
+  }
+#endif
+}
+
+const MVSlot *MVTree::LeafFindSlotForKey(MVLeafNode *leafnode, const uint8_t hash, const string &key) {
+  for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+    const int slot = __builtin_ctzll(mask);
+    if (leafnode->key(slot) == key) return &leafnode->leaf->slots[slot].get_ro();
+  }
+  return nullptr;
 }
 
 void MVTree::LeafFillEmptySlot(MVLeafNode *leafnode, const uint8_t hash,
                                    const string &key, const string &value) {
-  for (int slot = LEAF_KEYS; slot--;) {
-    if (leafnode->hashes[slot] == 0) {
-      LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-      return;
-    }
+  const uint64_t empty = LeafHashMask(leafnode->hashes, 0);
+  if (empty) {
+    const int slot = 63 - __builtin_clzll(empty);                     // highest unoccupied slot
+    LeafFillSpecificSlot(leafnode, hash, key, value, slot);
   }
 }
 
 bool MVTree::LeafFillSlotForKey(MVLeafNode *leafnode, const uint8_t hash,
                                     const string &key, const string &value) {
-  // scan for empty/matching slots
-  int last_empty_slot = -1;
-  int key_match_slot = -1;
-  for (int slot = LEAF_KEYS; slot--;) {
-    auto slot_hash = leafnode->hashes[slot];
-    if (slot_hash == 0) {
-      last_empty_slot = slot;
-    } else if (slot_hash == hash) {
-      if (leafnode->keys[slot].compare(key) == 0) {
-        key_match_slot = slot;
-        break;  // no duplicate keys allowed
-      }
+  // scan for matching slot, only comparing keys where hashes match
+  int slot = -1;
+  for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+    const int match = __builtin_ctzll(mask);
+    if (leafnode->key(match) == key) {
+      slot = match;
+      break;  // no duplicate keys allowed
     }
   }
 
-  // update suitable slot if found
-  int slot = key_match_slot >= 0 ? key_match_slot : last_empty_slot;
+  // overwrite matching slot in its own buffer if possible, else swap buffers atomically
   if (slot >= 0) {
-    LOG("   filling slot=" << slot);
-    transaction::exec_tx(pmpool, [&] {
-                                   LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-                                 });
+    LOG("   overwriting slot=" << slot);
+    auto &kvslot = leafnode->leaf->slots[slot].get_rw();
+    if (kvslot.fits(value)) {
+      transaction::exec_tx(pmpool, [&] {
+                                     kvslot.set_in_place(value);
+                                   });
+    } else {
+      kvslot.set_atomic(pmpool.get_handle(), hash, key, value, SlabFlags(key.size(), value.size()));
+    }
+    return true;
+  }
+
+  // otherwise publish into lowest empty slot, which needs no transaction
+  const uint64_t empty = LeafHashMask(leafnode->hashes, 0);
+  if (!empty) return false;
+  slot = __builtin_ctzll(empty);
+  LOG("   filling slot=" << slot);
+  leafnode->leaf->slots[slot].get_rw().set_atomic(pmpool.get_handle(), hash, key, value,
+                                                  SlabFlags(key.size(), value.size()));
+  leafnode->hashes[slot] = hash;
+  leafnode->set_key(slot, key);
+  total_keys++;
+  return true;
+}
+
+void MVTree::LeafClearSlotForKey(MVLeafNode *leafnode, const uint8_t hash, const string &key) {
+  for (uint64_t mask = LeafHashMask(leafnode->hashes, hash); mask; mask &= mask - 1) {
+    const int slot = __builtin_ctzll(mask);
+    if (leafnode->key(slot) == key) {
+      LOG("   freeing slot=" << slot);
+      leafnode->hashes[slot] = 0;
+      leafnode->clear_key(slot);
+      auto leaf = leafnode->leaf;
+      transaction::exec_tx(pmpool, [&] {
+                                     leaf->slots[slot].get_rw().clear();
+                                   });
+      total_keys--;
+      break;  // no duplicate keys allowed
+    }
   }
-  return slot >= 0;
 }
 
 void MVTree::LeafFillSpecificSlot(MVLeafNode *leafnode, const uint8_t hash,
                                       const string &key, const string &value, const int slot) {
-  if (leafnode->hashes[slot] == 0) {
+  const bool added = leafnode->hashes[slot] == 0;
+  if (added) {
     leafnode->hashes[slot] = hash;
-    leafnode->keys[slot] = key;
+    leafnode->set_key(slot, key);
   }
-  leafnode->leaf->slots[slot].get_rw().set(hash, key, value);
+  leafnode->leaf->slots[slot].get_rw().set(hash, key, value, SlabFlags(key.size(), value.size()));
+  if (added) total_keys++;
 }
 
 void MVTree::LeafSplitFull(MVLeafNode *leafnode, const uint8_t hash,
                                const string &key, const string &value) {
-  string keys[LEAF_KEYS + 1];
+  std::string_view keys[LEAF_KEYS + 1];
   keys[LEAF_KEYS] = key;
-  for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->keys[slot];
-  std::sort(std::begin(keys), std::end(keys), [](const string &lhs, const string &rhs) {
-                                                return lhs.compare(rhs) < 0;
-                                              });
-  string split_key = keys[LEAF_KEYS_MIDPOINT];
+  for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->key(slot);
+  std::sort(std::begin(keys), std::end(keys));
+  string split_key(keys[LEAF_KEYS_MIDPOINT]);
   LOG("   splitting leaf at key=" << split_key);
 
   // split leaf into two leaves, moving slots that sort above split key to new leaf
   unique_ptr<MVLeafNode> new_leafnode(new MVLeafNode());
   new_leafnode->parent = leafnode->parent;
   new_leafnode->is_leaf = true;
-  transaction::exec_tx(pmpool, [&] {
+  LeafAddTx([&] {
                                  persistent_ptr<MVLeaf> new_leaf;
                                  if (!leaves_prealloc.empty()) {
                                    new_leaf = leaves_prealloc.back();
@@ -453,18 +941,24 @@ void MVTree::LeafSplitFull(MVLeafNode *leafnode, const uint8_t hash,
                                    new_leafnode->leaf = new_leaf;
                                  }
                                  for (int slot = LEAF_KEYS; slot--;) {
-                                   if (leafnode->keys[slot].compare(split_key) > 0) {
-                                     new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
+                                   if (leafnode->key(slot).compare(split_key) > 0) {
                                      new_leafnode->hashes[slot] = leafnode->hashes[slot];
-                                     new_leafnode->keys[slot] = leafnode->keys[slot];
+                                     new_leafnode->set_key(slot, leafnode->key(slot));  // before slot moves
+                                     new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
                                      leafnode->hashes[slot] = 0;
-                                     leafnode->keys[slot].clear();
+                                     leafnode->clear_key(slot);
                                    }
                                  }
                                  auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
                                  LeafFillEmptySlot(target, hash, key, value);
                                });
 
+  // link new leaf as right neighbour, keeping volatile leaves in key order
+  new_leafnode->prev = leafnode;
+  new_leafnode->next = leafnode->next;
+  if (leafnode->next) leafnode->next->prev = new_leafnode.get();
+  leafnode->next = new_leafnode.get();
+
   // recursively update volatile parents outside persistent transaction
   InnerUpdateAfterSplit(leafnode, move(new_leafnode), &split_key);
 }
@@ -474,8 +968,7 @@ void MVTree::InnerUpdateAfterSplit(MVNode *node, unique_ptr<MVNode> new_node, st
     assert(node == tree_top.get());
     LOG("   creating new top node for split_key=" << *split_key);
     unique_ptr<MVInnerNode> top(new MVInnerNode());
-    top->keycount = 1;
-    top->keys[0] = *split_key;
+    top->insert_key(0, *split_key);
     node->parent = top.get();
     new_node->parent = top.get();
     top->children[0] = move(tree_top);
@@ -490,16 +983,13 @@ void MVTree::InnerUpdateAfterSplit(MVNode *node, unique_ptr<MVNode> new_node, st
   LOG("   updating parents for split_key=" << *split_key);
   MVInnerNode *inner = node->parent;
   { // insert split_key and new_node into inner node in sorted order
-    const uint8_t keycount = inner->keycount;
-    int idx = 0;  // position where split_key should be inserted
-    while (idx < keycount && inner->keys[idx].compare(*split_key) <= 0) idx++;
-    for (int i = keycount - 1; i >= idx; i--) inner->keys[i + 1] = move(inner->keys[i]);
+    const uint16_t keycount = inner->keycount;
+    const uint16_t idx = inner->upper_bound(*split_key);  // position where split_key goes
     for (int i = keycount; i > idx; i--) inner->children[i + 1] = move(inner->children[i]);
-    inner->keys[idx] = *split_key;
+    inner->insert_key(idx, *split_key);
     inner->children[idx + 1] = move(new_node);
-    inner->keycount = (uint8_t) (keycount + 1);
   }
-  const uint8_t keycount = inner->keycount;
+  const uint16_t keycount = inner->keycount;
   if (keycount <= INNER_KEYS) {
 #ifndef NDEBUG
     inner->assert_invariants();
@@ -510,16 +1000,15 @@ void MVTree::InnerUpdateAfterSplit(MVNode *node, unique_ptr<MVNode> new_node, st
   // split inner node at the midpoint, update parents as needed
   unique_ptr<MVInnerNode> ni(new MVInnerNode());                       // create new inner node
   ni->parent = inner->parent;                                          // set parent reference
-  for (int i = INNER_KEYS_UPPER; i < keycount; i++) {                  // move all upper keys
-    ni->keys[i - INNER_KEYS_UPPER] = move(inner->keys[i]);           // move key string
+  for (int i = INNER_KEYS_UPPER; i < keycount; i++) {                  // copy all upper keys
+    ni->insert_key(i - INNER_KEYS_UPPER, inner->key(i));             // append to new arena
   }
   for (int i = INNER_KEYS_UPPER; i < keycount + 1; i++) {              // move all upper children
     ni->children[i - INNER_KEYS_UPPER] = move(inner->children[i]);   // move child reference
     ni->children[i - INNER_KEYS_UPPER]->parent = ni.get();           // set parent reference
   }
-  ni->keycount = INNER_KEYS_MIDPOINT;                                  // always half the keys
-  string new_split_key = inner->keys[INNER_KEYS_MIDPOINT];             // save for recursion
-  inner->keycount = INNER_KEYS_MIDPOINT;                               // half of keys remain
+  string new_split_key(inner->key(INNER_KEYS_MIDPOINT));               // save for recursion
+  inner->truncate_keys(INNER_KEYS_MIDPOINT);                           // half of keys remain
 
   // perform deep check on modified inner nodes
 #ifndef NDEBUG
@@ -534,75 +1023,463 @@ void MVTree::InnerUpdateAfterSplit(MVNode *node, unique_ptr<MVNode> new_node, st
 // PROTECTED LIFECYCLE METHODS
 // ===============================================================================================
 
+// Runs task(0) .. task(count - 1) concurrently, using the calling thread for the last one.
+static void RunInParallel(const size_t count, const std::function<void(size_t)> &task) {
+  vector<std::thread> workers;
+  for (size_t i = 0; i + 1 < count; i++) workers.emplace_back(task, i);
+  if (count > 0) task(count - 1);
+  for (auto &worker : workers) worker.join();
+}
+
 void MVTree::Recover() {
+  SlabRegister();
+  auto stats = POBJ_STATS_ENABLED_TRANSIENT;                             // for fragmentation
+  pmemobj_ctl_set(pmpool.get_handle(), "stats.enabled", &stats);
+#if RECOVERY_LAZY
+  LOG("Recovering in background");
+  recovery = std::async(std::launch::async, [this] { RecoverIndex(); }).share();
+#else
+  RecoverIndex();
+#endif
+}
+
+// Leaves are read without the tree lock, which is only taken to publish the finished index.
+// Readers look in every leaf until then (see SlotSearch), and writers wait for the index.
+void MVTree::RecoverIndex() {
   LOG("Recovering");
+  vector<MVRecoveredLeaf> leaves;
+  if (!RecoverSnapshot(leaves)) RecoverLeaves(leaves);
+  DiscardSnapshot();                                                     // crash needs full scan
+  std::unique_lock<std::shared_mutex> lock(shared_mutex);
+  ReadersExclude(tree_writing, nullptr);
+  ReadersExcluded excluded{tree_writing};
+  InnerBulkLoad(leaves);
+  recovered = true;
+  RecoveryRelease();
+  recovery_done++;                                                       // publishing is last step
+  LOG("Recovered ok");
+}
 
+void MVTree::WaitForRecovery() {
+  if (recovery.valid()) recovery.wait();
+}
 
-  // traverse persistent leaves to build list of leaves to recover
-  std::list<MVRecoveredLeaf> leaves;
+double MVTree::RecoveryProgress() {
+  const size_t total = recovery_total;
+  return total > 0 ? (double) recovery_done / total : 0;
+}
 
-  std::unique_lock<std::shared_mutex> lock(shared_mutex);
+// Persistent leaves are always complete, so volatile nodes left ahead of them by an aborted
+// batch are dropped and recovered again with a full scan. The tree is already recovered, so the
+// rescan leaves RecoveryProgress alone. Callers hold the unique lock.
+void MVTree::RebuildIndex() {
+  tree_top.reset();
+  leaves_prealloc.clear();
+  vector<MVRecoveredLeaf> leaves;
+  RecoverLeaves(leaves);
+  InnerBulkLoad(leaves);
+  RecoveryRelease();
+}
 
-  auto leaf = kv_root->head;
-  while (leaf) {
-    unique_ptr<MVLeafNode> leafnode(new MVLeafNode());
-    leafnode->leaf = leaf;
-    leafnode->is_leaf = true;
+// Drops what readers used to look in leaves while recovering. Callers hold the unique lock.
+void MVTree::RecoveryRelease() {
+  recovery_leaves = 0;
+  recovery_nodes.reset();
+  recovery_chain.clear();
+  recovery_chain.shrink_to_fit();
+}
 
-    // find highest sorting key in leaf, while recovering all hashes
-    bool empty_leaf = true;
-    string max_key;
-    for (int slot = LEAF_KEYS; slot--;) {
-      auto kvslot = leaf->slots[slot].get_ro();
-      if (kvslot.empty()) continue;
-      leafnode->hashes[slot] = kvslot.hash();
-      if (leafnode->hashes[slot] == 0) continue;
-      const char *key = kvslot.key();
+// Adding a leaf takes it from preallocated leaves and moves keys in volatile nodes as it goes, so
+// if the transaction aborts, volatile nodes are rebuilt to match the leaves rolled back. Nested
+// in a batch, the abort is only rolled back once the batch ends, and the batch rebuilds instead.
+// Callers hold the unique lock.
+template <typename F>
+void MVTree::LeafAddTx(F &&body) {
+  try {
+    transaction::exec_tx(pmpool, body);
+  } catch (pmem::transaction_error) {                                    // includes alloc errors
+    if (pmemobj_tx_stage() == TX_STAGE_NONE) {
+      LOG("   adding leaf aborted, rebuilding index");
+      RebuildIndex();
+    }
+    throw;
+  }
+}
+
+void MVTree::RecoverLeaves(vector<MVRecoveredLeaf> &leaves) {
+  // collect persistent leaves so they can be divided into contiguous runs, and so that readers
+  // can look in each leaf through its node as soon as that is recovered
+  auto &chain = recovery_chain;
+  chain.clear();
+  for (auto leaf = kv_root->head; leaf; leaf = leaf->next) chain.push_back(leaf);
+  recovery_nodes.reset(new std::atomic<MVLeafNode *>[chain.size()]());
+  recovery_leaves.store(chain.size(), std::memory_order_release);
+  const bool counting = !recovered;                                      // not when rebuilding
+  if (counting) recovery_total = chain.size() + 1;
+  size_t threads = RECOVERY_THREADS > 0 ? RECOVERY_THREADS : std::thread::hardware_concurrency();
+  threads = std::max<size_t>(1, std::min(threads, chain.size() / RECOVERY_LEAVES_PER_THREAD));
+  LOG("   recovering leaves=" << chain.size() << ", threads=" << threads);
+
+  // recover each run of leaves on its own thread, sorting the run by highest key
+  const auto by_max_key = [](const MVRecoveredLeaf &lhs, const MVRecoveredLeaf &rhs) {
+    return lhs.max_key.compare(rhs.max_key) < 0;
+  };
+  vector<vector<MVRecoveredLeaf>> runs(threads);
+  vector<vector<persistent_ptr<MVLeaf>>> empties(threads);
+  RunInParallel(threads, [&](const size_t run) {
+    const size_t end = chain.size() * (run + 1) / threads;
+    for (size_t i = chain.size() * run / threads; i < end; i++) {
+      auto leaf = chain[i];
+      unique_ptr<MVLeafNode> leafnode(new MVLeafNode());
+      leafnode->leaf = leaf;
+      leafnode->is_leaf = true;
+
+      // find highest sorting key in leaf, while recovering all hashes
+      bool empty_leaf = true;
+      string max_key;
+      for (int slot = LEAF_KEYS; slot--;) {
+        auto& kvslot = leaf->slots[slot].get_ro();
+        if (kvslot.empty()) continue;
+        leafnode->hashes[slot] = kvslot.hash();
+        if (leafnode->hashes[slot] == 0) continue;
+        const char *key = kvslot.key();
+        if (empty_leaf) {
+          max_key = string(kvslot.key(), kvslot.get_ks());
+          empty_leaf = false;
+        } else if (max_key.compare(0, string::npos, kvslot.key(), kvslot.get_ks()) < 0) {
+          max_key = string(kvslot.key(), kvslot.get_ks());
+        }
+        leafnode->set_key(slot, std::string_view(key, kvslot.get_ks()));
+      }
+
+      // use highest sorting key to decide how to recover the leaf
       if (empty_leaf) {
-        max_key = string(kvslot.key(), kvslot.get_ks());
-        empty_leaf = false;
-      } else if (max_key.compare(0, string::npos, kvslot.key(), kvslot.get_ks()) < 0) {
-        max_key = string(kvslot.key(), kvslot.get_ks());
+        empties[run].push_back(leaf);
+        recovery_nodes[i].store(&recovery_empty, std::memory_order_release);
+      } else {
+        recovery_nodes[i].store(leafnode.get(), std::memory_order_release);  // stays put
+        runs[run].push_back({move(leafnode), max_key});
       }
-      leafnode->keys[slot] = string(key, kvslot.get_ks());
+      if (counting) recovery_done.fetch_add(1, std::memory_order_relaxed);
     }
+    std::sort(runs[run].begin(), runs[run].end(), by_max_key);
+  });
+  for (auto &empty : empties) leaves_prealloc.insert(leaves_prealloc.end(), empty.begin(), empty.end());
+
+  // merge sorted runs pairwise until all recovered leaves are in ascending key order
+  while (runs.size() > 1) {
+    vector<vector<MVRecoveredLeaf>> merged((runs.size() + 1) / 2);
+    RunInParallel(merged.size(), [&](const size_t pair) {
+      auto &lhs = runs[pair * 2];
+      if (pair * 2 + 1 == runs.size()) {
+        merged[pair] = move(lhs);                                        // odd run out
+        return;
+      }
+      auto &rhs = runs[pair * 2 + 1];
+      merged[pair].reserve(lhs.size() + rhs.size());
+      std::merge(std::make_move_iterator(lhs.begin()), std::make_move_iterator(lhs.end()),
+                 std::make_move_iterator(rhs.begin()), std::make_move_iterator(rhs.end()),
+                 std::back_inserter(merged[pair]), by_max_key);
+    });
+    runs = move(merged);
+  }
+  leaves = move(runs.front());
+}
 
-    // use highest sorting key to decide how to recover the leaf
-    if (empty_leaf) {
-      leaves_prealloc.push_back(leaf);
-    } else {
-      leaves.push_back({move(leafnode), max_key});
-    }
+// Every open of a pool, by any version of pmemkv or by other tools, advances its run id by two.
+// A leaf directory written in the run just before this one therefore describes the leaves as
+// they are now, while one written earlier may have missed changes made by code that ignores it.
+static uint64_t PoolRunId(PMEMobjpool *pop) {
+  PMEMvlt vlt = {0};
+  int unused;
+  pmemobj_volatile(pop, &vlt, &unused, sizeof(unused), [](void*, void*) { return 0; }, nullptr);
+  return vlt.runid;
+}
 
-    leaf = leaf->next;  // advance to next linked leaf
+// The leaf directory lists empty leaves, then every other leaf in key order with its hashes,
+// highest key and (when leaf keys are kept in DRAM) the key of each occupied slot. Reading it
+// back is one sequential pass, rather than following every slot into its key/value buffer.
+// Only a tree with a pool of its own keeps one, as its root is the only one that can grow.
+bool MVTree::RecoverSnapshot(vector<MVRecoveredLeaf> &leaves) {
+#if RECOVERY_SNAPSHOT
+  if (pool_root == nullptr || pool_root->directory == nullptr) return false;
+  auto directory = pool_root->directory;
+  if (directory->format != SNAPSHOT_FORMAT || !directory->contents) return false;
+  if (directory->run_id + 2 != PoolRunId(pmpool.get_handle())) return false;
+  LOG("   loading leaf directory, size=" << directory->size);
+  const char *p = directory->contents.get();
+  const auto read = [&p](void *dest, const size_t bytes) {
+    memcpy(dest, p, bytes);
+    p += bytes;
+  };
+  uint64_t empty_count, leaf_count;
+  read(&empty_count, sizeof(empty_count));
+  read(&leaf_count, sizeof(leaf_count));
+  recovery_total = empty_count + leaf_count + 1;
+  for (uint64_t i = 0; i < empty_count; i++) {
+    PMEMoid oid;
+    read(&oid, sizeof(oid));
+    leaves_prealloc.push_back(persistent_ptr<MVLeaf>(oid));
   }
+  recovery_done = empty_count;
+  leaves.reserve(leaf_count);
+  for (uint64_t i = 0; i < leaf_count; i++) {
+    PMEMoid oid;
+    read(&oid, sizeof(oid));
+    unique_ptr<MVLeafNode> leafnode(new MVLeafNode());
+    leafnode->leaf = persistent_ptr<MVLeaf>(oid);
+    leafnode->is_leaf = true;
+    read(leafnode->hashes, sizeof(leafnode->hashes));
+    uint32_t size;
+    read(&size, sizeof(size));
+    string max_key(p, size);
+    p += size;
+#if MVTREE_LEAF_ARENA
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+      if (leafnode->hashes[slot] == 0) continue;
+      read(&size, sizeof(size));
+      leafnode->set_key(slot, std::string_view(p, size));
+      p += size;
+    }
+#endif
+    leaves.push_back({move(leafnode), move(max_key)});
+    recovery_done.fetch_add(1, std::memory_order_relaxed);
+  }
+  assert(p == directory->contents.get() + directory->size);
+  return true;
+#else
+  return false;
+#endif
+}
 
-  // sort recovered leaves in ascending key order
-  leaves.sort([](const MVRecoveredLeaf &lhs, const MVRecoveredLeaf &rhs) {
-                return (lhs.max_key.compare(rhs.max_key) < 0);
-              });
+void MVTree::SaveSnapshot() {
+#if RECOVERY_SNAPSHOT
+  if (pool_root == nullptr) return;
+  LOG("   saving leaf directory");
+  string directory;
+  const auto write = [&directory](const void *src, const size_t bytes) {
+    directory.append((const char*) src, bytes);
+  };
+  vector<MVLeafNode*> ordered;                                           // leaves in key order
+  vector<persistent_ptr<MVLeaf>> empties(leaves_prealloc);
+  vector<MVNode*> pending;
+  if (tree_top) pending.push_back(tree_top.get());
+  while (!pending.empty()) {
+    auto next = pending.back();
+    pending.pop_back();
+    if (next->is_leaf) {
+      auto leafnode = (MVLeafNode*) next;
+      if (std::all_of(std::begin(leafnode->hashes), std::end(leafnode->hashes),
+                      [](const uint8_t hash) { return hash == 0; })) {
+        empties.push_back(leafnode->leaf);
+      } else {
+        ordered.push_back(leafnode);
+      }
+      continue;
+    }
+    auto inner = (MVInnerNode*) next;
+    for (int i = inner->keycount + 1; i--;) pending.push_back(inner->children[i].get());
+  }
+  const uint64_t empty_count = empties.size();
+  const uint64_t leaf_count = ordered.size();
+  write(&empty_count, sizeof(empty_count));
+  write(&leaf_count, sizeof(leaf_count));
+  for (auto &leaf : empties) {
+    const PMEMoid oid = leaf.raw();
+    write(&oid, sizeof(oid));
+  }
+  for (auto leafnode : ordered) {
+    const PMEMoid oid = leafnode->leaf.raw();
+    write(&oid, sizeof(oid));
+    write(leafnode->hashes, sizeof(leafnode->hashes));
+    std::string_view max_key;
+    bool found = false;
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+      if (leafnode->hashes[slot] == 0) continue;
+      if (!found || max_key.compare(leafnode->key(slot)) < 0) max_key = leafnode->key(slot);
+      found = true;
+    }
+    const uint32_t size = (uint32_t) max_key.size();
+    write(&size, sizeof(size));
+    write(max_key.data(), max_key.size());
+#if MVTREE_LEAF_ARENA
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+      if (leafnode->hashes[slot] == 0) continue;
+      const std::string_view key = leafnode->key(slot);
+      const uint32_t keysize = (uint32_t) key.size();
+      write(&keysize, sizeof(keysize));
+      write(key.data(), key.size());
+    }
+#endif
+  }
 
-  // reconstruct top/inner nodes using adjacent pairs of recovered leaves
-  tree_top.reset(nullptr);
+  // a full pool just means the next open scans every leaf
+  try {
+    transaction::exec_tx(pmpool, [&] {
+      DiscardSnapshot();
+      auto saved = make_persistent<MVDirectory>();
+      saved->contents = make_persistent<char[]>(directory.size());
+      memcpy(saved->contents.get(), directory.data(), directory.size());
+      saved->size = directory.size();
+      saved->run_id = PoolRunId(pmpool.get_handle());
+      saved->format = SNAPSHOT_FORMAT;
+      pool_root->directory = saved;
+    });
+  } catch (pmem::transaction_alloc_error) {
+    LOG("   could not save leaf directory");
+  } catch (pmem::transaction_error) {
+    LOG("   could not save leaf directory");
+  }
+#endif
+}
 
-  if (!leaves.empty()) {
-    tree_top = move(leaves.front().leafnode);
-    auto max_key = leaves.front().max_key;
-    leaves.pop_front();
+void MVTree::DiscardSnapshot() {
+  if (pool_root == nullptr || pool_root->directory == nullptr) return;
+  transaction::exec_tx(pmpool, [&] {
+    auto directory = pool_root->directory;
+    if (directory->contents) delete_persistent<char[]>(directory->contents, directory->size);
+    delete_persistent<MVDirectory>(directory);
+    pool_root->directory = nullptr;
+  });
+}
 
-    auto prevnode = tree_top.get();
-    while (!leaves.empty()) {
-      string split_key = string(max_key);
-      auto nextnode = leaves.front().leafnode.get();
-      nextnode->parent = prevnode->parent;
-      InnerUpdateAfterSplit(prevnode, move(leaves.front().leafnode), &split_key);
-      max_key = leaves.front().max_key;
-      leaves.pop_front();
-      prevnode = nextnode;
+// Slot buffers of up to SLAB_MAX_SIZE bytes get their own allocation classes, spaced a quarter
+// power of two apart, so each is carved from a run of equal units without a per-object header.
+// Free units are tracked by the pool in DRAM and classes are runtime state, so they are registered
+// on every open. An id already registered with the same unit size (by another tree sharing the
+// pool) is reused, and any other conflict leaves buffers in the default classes.
+void MVTree::SlabRegister() {
+  slab_classes.clear();
+#if SLAB_MAX_SIZE > 0
+  unsigned class_id = SLAB_CLASS_ID_FIRST;
+  for (size_t unit = SLAB_MIN_SIZE, step = SLAB_MIN_SIZE / 4; unit <= SLAB_MAX_SIZE; unit += step) {
+    if (unit == step * 8) step *= 2;                                     // quarter of a power of two
+    pobj_alloc_class_desc desc = {};
+    desc.unit_size = unit;
+    desc.units_per_block = SLAB_UNITS_PER_BLOCK;
+    desc.header_type = POBJ_HEADER_NONE;
+    desc.class_id = class_id;
+    const string query = "heap.alloc_class." + to_string(class_id) + ".desc";
+    if (pmemobj_ctl_set(pmpool.get_handle(), query.c_str(), &desc) != 0) {
+      pobj_alloc_class_desc existing = {};
+      if (pmemobj_ctl_get(pmpool.get_handle(), query.c_str(), &existing) != 0 ||
+        existing.unit_size != unit || existing.header_type != POBJ_HEADER_NONE) {
+        LOG("   slab classes unavailable, class_id=" << class_id);
+        slab_classes.clear();
+        return;
+      }
     }
+    slab_classes.push_back({unit, class_id++});
   }
+#endif
+}
 
-  LOG("Recovered ok");
+uint64_t MVTree::SlabFlags(const size_t ksize, const size_t vsize) {
+  const size_t size = MVSlot::buffer_size(ksize, vsize);
+  for (auto& slab : slab_classes) if (size <= slab.unit_size) return POBJ_CLASS_ID(slab.class_id);
+  return 0;                                                              // default classes
+}
+
+// Slot buffers are relocated first, as their only references are the slots of the leaf. The leaf
+// is then referenced from the list (by the previous leaf or the root) and from DRAM, by its leaf
+// node or the unused leaves, and it is found through any key it holds. An empty leaf still in
+// the tree has no key to find it by, so it stays where it is. Callers hold the unique lock.
+size_t MVTree::CompactLeaf(persistent_ptr<MVLeaf> &link) {
+  vector<PMEMoid*> references;
+  const MVSlot *first = nullptr;                                         // any occupied slot
+  for (int slot = 0; slot < LEAF_KEYS; slot++) {
+    auto &mvslot = link->slots[slot].get_rw();
+    if (mvslot.empty()) continue;
+    if (!first) first = &mvslot;
+    if (!mvslot.inlined()) references.push_back(mvslot.buffer_oid());
+  }
+  const size_t buffers = references.size();
+  CompactObjects(references);
+
+  references.clear();
+  references.push_back(link.raw_ptr());
+  if (first) {
+    auto leafnode = LeafSearch(string(first->key(), first->keysize()));
+    if (leafnode && leafnode->leaf == link) references.push_back(leafnode->leaf.raw_ptr());
+  } else {
+    for (auto &leaf : leaves_prealloc) if (leaf == link) references.push_back(leaf.raw_ptr());
+  }
+  if (references.size() > 1) CompactObjects(references);
+  return buffers + 1;
+}
+
+// The pool moves whichever of the objects sit in sparsely used runs into denser ones, and updates
+// every reference passed in (whether in the pool or in DRAM) in the same redo-logged step, so a
+// crash leaves each object either where it was or fully moved. A pool too full to move objects
+// just keeps them in place.
+void MVTree::CompactObjects(vector<PMEMoid*> &references) {
+  if (references.empty()) return;
+  pobj_defrag_result result = {};
+  if (pmemobj_defrag(pmpool.get_handle(), references.data(), references.size(), &result) != 0) {
+    LOG("   could not relocate objects, count=" << references.size());
+    return;
+  }
+  compact_relocated += result.relocated;
+}
+
+void MVTree::CompactLoop() {
+  std::unique_lock<std::mutex> lock(compact_mutex);
+  while (compact_rate > 0) {
+    const size_t rate = compact_rate;
+    lock.unlock();
+    const auto deadline = std::chrono::steady_clock::now() +
+                          std::chrono::microseconds(COMPACT_STEP_OBJECTS * 1000000 / rate);
+    Compact(COMPACT_STEP_OBJECTS);
+    lock.lock();
+    compact_wake.wait_until(lock, deadline, [&] { return compact_rate != rate; });
+  }
+}
+
+// Builds inner levels one at a time from the sorted leaves, giving each new inner node an even
+// share of the level below, but no more than RECOVERY_FILL_PERCENT of INNER_KEYS keys. The keys
+// between adjacent groups are passed up to separate the new nodes in the level above. Keys are
+// counted on the way, so TotalNumKeys never has to visit the leaves.
+void MVTree::InnerBulkLoad(vector<MVRecoveredLeaf> &leaves) {
+  vector<unique_ptr<MVNode>> nodes;
+  vector<string> split_keys;                                             // between adjacent nodes
+  for (size_t i = 1; i < leaves.size(); i++) {                           // link neighbouring leaves
+    leaves[i].leafnode->prev = leaves[i - 1].leafnode.get();
+    leaves[i - 1].leafnode->next = leaves[i].leafnode.get();
+  }
+  size_t keys = 0;
+  for (size_t i = 0; i < leaves.size(); i++) {
+    keys += leaves[i].leafnode->key_count();
+    nodes.push_back(move(leaves[i].leafnode));
+    if (i + 1 < leaves.size()) split_keys.push_back(move(leaves[i].max_key));
+  }
+  const size_t fanout = std::max(2, INNER_KEYS * RECOVERY_FILL_PERCENT / 100 + 1);
+  while (nodes.size() > 1) {
+    const size_t count = nodes.size();
+    const size_t groups = std::min((count + fanout - 1) / fanout, count / 2);
+    vector<unique_ptr<MVNode>> uppers;
+    vector<string> upper_keys;
+    size_t begin = 0;
+    for (size_t group = 0; group < groups; group++) {
+      const size_t end = count * (group + 1) / groups;                   // at least two children
+      unique_ptr<MVInnerNode> inner(new MVInnerNode());
+      for (size_t i = begin; i < end; i++) {
+        if (i > begin) inner->insert_key(inner->keycount, split_keys[i - 1]);
+        nodes[i]->parent = inner.get();
+        inner->children[i - begin] = move(nodes[i]);
+      }
+#ifndef NDEBUG
+      inner->assert_invariants();
+#endif
+      if (end < count) upper_keys.push_back(move(split_keys[end - 1]));
+      uppers.push_back(move(inner));
+      begin = end;
+    }
+    nodes = move(uppers);
+    split_keys = move(upper_keys);
+    LOG("   packed inner level, nodes=" << nodes.size());
+  }
+  tree_top.reset(nodes.empty() ? nullptr : nodes.front().release());
+  total_keys = keys;
 }
 
 // ===============================================================================================
@@ -641,59 +1518,299 @@ uint8_t MVTree::PearsonHash(const char *data, const size_t size) {
   // MODIFICATION END
 }
 
+// ===============================================================================================
+// FINGERPRINT METHODS
+// ===============================================================================================
+
+// Compares all leaf hashes against the given one, returning a mask where bit N is set when
+// hashes[N] matches. Keys then only need comparing for set bits, which is rare except for
+// the slot actually holding the key.
+uint64_t MVTree::LeafHashMask(const uint8_t *hashes, const uint8_t hash) {
+  uint64_t mask = 0;
+  int slot = 0;
+#if defined(__AVX2__)
+  const __m256i wide = _mm256_set1_epi8((char) hash);
+  for (; slot + 32 <= LEAF_KEYS; slot += 32) {
+    auto chunk = _mm256_loadu_si256((const __m256i *) (hashes + slot));
+    mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, wide)) << slot;
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i narrow = _mm_set1_epi8((char) hash);
+  for (; slot + 16 <= LEAF_KEYS; slot += 16) {
+    auto chunk = _mm_loadu_si128((const __m128i *) (hashes + slot));
+    mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, narrow)) << slot;
+  }
+#endif
+  for (; slot < LEAF_KEYS; slot++) {                                   // scalar fallback
+    if (hashes[slot] == hash) mask |= (uint64_t) 1 << slot;
+  }
+  return mask;
+}
+
 // ===============================================================================================
 // SLOT CLASS METHODS
 // ===============================================================================================
 
-bool MVSlot::empty() {
-    if (kv)
+bool MVSlot::empty() const {
+    if (kv || inlined())
         return false;
     else
         return true;
 }
 
+// Must run inside a transaction. The cell hash is cleared even when a buffer is set, as a crash
+// while a record moves between cell and buffer can leave a stale hash behind the buffer.
 void MVSlot::clear() {
     if (kv) {
-        char* p = kv.get();
-        set_ph_direct(p, 0);
-        set_ks_direct(p, 0);
-        set_vs_direct(p, 0);
+        char* p = kv.get();                                               // left intact if tx aborts
         delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
                                       get_vs_direct(p) + 2);
         kv = nullptr;
     }
+#if LEAF_INLINE_SIZE > 0
+    clear_cell();
+#endif
 }
 
-void MVSlot::set(const uint8_t hash, const string& key, const string& value) {
+void MVSlot::set(const uint8_t hash, const string& key, const string& value, const uint64_t flags) {
     if (kv) {
         char* p = kv.get();
         delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
                                       get_vs_direct(p) + 2);
     }
-    size_t ksize;
-    size_t vsize;
-    ksize = key.size();
-    vsize = value.size();
-    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    kv = make_persistent<char[]>(size);
-    char* p = kv.get();
-    set_ph_direct(p, hash);
+    const size_t size = buffer_size(key.size(), value.size());
+#if LEAF_INLINE_SIZE > 0
+    if (size <= LEAF_INLINE_SIZE) {
+        if (kv) kv = nullptr;
+        if (pmemobj_tx_add_range_direct(cell, size) != 0) {
+            throw pmem::transaction_error("failed to add cell to transaction");
+        }
+        fill_direct(cell, hash, key, value);
+        return;
+    }
+    clear_cell();
+#endif
+    const PMEMoid oid = pmemobj_tx_xalloc(size, 0, flags);
+    if (OID_IS_NULL(oid)) throw pmem::transaction_alloc_error("failed to allocate slot buffer");
+    kv = oid;
+    fill_direct(kv.get(), hash, key, value);
+}
+
+// An overwrite keeps the current buffer when the new value fits its usable size, as long as at
+// least half of the buffer stays in use, so shrinking a large value still releases the space.
+// Records small enough for the cell always stay in it, or move into it.
+bool MVSlot::fits(const string& value) const {
+    const size_t size = buffer_size(get_ks(), value.size());
+#if LEAF_INLINE_SIZE > 0
+    if (!kv) return size <= LEAF_INLINE_SIZE;
+    if (size <= LEAF_INLINE_SIZE) return false;
+#endif
+    const size_t usable = usable_size();
+    return size <= usable && usable <= size * 2;
+}
+
+// Only the value size and the value bytes being written are undo logged, so this must run
+// inside a transaction. Key and hash are unchanged.
+void MVSlot::set_in_place(const string& value) {
+    char* p = data();
+    char* vp = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t) + get_ks_direct(p) + 1;
+    const size_t vsize = value.size();
+    if (pmemobj_tx_add_range_direct(p + sizeof(uint32_t), sizeof(uint32_t)) != 0 ||
+        pmemobj_tx_add_range_direct(vp, vsize + 1) != 0) {
+        throw pmem::transaction_error("failed to add value to transaction");
+    }
+    set_vs_direct(p, (uint32_t) vsize);
+    memcpy(vp, value.data(), vsize);
+    vp[vsize] = 0;
+}
+
+// Fills a slot without a transaction. The new buffer is reserved, filled and persisted first,
+// then a single publish points the slot at it (and frees any old buffer), so after a crash the
+// slot holds either the old state or the new buffer, and no buffer is left unreferenced.
+// A small record is written to the cell with its hash last, which makes it visible unless a
+// buffer is still set, and the same publish then frees that buffer and clears the pointer.
+// Within an open transaction, as for a batch, the slot is filled transactionally instead.
+void MVSlot::set_atomic(PMEMobjpool* pop, const uint8_t hash, const string& key, const string& value,
+                        const uint64_t flags) {
+    if (pmemobj_tx_stage() == TX_STAGE_WORK) {
+        set(hash, key, value, flags);
+        return;
+    }
+    const size_t size = buffer_size(key.size(), value.size());
+    pobj_action actions[3];
+    int count = 0;
+#if LEAF_INLINE_SIZE > 0
+    if (size <= LEAF_INLINE_SIZE) {
+        assert(!inlined());                                              // overwritten in place
+        char* hp = cell + sizeof(uint32_t) + sizeof(uint32_t);
+        fill_direct(cell, 0, key, value);
+        pmemobj_persist(pop, cell, size);
+        *hp = hash;
+        pmemobj_persist(pop, hp, sizeof(uint8_t));
+        if (!kv) return;
+        pmemobj_defer_free(pop, kv.raw(), &actions[count++]);
+        pmemobj_set_value(pop, &actions[count++], &kv.raw_ptr()->off, 0);
+        if (pmemobj_publish(pop, actions, count) != 0) {
+            pmemobj_cancel(pop, actions, count);
+            throw pmem::transaction_error("failed to publish slot cell");
+        }
+        return;
+    }
+#endif
+    const PMEMoid oid = pmemobj_xreserve(pop, &actions[count++], size, 0, flags);
+    if (OID_IS_NULL(oid)) throw pmem::transaction_alloc_error("failed to reserve slot buffer");
+    char* p = (char*) pmemobj_direct(oid);
+    fill_direct(p, hash, key, value);
+    pmemobj_persist(pop, p, size);
+    if (kv) {
+        pmemobj_defer_free(pop, kv.raw(), &actions[count++]);
+    } else {
+        pmemobj_set_value(pop, &actions[count++], &kv.raw_ptr()->pool_uuid_lo, oid.pool_uuid_lo);
+    }
+    pmemobj_set_value(pop, &actions[count++], &kv.raw_ptr()->off, oid.off);
+    if (pmemobj_publish(pop, actions, count) != 0) {
+        pmemobj_cancel(pop, actions, count);
+        throw pmem::transaction_error("failed to publish slot buffer");
+    }
+}
+
+#if LEAF_INLINE_SIZE > 0
+// Zeroing the hash is enough to mark the cell unused. Must run inside a transaction.
+void MVSlot::clear_cell() {
+    char* hp = cell + sizeof(uint32_t) + sizeof(uint32_t);
+    if (*hp == 0) return;
+    if (pmemobj_tx_add_range_direct(hp, sizeof(uint8_t)) != 0) {
+        throw pmem::transaction_error("failed to add cell to transaction");
+    }
+    *hp = 0;
+}
+#endif
+
+size_t MVSlot::usable_size() const {
+    return pmemobj_alloc_usable_size(kv.raw());
+}
+
+size_t MVSlot::buffer_size(const size_t ksize, const size_t vsize) {
+    return ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+}
+
+void MVSlot::fill_direct(char* p, const uint8_t hash, const string& key, const string& value) {
+    const size_t ksize = key.size();
+    const size_t vsize = value.size();
     set_ks_direct(p, (uint32_t) ksize);
     set_vs_direct(p, (uint32_t) vsize);
+    set_ph_direct(p, hash);
     char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
     memcpy(kvptr, key.data(), ksize);                                       // copy key into buffer
+    kvptr[ksize] = 0;
     kvptr += ksize + 1;                                                     // advance ptr past key
     memcpy(kvptr, value.data(), vsize);                                     // copy value into buffer
+    kvptr[vsize] = 0;
 }
 
 // ===============================================================================================
-// Node invariants
+// INNER NODE METHODS
 // ===============================================================================================
 
+// Separator keys in a node usually share their leading bytes, so each node tracks how many
+// bytes all of its keys have in common and keeps the next 8 bytes of every key as a big-endian
+// integer. Searches compare those integers and only touch the key arena when they tie.
+int MVInnerNode::compare(const int idx, const uint64_t kp, std::string_view k) const {
+    if (prefixes[idx] != kp) return prefixes[idx] < kp ? -1 : 1;
+    return key(idx).compare(k);
+}
+
+// Fixed-step binary search over the prefixes. The loop always runs log2(keycount) times and
+// picks the next half without an early exit, so the compiler can use a conditional move.
+uint16_t MVInnerNode::lower_bound(std::string_view k) const {
+    if (keycount == 0) return 0;
+    const int shared = k.substr(0, prefix_len).compare(key(0).substr(0, prefix_len));
+    if (shared != 0) return (uint16_t) (shared < 0 ? 0 : keycount);     // k outside node range
+    const uint64_t kp = normalize(k, prefix_len);
+    uint16_t base = 0;
+    uint16_t n = keycount;
+    while (n > 1) {
+        const uint16_t half = n / 2;
+        base = (compare(base + half, kp, k) < 0) ? base + half : base;
+        n -= half;
+    }
+    return base + (compare(base, kp, k) < 0);
+}
+
+uint16_t MVInnerNode::upper_bound(std::string_view k) const {
+    if (keycount == 0) return 0;
+    const int shared = k.substr(0, prefix_len).compare(key(0).substr(0, prefix_len));
+    if (shared != 0) return (uint16_t) (shared < 0 ? 0 : keycount);     // k outside node range
+    const uint64_t kp = normalize(k, prefix_len);
+    uint16_t base = 0;
+    uint16_t n = keycount;
+    while (n > 1) {
+        const uint16_t half = n / 2;
+        base = (compare(base + half, kp, k) <= 0) ? base + half : base;
+        n -= half;
+    }
+    return base + (compare(base, kp, k) <= 0);
+}
+
+void MVInnerNode::insert_key(const int idx, std::string_view k) {
+    for (int i = keycount; i > idx; i--) {
+        prefixes[i] = prefixes[i - 1];
+        offsets[i] = offsets[i - 1];
+        sizes[i] = sizes[i - 1];
+    }
+    offsets[idx] = (uint32_t) arena.size();                              // keys are only appended
+    sizes[idx] = (uint32_t) k.size();
+    arena.append(k.data(), k.size());
+    keycount++;
+    if (keycount == 1 || k.substr(0, prefix_len) != key(idx == 0 ? 1 : 0).substr(0, prefix_len)) {
+        refresh_prefixes();                                              // shared bytes shrank
+    } else {
+        prefixes[idx] = normalize(k, prefix_len);
+    }
+}
+
+void MVInnerNode::truncate_keys(const uint16_t count) {
+    string compacted;
+    for (int i = 0; i < count; i++) {
+        const uint32_t offset = (uint32_t) compacted.size();
+        compacted.append(arena, offsets[i], sizes[i]);
+        offsets[i] = offset;
+    }
+    arena = move(compacted);
+    keycount = count;
+    refresh_prefixes();                                                  // shared bytes may grow
+}
+
+void MVInnerNode::refresh_prefixes() {
+    prefix_len = 0;
+    if (keycount > 0) {                                                  // first & last share least
+        const std::string_view first = key(0);
+        const std::string_view last = key(keycount - 1);
+        const size_t limit = std::min(first.size(), last.size());
+        while (prefix_len < limit && first[prefix_len] == last[prefix_len]) prefix_len++;
+    }
+    for (int i = 0; i < keycount; i++) prefixes[i] = normalize(key(i), prefix_len);
+}
+
+// Loads up to 8 key bytes starting at offset, zero-padded, so that comparing the results as
+// integers orders keys the same way as comparing their bytes (with ties for equal bytes).
+uint64_t MVInnerNode::normalize(std::string_view k, const uint32_t offset) {
+    uint64_t word = 0;
+    if (offset < k.size()) memcpy(&word, k.data() + offset, std::min<size_t>(8, k.size() - offset));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
 void MVInnerNode::assert_invariants() {
     assert(keycount <= INNER_KEYS);
     for (auto i = 0; i < keycount; ++i) {
-        assert(keys[i].size() > 0);
+        assert(sizes[i] > 0);
+        assert(offsets[i] + sizes[i] <= arena.size());
+        assert(prefixes[i] == normalize(key(i), prefix_len));
+        assert(i == 0 || key(i - 1).compare(key(i)) <= 0);
         assert(children[i] != nullptr);
     }
     assert(children[keycount] != nullptr);
@@ -701,5 +1818,184 @@ void MVInnerNode::assert_invariants() {
         assert(children[i] == nullptr);
 }
 
+// ===============================================================================================
+// CURSOR METHODS
+// ===============================================================================================
+
+// A cursor copies the pairs of one leaf into buffers it reuses, holding the tree and leaf locks
+// only while it copies, and moves within that leaf without locks. Leaving the leaf searches the
+// tree again for the pairs just above or below those copied, so writers may change, split or
+// remove leaves in between. Each leaf is seen as of one moment, and keys put behind the cursor
+// are not seen.
+bool MVTreeIterator::Valid() {
+    return pos < loaded.size();
+}
+
+void MVTreeIterator::SeekToFirst() {
+    Load(FIRST);
+}
+
+void MVTreeIterator::SeekToLast() {
+    Load(LAST);
+}
+
+void MVTreeIterator::Seek(const string& key) {
+    bound_key.assign(key);
+    Load(AT_OR_ABOVE);
+}
+
+void MVTreeIterator::Next() {
+    if (!Valid()) return;
+    if (++pos < loaded.size()) return;
+    auto& last = loaded.back();
+    bound_key.assign(records, last.offset, last.keysize);
+    Load(ABOVE);
+}
+
+void MVTreeIterator::Prev() {
+    if (!Valid()) return;
+    if (pos > 0) {
+        pos--;
+        return;
+    }
+    auto& first = loaded.front();
+    bound_key.assign(records, first.offset, first.keysize);
+    Load(BELOW);
+}
+
+std::string_view MVTreeIterator::key() {
+    auto& record = loaded[pos];
+    return std::string_view(records.data() + record.offset, record.keysize);
+}
+
+std::string_view MVTreeIterator::value() {
+    auto& record = loaded[pos];
+    return std::string_view(records.data() + record.offset + record.keysize, record.valsize);
+}
+
+// Copies the pairs within the bound from the leaf where the bound key belongs, or from the leaf
+// at either end, and moves on through neighbouring leaves until one has any.
+void MVTreeIterator::Load(const Bound bound) {
+    records.clear();
+    loaded.clear();
+    pos = 0;
+    tree->WaitForRecovery();
+    std::shared_lock<std::shared_mutex> lock(tree->shared_mutex);
+    const bool backward = bound == LAST || bound == BELOW;
+    MVLeafNode* start = bound == FIRST || bound == LAST ? tree->LeafEdge(backward)
+                                                        : tree->LeafSearch(bound_key);
+    uint8_t slots[LEAF_KEYS];
+    for (auto leafnode = start; leafnode && loaded.empty();
+         leafnode = backward ? leafnode->prev : leafnode->next) {
+        std::shared_lock<std::shared_mutex> leaflock(leafnode->mutex);
+        const int count = leafnode->sorted_slots(slots);
+        for (int i = 0; i < count; i++) {
+            const std::string_view key = leafnode->key(slots[i]);
+            if (bound == AT_OR_ABOVE && key.compare(bound_key) < 0) continue;
+            if (bound == ABOVE && key.compare(bound_key) <= 0) continue;
+            if (bound == BELOW && key.compare(bound_key) >= 0) break;
+            auto& kvslot = leafnode->leaf->slots[slots[i]].get_ro();
+            loaded.push_back({(uint32_t) records.size(), (uint32_t) key.size(), kvslot.valsize()});
+            records.append(key);
+            records.append(kvslot.val(), kvslot.valsize());
+        }
+    }
+    if (backward && !loaded.empty()) pos = loaded.size() - 1;
+}
+
+// ===============================================================================================
+// LEAF NODE METHODS
+// ===============================================================================================
+
+// With MVTREE_LEAF_ARENA the keys of a leaf are packed into one string, so lookups never touch
+// pmem until a key matches. Without it only hashes live in DRAM and keys are read from the slots.
+std::string_view MVLeafNode::key(const int slot) const {
+#if MVTREE_LEAF_ARENA
+    return std::string_view(arena.data() + offsets[slot], sizes[slot]);
+#else
+    auto& kvslot = leaf->slots[slot].get_ro();
+    return std::string_view(kvslot.key(), kvslot.keysize());
+#endif
+}
+
+void MVLeafNode::set_key(const int slot, std::string_view k) {
+    order_count = -1;
+#if MVTREE_LEAF_ARENA
+    if (arena.size() + k.size() > arena.capacity()) {                    // drop cleared keys first
+        string compacted;
+        compacted.reserve(arena.size());
+        for (int i = 0; i < LEAF_KEYS; i++) {
+            if (i == slot || hashes[i] == 0) {
+                offsets[i] = sizes[i] = 0;
+                continue;
+            }
+            const uint32_t offset = (uint32_t) compacted.size();
+            compacted.append(arena, offsets[i], sizes[i]);
+            offsets[i] = offset;
+        }
+        arena = move(compacted);
+    }
+    offsets[slot] = (uint32_t) arena.size();
+    sizes[slot] = (uint32_t) k.size();
+    arena.append(k.data(), k.size());
+#endif
+}
+
+void MVLeafNode::clear_key(const int slot) {
+    order_count = -1;
+#if MVTREE_LEAF_ARENA
+    offsets[slot] = sizes[slot] = 0;                                     // bytes reclaimed later
+#endif
+}
+
+int MVLeafNode::key_count() const {
+    int count = 0;
+    for (int slot = 0; slot < LEAF_KEYS; slot++) if (hashes[slot] != 0) count++;
+    return count;
+}
+
+// Readers share the leaf lock, so the first to sort a changed leaf claims the cached order and
+// any others use their own copy. Writers invalidate the cache while holding the lock exclusively.
+int MVLeafNode::sorted_slots(uint8_t *slots) {
+    int8_t count = order_count.load(std::memory_order_acquire);
+    if (count >= 0) {
+        memcpy(slots, order, count);
+        return count;
+    }
+    count = 0;
+    for (int slot = 0; slot < LEAF_KEYS; slot++) if (hashes[slot] != 0) slots[count++] = slot;
+    std::sort(slots, slots + count, [this](const uint8_t lhs, const uint8_t rhs) {
+        return key(lhs).compare(key(rhs)) < 0;
+    });
+    int8_t stale = -1;
+    if (order_count.compare_exchange_strong(stale, -2)) {
+        memcpy(order, slots, count);
+        order_count.store(count, std::memory_order_release);
+    }
+    return count;
+}
+
+// Hashes and keys are set ahead of the slots they describe, so after an aborted transaction they
+// are read back from the persistent leaf.
+void MVLeafNode::reload() {
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+        auto& kvslot = leaf->slots[slot].get_ro();
+        hashes[slot] = kvslot.empty() ? 0 : kvslot.hash();
+        if (hashes[slot] == 0) {
+            clear_key(slot);
+        } else {
+            set_key(slot, std::string_view(kvslot.key(), kvslot.keysize()));
+        }
+    }
+}
+
+size_t MVLeafNode::dram_bytes() const {
+#if MVTREE_LEAF_ARENA
+    return sizeof(MVLeafNode) + arena.capacity();
+#else
+    return sizeof(MVLeafNode);
+#endif
+}
+
 } // namespace kvtree
 } // namespace pmemkv
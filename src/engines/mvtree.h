@@ -32,6 +32,12 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <string_view>
+#include <thread>
 #include <vector>
 #include <shared_mutex>
 #include "../pmemkv.h"
@@ -54,52 +60,147 @@ namespace mvtree {
 
 const string ENGINE = "mvtree";                           // engine identifier
 
-#define INNER_KEYS 4                                       // maximum keys for inner nodes
+#ifndef INNER_KEYS
+#define INNER_KEYS 64                                      // maximum keys for inner nodes
+#endif
 #define INNER_KEYS_MIDPOINT (INNER_KEYS / 2)               // halfway point within the node
 #define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
 #define LEAF_KEYS 48                                       // maximum keys in tree nodes
 #define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)                 // halfway point within the node
 
+#ifndef RECOVERY_THREADS
+#define RECOVERY_THREADS 0                                 // threads used by recovery (0 for all cores)
+#endif
+#define RECOVERY_LEAVES_PER_THREAD 256                     // fewest leaves worth another thread
+#ifndef RECOVERY_SNAPSHOT
+#define RECOVERY_SNAPSHOT 1                                // save leaf directory on clean close
+#endif
+#ifndef RECOVERY_FILL_PERCENT
+#define RECOVERY_FILL_PERCENT 80                           // share of inner keys filled by recovery
+#endif
+#ifndef RECOVERY_LAZY
+#define RECOVERY_LAZY 0                                    // open before index is rebuilt
+#endif
+
+#ifndef MVTREE_COMBINING
+#define MVTREE_COMBINING 1                                 // combine writes to a leaf (0 locks each)
+#endif
+
+#ifndef MVTREE_READER_SLOTS
+#define MVTREE_READER_SLOTS 64                             // concurrent lock-free readers (0 off)
+#endif
+
+#ifndef MVTREE_LEAF_ARENA
+#define MVTREE_LEAF_ARENA 1                                // copy leaf keys to DRAM (0 reads pmem)
+#endif
+
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 1024                                 // largest slot buffer in a size class (0 off)
+#endif
+#define SLAB_MIN_SIZE 32                                   // smallest size class for slot buffers
+#define SLAB_UNITS_PER_BLOCK 1024                          // units carved from each slab run
+#define SLAB_CLASS_ID_FIRST 200                            // first pool allocation class id used
+
+#ifndef LEAF_INLINE_SIZE
+#define LEAF_INLINE_SIZE 0                                 // bytes for records kept in slots (0 off)
+#endif
+
+#ifndef COMPACT_STEP_OBJECTS
+#define COMPACT_STEP_OBJECTS 256                           // objects offered by each compact step
+#endif
+
+#ifndef MULTIGET_GROUP
+#define MULTIGET_GROUP 16                                  // keys looked up in lockstep by MultiGet
+#endif
+
+static_assert(LEAF_KEYS <= 64, "leaf hash masks are limited to 64 slots");
+static_assert(INNER_KEYS >= 2 && INNER_KEYS < 0xFFFF, "inner key count must fit in uint16_t");
+static_assert(RECOVERY_FILL_PERCENT > 0 && RECOVERY_FILL_PERCENT <= 100, "fill must be a percentage");
+static_assert(LEAF_INLINE_SIZE % 8 == 0, "inline cells keep slots 8-byte aligned");
+static_assert(MULTIGET_GROUP > 0, "lookups need a group of at least one key");
+static_assert((SLAB_MIN_SIZE & (SLAB_MIN_SIZE - 1)) == 0, "size classes start at a power of two");
+
 class MVSlot {
   public:
     uint8_t hash() const { return get_ph(); }
     uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))); }
-    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    const char* key() const { return (data() + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
     const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
     const uint32_t keysize() const { return get_ks(); }
     const uint32_t keysize_direct(char *p) const { return *((uint32_t *)(p)); }
-    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
+    const char* val() const { return (data() + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
     const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
     const uint32_t valsize() const { return get_vs(); }
     const uint32_t valsize_direct(char *p) const { return *((uint32_t *)(p + sizeof(uint32_t))); }
     void clear();
-    void set(const uint8_t hash, const string& key, const string& value);
-    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set(const uint8_t hash, const string& key, const string& value, const uint64_t flags);
+    bool fits(const string& value) const;
+    void set_in_place(const string& value);
+    void set_atomic(PMEMobjpool* pop, const uint8_t hash, const string& key, const string& value,
+                    const uint64_t flags);
+    void set_ph(uint8_t v) {*((uint8_t *)(data() + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
     void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
-    void set_ks(uint32_t v) {*((uint32_t *)(kv.get())) = v;}
+    void set_ks(uint32_t v) {*((uint32_t *)(data())) = v;}
     void set_ks_direct(char * p, uint32_t v) {*((uint32_t *)(p)) = v;}
-    void set_vs(uint32_t v) {*((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t))) = v;}
+    void set_vs(uint32_t v) {*((uint32_t *)(data() + sizeof(uint32_t))) = v;}
     void set_vs_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t))) = v;}
-    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint8_t get_ph() const {return *((uint8_t *)(data() + sizeof(uint32_t) + sizeof(uint32_t)));}
     uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
-    uint32_t get_ks() const {return *((uint32_t *)(kv.get()));}
+    uint32_t get_ks() const {return *((uint32_t *)(data()));}
     uint32_t get_ks_direct(char *p) const {return *((uint32_t *)(p));}
-    uint32_t get_vs() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t)));}
+    uint32_t get_vs() const {return *((uint32_t *)(data() + sizeof(uint32_t)));}
     uint32_t get_vs_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t)));}
-    bool empty();
+    bool empty() const;
+    bool inlined() const;
+    size_t usable_size() const;
+    PMEMoid* buffer_oid() { return kv.raw_ptr(); }         // only reference to buffer
+    static size_t buffer_size(size_t ksize, size_t vsize);
   private:
+    void fill_direct(char* p, uint8_t hash, const string& key, const string& value);
+    char* data() const;                                    // key & value, inline or out of line
+#if LEAF_INLINE_SIZE > 0
+    void clear_cell();                                     // mark inline record unused
+#endif
     persistent_ptr<char[]> kv;                             // buffer for key & value
+#if LEAF_INLINE_SIZE > 0
+    char cell[LEAF_INLINE_SIZE] = {};                      // small key & value stored in slot
+#endif
 };
 
+#if LEAF_INLINE_SIZE > 0
+// A record is inline when no buffer is set and the hash in its cell is not zero. A buffer takes
+// precedence, so a stale cell is ignored until the slot is next cleared.
+inline bool MVSlot::inlined() const { return !kv && cell[sizeof(uint32_t) + sizeof(uint32_t)] != 0; }
+inline char* MVSlot::data() const { return kv ? kv.get() : (char*) cell; }
+#else
+inline bool MVSlot::inlined() const { return false; }
+inline char* MVSlot::data() const { return kv.get(); }
+#endif
+
 struct MVLeaf {
     p<MVSlot> slots[LEAF_KEYS];                            // array of slot containers
     persistent_ptr<MVLeaf> next;                           // next leaf in unsorted list
 };
 
+const uint64_t SNAPSHOT_FORMAT =                           // identifies current leaf directory
+    (0x534E4150ULL << 32) | (LEAF_KEYS << 8) | MVTREE_LEAF_ARENA;
+
 struct MVRoot {                                            // persistent root object
     persistent_ptr<MVLeaf> head;                           // head of linked list of leaves
 };
 
+struct MVDirectory {                                       // leaf directory from clean close
+    p<uint64_t> format;                                    // SNAPSHOT_FORMAT when written
+    p<uint64_t> run_id;                                    // pool run that wrote it
+    p<uint64_t> size;                                      // bytes in contents
+    persistent_ptr<char[]> contents;                       // serialized leaf directory
+};
+
+struct MVPoolRoot {                                        // root object of a tree's own pool
+    MVRoot tree;                                           // same as roots in shared pools
+    persistent_ptr<MVDirectory> directory;                 // saved leaf directory, or null
+};
+
 struct MVInnerNode;
 
 struct MVNode {                                            // volatile nodes of the tree
@@ -109,16 +210,62 @@ struct MVNode {                                            // volatile nodes of
 };
 
 struct MVInnerNode final : MVNode {                        // volatile inner nodes of the tree
-    uint8_t keycount;                                      // count of keys in this node
-    string keys[INNER_KEYS + 1];                           // child keys plus one overflow slot
+    uint16_t keycount = 0;                                 // count of keys in this node
+    uint32_t prefix_len = 0;                               // leading bytes shared by all keys
+    uint64_t prefixes[INNER_KEYS + 1];                     // next 8 key bytes after shared ones
+    uint32_t offsets[INNER_KEYS + 1];                      // key offsets into arena plus overflow
+    uint32_t sizes[INNER_KEYS + 1];                        // key sizes plus one overflow slot
+    string arena;                                          // contiguous bytes of all keys
     unique_ptr<MVNode> children[INNER_KEYS + 2];           // child nodes plus one overflow slot
+    std::string_view key(int idx) const {                  // key at index, backed by arena
+        return std::string_view(arena.data() + offsets[idx], sizes[idx]);
+    }
+    int compare(int idx,                                   // order of key at index against k
+                uint64_t kp,
+                std::string_view k) const;
+    uint16_t lower_bound(std::string_view k) const;        // index of first key not less than k
+    uint16_t upper_bound(std::string_view k) const;        // index of first key greater than k
+    void insert_key(int idx, std::string_view k);          // insert key at index, shifting up
+    void truncate_keys(uint16_t count);                    // keep lowest keys, compacting arena
+    void refresh_prefixes();                               // recompute shared length & prefixes
+    static uint64_t normalize(std::string_view k,          // big-endian integer of 8 key bytes
+                              uint32_t offset);
     void assert_invariants();
 };
 
+struct MVWriteRequest {                                    // put or remove published by a writer
+    const string& key;                                     // key to put or remove
+    const string* value;                                   // value to put, null to remove
+    KVStatus status = FAILED;                              // result once applied
+    bool done = false;                                     // applied (under combine mutex)
+    bool split = false;                                    // leaf was full, needs the tree lock
+};
+
 struct MVLeafNode final : MVNode {                         // volatile leaf nodes of the tree
     uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
-    string keys[LEAF_KEYS];                                // keys stored in this leaf
+#if MVTREE_LEAF_ARENA
+    uint32_t offsets[LEAF_KEYS];                           // key offsets into arena
+    uint32_t sizes[LEAF_KEYS];                             // key sizes (zero when unused)
+    string arena;                                          // contiguous bytes of leaf keys
+#endif
     persistent_ptr<MVLeaf> leaf;                           // pointer to persistent leaf
+    MVLeafNode* prev = nullptr;                            // neighbouring leaf with lower keys
+    MVLeafNode* next = nullptr;                            // neighbouring leaf with higher keys
+    uint8_t order[LEAF_KEYS];                              // occupied slots in key order
+    std::atomic<int8_t> order_count{-1};                   // slots in order (-1 stale, -2 busy)
+    std::shared_mutex mutex;                               // guards slots & volatile leaf state
+    std::atomic<bool> writing{false};                      // lock-free readers must use locks
+    std::mutex combine_mutex;                              // guards pending requests & combiner
+    std::condition_variable combine_applied;               // signals when requests are done
+    vector<MVWriteRequest*> combine_pending;               // published but not yet taken
+    bool combining = false;                                // a writer is applying requests
+    std::string_view key(int slot) const;                  // key for occupied slot
+    void set_key(int slot, std::string_view k);            // remember key for slot
+    void clear_key(int slot);                              // forget key for slot
+    size_t dram_bytes() const;                             // volatile bytes held by this leaf
+    int key_count() const;                                 // count of occupied slots
+    int sorted_slots(uint8_t* slots);                      // copy order of slots, return count
+    void reload();                                         // recover hashes & keys from leaf
 };
 
 struct MVRecoveredLeaf {                                   // temporary wrapper used for recovery
@@ -126,10 +273,30 @@ struct MVRecoveredLeaf {                                   // temporary wrapper
     string max_key;                                        // highest sorting key present
 };
 
+struct MVSlabClass {                                       // allocation class for slot buffers
+    size_t unit_size;                                      // bytes in every unit of the class
+    unsigned class_id;                                     // id registered with the pool
+};
+
+struct alignas(64) MVReaderSlot {                          // announcement of one lock-free reader
+    std::atomic<const void*> node{nullptr};                // leaf read, tree while searching
+};
+
 struct MVTreeAnalysis {                                    // tree analysis structure
     size_t leaf_empty;                                     // count of persisted leaves w/o keys
     size_t leaf_prealloc;                                  // count of persisted but unused leaves
     size_t leaf_total;                                     // count of all persisted leaves
+    size_t inner_depth;                                    // count of inner levels above leaves
+    size_t inner_total;                                    // count of volatile inner nodes
+    size_t dram_per_key;                                   // volatile tree bytes per key
+    size_t slab_buffers;                                   // count of slot buffers in size classes
+    size_t slab_fill_percent;                              // share of their units holding data
+    size_t inline_records;                                 // count of records kept in slot cells
+    size_t combined_commits;                               // transactions used by put & remove
+    size_t combined_writes;                                // puts & removes applied by them
+    size_t compact_passes;                                 // compaction passes over all leaves
+    size_t compact_relocated;                              // objects moved by compaction
+    size_t fragmentation_percent;                          // share of active runs not allocated
     string path;                                           // path when constructed
 };
 
@@ -159,9 +326,16 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
                  char* value) final;
     KVStatus Get(const string& key,                        // append value to std::string
                  string* value) final;
+    KVStatus Get(void* context,                            // pass value in place to callback
+                 const string& key,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // get values for many keys at once
+                  vector<string>& values,
+                  vector<KVStatus>& statuses) final;
     KVStatus Put(const string& key,                        // copy value from std::string
                  const string& value) final;
     KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Write(const KVWriteBatch& batch) final;       // apply batch in one transaction
 
     // destroy those pmem used
     void Free() final;
@@ -170,23 +344,76 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
 
     void ListAllKeys(vector<string>& keys) final; // list all keys
 
-    size_t TotalNumKeys() final; // get total number of keys.
+    void ListKeyValuePairsBetween(const string& from,      // list pairs from <= key < to
+                                  const string& to,
+                                  vector<string>& kv_pairs) final;
+
+    size_t TotalNumKeys() final;                           // get total number of keys
+
+    KVIterator* NewIterator() final;                       // new cursor copying a leaf at a time
+
+    void Each(void* context,                               // pass every pair to callback
+              KVEachCallback* callback) final;
+    void EachAbove(void* context,                          // pass pairs with key above given key
+                   const string& key,
+                   KVEachCallback* callback) final;
+    void EachBelow(void* context,                          // pass pairs with key below given key
+                   const string& key,
+                   KVEachCallback* callback) final;
+    void EachBetween(void* context,                        // pass pairs with key1 < key < key2
+                     const string& key1,
+                     const string& key2,
+                     KVEachCallback* callback) final;
+
+    double RecoveryProgress() final;                       // share of index rebuilt since open
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
 
 
     void Analyze(MVTreeAnalysis& analysis);                // report on internal state & stats
+    bool Compact(size_t objects = COMPACT_STEP_OBJECTS);   // relocate some objects, true at end
+    void CompactInBackground(size_t objects_per_second);   // keep compacting at rate (0 stops)
   protected:
+    friend class MVTreeIterator;
+    void PutKey(const string& key,                         // put without catching failures
+                const string& value);
+    void RemoveKey(const string& key);                     // remove without catching failures
+    void RebuildIndex();                                   // rebuild volatile nodes from leaves
+    template <typename F>
+    void LeafAddTx(F&& body);                              // run body, rebuilding if it aborts
+    KVStatus Combine(MVWriteRequest& request);             // apply request, maybe with others
+    void CombineApply(MVLeafNode* leafnode,                // apply requests in one transaction
+                      vector<MVWriteRequest*>& requests);
+    void CombineApplyToLeaf(MVLeafNode* leafnode,          // apply request unless leaf is full
+                            MVWriteRequest& request);
+    KVStatus CombineApplyOne(const MVWriteRequest& request); // apply request with tree lock held
     MVLeafNode* LeafSearch(const string& key);             // find node for key
+    MVLeafNode* LeafEdge(bool highest);                    // find node for lowest or highest keys
+    void EachInRange(const string* above,                  // pass pairs between keys (null open)
+                     const string* below,
+                     void* context,
+                     KVEachCallback* callback);
+    const MVSlot* SlotSearch(const string& key,            // find occupied slot for key
+                             std::shared_lock<std::shared_mutex>& leaflock);
+    template <typename F>
+    bool SlotRead(const string& key, F&& read);            // read slot for key without locks
+    void ReadersExclude(std::atomic<bool>& writing,        // wait for lock-free readers of node
+                        const void* node);
     void LeafFillEmptySlot(MVLeafNode* leafnode,           // write first unoccupied slot found
                            uint8_t hash,
                            const string& key,
                            const string& value);
+    const MVSlot* LeafFindSlotForKey(MVLeafNode* leafnode, // find slot for matching key if present
+                                     uint8_t hash,
+                                     const string& key);
     bool LeafFillSlotForKey(MVLeafNode* leafnode,          // write slot for matching key if found
                             uint8_t hash,
                             const string& key,
                             const string& value);
+    void LeafClearSlotForKey(MVLeafNode* leafnode,         // clear slot for matching key if found
+                             uint8_t hash,
+                             const string& key);
     void LeafFillSpecificSlot(MVLeafNode* leafnode,        // write slot at specific index
                               uint8_t hash,
                               const string& key,
@@ -199,9 +426,24 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
     void InnerUpdateAfterSplit(MVNode* node,               // update parents after leaf split
                                unique_ptr<MVNode> newnode,
                                string* split_key);
+    void InnerBulkLoad(vector<MVRecoveredLeaf>& leaves);   // pack sorted leaves bottom-up
     uint8_t PearsonHash(const char* data,                  // calculate 1-byte hash for string
                         size_t size);
+    uint64_t LeafHashMask(const uint8_t* hashes,           // bitmask of slots matching hash
+                          uint8_t hash);
     void Recover();                                        // reload state from persistent pool
+    void RecoverIndex();                                   // rebuild volatile nodes from leaves
+    void WaitForRecovery();                                // block until index is rebuilt
+    void RecoverLeaves(vector<MVRecoveredLeaf>& leaves);   // scan persistent leaves
+    void RecoveryRelease();                                // drop leaves readers used to recover
+    bool RecoverSnapshot(vector<MVRecoveredLeaf>& leaves); // load leaf directory if valid
+    void SaveSnapshot();                                   // write leaf directory on close
+    void DiscardSnapshot();                                // invalidate leaf directory
+    void SlabRegister();                                   // register size classes with pool
+    uint64_t SlabFlags(size_t ksize, size_t vsize);        // allocation flags for slot buffer
+    size_t CompactLeaf(persistent_ptr<MVLeaf>& link);      // relocate leaf & buffers, return count
+    void CompactObjects(vector<PMEMoid*>& references);     // relocate objects with all references
+    void CompactLoop();                                    // background compaction until stopped
   private:
     MVTree(const MVTree&);                                 // prevent copying
     void operator=(const MVTree&);                         // prevent assigning
@@ -209,8 +451,57 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
     const string pmpath;                                   // path when constructed
     pool_base pmpool;
     persistent_ptr<MVRoot> kv_root;                                      // pointer to persistent root
+    persistent_ptr<MVPoolRoot> pool_root;                  // root of own pool, null if shared
     unique_ptr<MVNode> tree_top;                           // pointer to uppermost inner node
-    std::shared_mutex shared_mutex;
+    vector<MVSlabClass> slab_classes;                      // size classes by unit, empty if off
+    std::shared_mutex shared_mutex;                        // shared by leaf access, unique to split
+    std::atomic<size_t> combine_commits{0};                // transactions used by writers
+    std::atomic<size_t> combine_writes{0};                 // requests applied by them
+    std::atomic<size_t> total_keys{0};                     // occupied slots in volatile leaves
+    MVReaderSlot reader_slots[MVTREE_READER_SLOTS > 0 ? MVTREE_READER_SLOTS : 1];  // reader announcements
+    std::atomic<bool> tree_writing{false};                 // lock-free readers must use locks
+    bool recovered = false;                                // index is complete (under lock)
+    std::atomic<size_t> recovery_done{0};                  // recovery steps finished
+    std::atomic<size_t> recovery_total{0};                 // recovery steps expected
+    std::shared_future<void> recovery;                     // background recovery when lazy
+    vector<persistent_ptr<MVLeaf>> recovery_chain;         // persistent leaves being recovered
+    unique_ptr<std::atomic<MVLeafNode*>[]> recovery_nodes; // node of each leaf once recovered
+    std::atomic<size_t> recovery_leaves{0};                // leaves readers may look up this way
+    MVLeafNode recovery_empty = MVLeafNode();              // node standing in for empty leaves
+    persistent_ptr<MVLeaf> compact_prev;                   // leaf compacted last (under lock)
+    size_t compact_passes = 0;                             // compaction passes (under lock)
+    size_t compact_relocated = 0;                          // objects moved (under lock)
+    std::mutex compact_mutex;                              // guards compaction rate
+    std::condition_variable compact_wake;                  // signals a change of rate
+    size_t compact_rate = 0;                               // objects per second, 0 when stopped
+    std::thread compact_thread;                            // background compaction
+};
+
+struct MVCursorRecord {                                    // pair copied into a cursor
+    uint32_t offset;                                       // key offset into cursor records
+    uint32_t keysize;                                      // key bytes, value follows key
+    uint32_t valsize;                                      // value bytes
+};
+
+class MVTreeIterator final : public KVIterator {           // cursor copying a leaf at a time
+  public:
+    explicit MVTreeIterator(MVTree* tree) : tree(tree) {}
+    bool Valid() final;                                    // positioned at a pair
+    void SeekToFirst() final;                              // position at lowest key
+    void SeekToLast() final;                               // position at highest key
+    void Seek(const string& key) final;                    // position at first key not below key
+    void Next() final;                                     // move to next higher key
+    void Prev() final;                                     // move to next lower key
+    std::string_view key() final;                          // key at position, valid until moved
+    std::string_view value() final;                        // value at position, valid until moved
+  private:
+    enum Bound { FIRST, LAST, AT_OR_ABOVE, ABOVE, BELOW }; // which pairs a load copies
+    void Load(Bound bound);                                // copy pairs of first leaf with any
+    MVTree* const tree;                                    // tree walked by cursor
+    string records;                                        // keys & values of loaded pairs
+    vector<MVCursorRecord> loaded;                         // loaded pairs in key order
+    size_t pos = 0;                                        // position within loaded pairs
+    string bound_key;                                      // key that bounds the next load
 };
 
 } // namespace mvtree
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <future>
+#include <iostream>
+#include <queue>
+#include <unistd.h>
+#include "sharded.h"
+
+#define DO_LOG 0
+#define LOG(msg) if (DO_LOG) std::cout << "[sharded] " << msg << "\n"
+
+namespace pmemkv {
+namespace sharded {
+
+// ===============================================================================================
+// ShardedEngine METHODS
+// ===============================================================================================
+
+// Shard roots are allocated in the same transaction that fills the directory, so a crash while
+// creating the pool leaves either every shard or none. Shard 0 is opened first to register the
+// size classes that all shards share, and the others then recover in parallel.
+ShardedEngine::ShardedEngine(const string& path, size_t size, const string& layout,
+                             const size_t shard_count) : pmpath(path) {
+    if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
+        LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
+        pmpool = pool<ShardedRoot>::create(path.c_str(), layout, size, S_IRWXU);
+    } else {
+        LOG("Opening pool, path=" << path);
+        pmpool = pool<ShardedRoot>::open(path.c_str(), layout);
+    }
+    try {
+        auto root = pmpool.get_root();
+        if (root->shard_count == 0) {
+            if (shard_count == 0 || shard_count > SHARDED_SHARDS_MAX) {
+                throw std::invalid_argument("shard count out of range");
+            }
+            LOG("Creating shards=" << shard_count);
+            transaction::exec_tx(pmpool, [&] {
+                for (size_t i = 0; i < shard_count; i++) {
+                    root->shards[i] = make_persistent<mvtree::MVRoot>();
+                }
+                root->shard_count = shard_count;
+            });
+        }
+        PMEMobjpool* pop = pmpool.get_handle();
+        shards.resize(root->shard_count);
+        shards[0].reset(new mvtree::MVTree(pop, root->shards[0].raw()));
+        vector<std::future<void>> opening;
+        for (size_t i = 1; i < shards.size(); i++) {
+            const PMEMoid oid = root->shards[i].raw();
+            opening.push_back(std::async(std::launch::async, [this, pop, oid, i] {
+                shards[i].reset(new mvtree::MVTree(pop, oid));
+            }));
+        }
+        for (auto& shard : opening) shard.wait();
+        for (auto& shard : opening) shard.get();                         // rethrow any failure
+    } catch (...) {
+        shards.clear();
+        pmpool.close();
+        throw;
+    }
+    LOG("Opened ok, shards=" << shards.size());
+}
+
+ShardedEngine::~ShardedEngine() {
+    LOG("Closing");
+    shards.clear();
+    pmpool.close();
+    LOG("Closed ok");
+}
+
+PMEMoid ShardedEngine::GetRootOid() {
+    return pmpool.get_root().raw();
+}
+
+PMEMobjpool* ShardedEngine::GetPool() {
+    return pmpool.get_handle();
+}
+
+// ===============================================================================================
+// KEY/VALUE METHODS
+// ===============================================================================================
+
+void ShardedEngine::Analyze(ShardedAnalysis& analysis) {
+    LOG("Analyzing");
+    analysis.shard_count = shards.size();
+    analysis.shard_keys_min = 0;
+    analysis.shard_keys_max = 0;
+    for (size_t i = 0; i < shards.size(); i++) {
+        const size_t keys = shards[i]->TotalNumKeys();
+        if (i == 0 || keys < analysis.shard_keys_min) analysis.shard_keys_min = keys;
+        if (keys > analysis.shard_keys_max) analysis.shard_keys_max = keys;
+    }
+    analysis.path = pmpath;
+    LOG("Analyzed ok");
+}
+
+KVStatus ShardedEngine::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
+                            const char* key, char* value) {
+    const string ckey(key, (size_t) keybytes);
+    return shards[ShardIndex(ckey)]->Get(limit, keybytes, valuebytes, key, value);
+}
+
+KVStatus ShardedEngine::Get(const string& key, string* value) {
+    return shards[ShardIndex(key)]->Get(key, value);
+}
+
+KVStatus ShardedEngine::Get(void* context, const string& key, KVGetCallback* callback) {
+    return shards[ShardIndex(key)]->Get(context, key, callback);
+}
+
+// Keys are split by shard, so each shard looks up its own keys as one batch.
+void ShardedEngine::MultiGet(const vector<string>& keys, vector<string>& values,
+                             vector<KVStatus>& statuses) {
+    values.assign(keys.size(), string());
+    statuses.assign(keys.size(), NOT_FOUND);
+    vector<vector<size_t>> positions(shards.size());                     // indexes into keys
+    for (size_t i = 0; i < keys.size(); i++) positions[ShardIndex(keys[i])].push_back(i);
+    vector<string> shard_keys, shard_values;
+    vector<KVStatus> shard_statuses;
+    for (size_t s = 0; s < shards.size(); s++) {
+        if (positions[s].empty()) continue;
+        shard_keys.clear();
+        for (auto i : positions[s]) shard_keys.push_back(keys[i]);
+        shards[s]->MultiGet(shard_keys, shard_values, shard_statuses);
+        for (size_t j = 0; j < positions[s].size(); j++) {
+            values[positions[s][j]] = move(shard_values[j]);
+            statuses[positions[s][j]] = shard_statuses[j];
+        }
+    }
+}
+
+KVStatus ShardedEngine::Put(const string& key, const string& value) {
+    return shards[ShardIndex(key)]->Put(key, value);
+}
+
+KVStatus ShardedEngine::Remove(const string& key) {
+    return shards[ShardIndex(key)]->Remove(key);
+}
+
+// Operations on one key all go to the same shard in the order added, but each shard applies its
+// share of the batch in its own transaction, so a batch is only atomic within a shard.
+KVStatus ShardedEngine::Write(const KVWriteBatch& batch) {
+    LOG("Write batch of " << batch.Count() << " operations");
+    vector<KVWriteBatch> parts(shards.size());
+    for (auto& op : batch.Ops()) {
+        auto& part = parts[ShardIndex(op.key)];
+        if (op.remove) {
+            part.Remove(op.key);
+        } else {
+            part.Put(op.key, op.value);
+        }
+    }
+    KVStatus status = OK;
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (parts[i].Count() > 0 && shards[i]->Write(parts[i]) == FAILED) status = FAILED;
+    }
+    return status;
+}
+
+// The directory is emptied before any shard is freed, so a crash part way leaves a pool that
+// makes new shards when opened, rather than a directory of freed roots. Shards not yet freed by
+// then are leaked.
+void ShardedEngine::Free() {
+    LOG("Free the shards");
+    auto root = pmpool.get_root();
+    transaction::exec_tx(pmpool, [&] {
+        root->shard_count = 0;
+    });
+    for (auto& shard : shards) shard->Free();
+    transaction::exec_tx(pmpool, [&] {
+        for (size_t i = 0; i < shards.size(); i++) root->shards[i] = nullptr;
+    });
+}
+
+void ShardedEngine::ListAllKeyValuePairs(vector<string>& kv_pairs) {
+    for (auto& shard : shards) shard->ListAllKeyValuePairs(kv_pairs);
+}
+
+void ShardedEngine::ListAllKeys(vector<string>& keys) {
+    for (auto& shard : shards) shard->ListAllKeys(keys);
+}
+
+// Each shard lists its own pairs in key order, and shards hold disjoint keys, so merging the
+// lists by their next key keeps the combined list in order.
+void ShardedEngine::ListKeyValuePairsBetween(const string& from, const string& to,
+                                             vector<string>& kv_pairs) {
+    LOG("Listing from=" << from << ", to=" << to);
+    vector<vector<string>> parts(shards.size());
+    for (size_t i = 0; i < shards.size(); i++) {
+        shards[i]->ListKeyValuePairsBetween(from, to, parts[i]);
+    }
+    typedef std::pair<size_t, size_t> Cursor;                            // shard & next key index
+    const auto later = [&](const Cursor& lhs, const Cursor& rhs) {
+        return parts[lhs.first][lhs.second].compare(parts[rhs.first][rhs.second]) > 0;
+    };
+    std::priority_queue<Cursor, vector<Cursor>, decltype(later)> next(later);
+    for (size_t i = 0; i < parts.size(); i++) if (!parts[i].empty()) next.push({i, 0});
+    while (!next.empty()) {
+        const Cursor cursor = next.top();
+        next.pop();
+        auto& part = parts[cursor.first];
+        kv_pairs.push_back(move(part[cursor.second]));
+        kv_pairs.push_back(move(part[cursor.second + 1]));
+        if (cursor.second + 2 < part.size()) next.push({cursor.first, cursor.second + 2});
+    }
+    LOG("List ok");
+}
+
+// Callbacks see each shard's pairs in key order, one shard after another, so unlike
+// ListKeyValuePairsBetween the pairs are not ordered overall.
+void ShardedEngine::Each(void* context, KVEachCallback* callback) {
+    for (auto& shard : shards) shard->Each(context, callback);
+}
+
+void ShardedEngine::EachAbove(void* context, const string& key, KVEachCallback* callback) {
+    for (auto& shard : shards) shard->EachAbove(context, key, callback);
+}
+
+void ShardedEngine::EachBelow(void* context, const string& key, KVEachCallback* callback) {
+    for (auto& shard : shards) shard->EachBelow(context, key, callback);
+}
+
+void ShardedEngine::EachBetween(void* context, const string& key1, const string& key2,
+                                KVEachCallback* callback) {
+    for (auto& shard : shards) shard->EachBetween(context, key1, key2, callback);
+}
+
+size_t ShardedEngine::TotalNumKeys() {
+    size_t total = 0;
+    for (auto& shard : shards) total += shard->TotalNumKeys();
+    return total;
+}
+
+double ShardedEngine::RecoveryProgress() {
+    if (shards.empty()) return 1;                          // nothing to recover
+    double progress = 0;
+    for (auto& shard : shards) progress += shard->RecoveryProgress();
+    return progress / shards.size();
+}
+
+// ===============================================================================================
+// PROTECTED METHODS
+// ===============================================================================================
+
+size_t ShardedEngine::ShardIndex(const string& key) {
+    return PartitionHash(key.data(), key.size()) % shards.size();
+}
+
+// 64-bit FNV-1a, which is fixed by its definition, so keys keep their shard across builds and
+// platforms. Leaves fingerprint keys with an unrelated Pearson hash, so keys that share a shard
+// still spread across all fingerprints.
+uint64_t ShardedEngine::PartitionHash(const char* data, const size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (uint8_t) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+} // namespace sharded
+} // namespace pmemkv
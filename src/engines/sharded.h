@@ -0,0 +1,137 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "mvtree.h"
+
+using std::unique_ptr;
+using std::vector;
+using pmem::obj::p;
+using pmem::obj::persistent_ptr;
+using pmem::obj::pool;
+using pmem::obj::pool_base;
+
+namespace pmemkv {
+namespace sharded {
+
+const string ENGINE = "sharded";                           // engine identifier
+
+#ifndef SHARDED_SHARDS
+#define SHARDED_SHARDS 16                                  // shards made for new pools
+#endif
+#define SHARDED_SHARDS_MAX 256                             // most shards a pool can hold
+
+static_assert(SHARDED_SHARDS > 0 && SHARDED_SHARDS <= SHARDED_SHARDS_MAX, "shard count out of range");
+
+struct ShardedRoot {                                       // persistent root object
+    p<uint64_t> shard_count;                               // shards in directory, zero until made
+    persistent_ptr<mvtree::MVRoot> shards[SHARDED_SHARDS_MAX]; // directory of shard roots
+};
+
+struct ShardedAnalysis {                                   // sharded analysis structure
+    size_t shard_count;                                    // count of shards in pool
+    size_t shard_keys_min;                                 // fewest keys held by one shard
+    size_t shard_keys_max;                                 // most keys held by one shard
+    string path;                                           // path when constructed
+};
+
+class ShardedEngine : public KVEngine {                    // hash-partitioned mvtree engine
+  public:
+    ShardedEngine(const string& path,                      // open or create pool at path
+                  size_t size,
+                  const string& layout,
+                  size_t shard_count = SHARDED_SHARDS);    // shards when creating pool
+    ~ShardedEngine();                                      // default destructor
+
+    string Engine() final { return ENGINE; }               // engine identifier
+    KVStatus Get(int32_t limit,                            // copy value to fixed-size buffer
+                 int32_t keybytes,
+                 int32_t* valuebytes,
+                 const char* key,
+                 char* value) final;
+    KVStatus Get(const string& key,                        // append value to std::string
+                 string* value) final;
+    KVStatus Get(void* context,                            // pass value in place to callback
+                 const string& key,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // get values for many keys at once
+                  vector<string>& values,
+                  vector<KVStatus>& statuses) final;
+    KVStatus Put(const string& key,                        // copy value from std::string
+                 const string& value) final;
+    KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Write(const KVWriteBatch& batch) final;       // apply batch, atomically per shard
+
+    void Free() final;
+
+    PMEMoid GetRootOid() final;
+    PMEMobjpool* GetPool() final;
+
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final; // list all key value pairs
+    void ListAllKeys(vector<string>& keys) final;          // list all keys
+    void ListKeyValuePairsBetween(const string& from,      // list pairs from <= key < to
+                                  const string& to,
+                                  vector<string>& kv_pairs) final;
+    size_t TotalNumKeys() final;                           // get total number of keys
+    double RecoveryProgress() final;                       // share of shard indexes rebuilt
+
+    void Each(void* context,                               // pass pairs shard by shard
+              KVEachCallback* callback) final;
+    void EachAbove(void* context,                          // pass pairs with key above given key
+                   const string& key,
+                   KVEachCallback* callback) final;
+    void EachBelow(void* context,                          // pass pairs with key below given key
+                   const string& key,
+                   KVEachCallback* callback) final;
+    void EachBetween(void* context,                        // pass pairs with key1 < key < key2
+                     const string& key1,
+                     const string& key2,
+                     KVEachCallback* callback) final;
+
+    void Analyze(ShardedAnalysis& analysis);               // report on shard balance
+  protected:
+    size_t ShardIndex(const string& key);                  // index of shard holding key
+    static uint64_t PartitionHash(const char* data,        // stable 64-bit hash of key bytes
+                                  size_t size);
+  private:
+    ShardedEngine(const ShardedEngine&);                   // prevent copying
+    void operator=(const ShardedEngine&);                  // prevent assigning
+    const string pmpath;                                   // path when constructed
+    pool<ShardedRoot> pmpool;                              // pool holding all shards
+    vector<unique_ptr<mvtree::MVTree>> shards;             // open shards in directory order
+};
+
+} // namespace sharded
+} // namespace pmemkv
@@ -30,10 +30,12 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include "engines/blackhole.h"
 #include "engines/kvtree2.h"
 #include "engines/btree.h"
 #include "engines/mvtree.h"
+#include "engines/sharded.h"
 
 namespace pmemkv {
 
@@ -51,6 +53,8 @@ KVEngine* KVEngine::Open(const string& engine,
             return new kvtree2::KVTree(path, size, layout);
         } else if (engine == btree::ENGINE) {
             return new btree::BTreeEngine(path, size, layout);
+        } else if (engine == sharded::ENGINE) {
+            return new sharded::ShardedEngine(path, size, layout);
         } else {
             return nullptr;
         }
@@ -102,6 +106,8 @@ void KVEngine::Close(KVEngine* kv) {
         delete (kvtree2::KVTree*) kv;
     } else if (engine == btree::ENGINE) {
         delete (btree::BTreeEngine*) kv;
+    } else if (engine == sharded::ENGINE) {
+        delete (sharded::ShardedEngine*) kv;
     }
     kv = nullptr;
 }
@@ -113,6 +119,110 @@ void KVEngine::Free(KVEngine* kv) {
     KVEngine::Close(kv);
 }
 
+// Engines without transactional batches apply each operation on its own, stopping at the first
+// that fails, so operations before it stay applied.
+KVStatus KVEngine::Write(const KVWriteBatch& batch) {
+    for (auto& op : batch.Ops()) {
+        const KVStatus status = op.remove ? Remove(op.key) : Put(op.key, op.value);
+        if (status == FAILED) return FAILED;
+    }
+    return OK;
+}
+
+// Engines that cannot expose values in place pass a copy, which lives only as long as the call.
+KVStatus KVEngine::Get(void* context, const string& key, KVGetCallback* callback) {
+    string value;
+    const KVStatus status = Get(key, &value);
+    if (status == OK) callback(context, (int32_t) value.size(), value.data());
+    return status;
+}
+
+void KVEngine::MultiGet(const vector<string>& keys, vector<string>& values,
+                        vector<KVStatus>& statuses) {
+    values.assign(keys.size(), string());
+    statuses.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) statuses[i] = Get(keys[i], &values[i]);
+}
+
+// Engines that do not keep keys in order have no cursor, and callers fall back to the listings.
+KVIterator* KVEngine::NewIterator() {
+    return nullptr;
+}
+
+// Engines with a cursor list pairs in key order through it, and others list every pair first and
+// keep those in range, sorted by key.
+void KVEngine::ListKeyValuePairsBetween(const string& from, const string& to,
+                                        vector<string>& kv_pairs) {
+    std::unique_ptr<KVIterator> it(NewIterator());
+    if (it) {
+        for (it->Seek(from); it->Valid() && it->key().compare(to) < 0; it->Next()) {
+            kv_pairs.emplace_back(it->key());
+            kv_pairs.emplace_back(it->value());
+        }
+        return;
+    }
+    vector<string> all_pairs;
+    ListAllKeyValuePairs(all_pairs);
+    vector<size_t> in_range;                               // index of each key in range
+    for (size_t i = 0; i + 1 < all_pairs.size(); i += 2) {
+        if (all_pairs[i].compare(from) >= 0 && all_pairs[i].compare(to) < 0) in_range.push_back(i);
+    }
+    std::sort(in_range.begin(), in_range.end(),
+              [&](size_t lhs, size_t rhs) { return all_pairs[lhs] < all_pairs[rhs]; });
+    for (auto i : in_range) {
+        kv_pairs.push_back(std::move(all_pairs[i]));
+        kv_pairs.push_back(std::move(all_pairs[i + 1]));
+    }
+}
+
+// Engines with a cursor pass pairs in key order through it, and others list every pair first and
+// pass those in range in the order listed. Null bounds leave that side open.
+static void EachInRange(KVEngine* kv, const string* above, const string* below,
+                        void* context, KVEachCallback* callback) {
+    std::unique_ptr<KVIterator> it(kv->NewIterator());
+    if (it) {
+        if (above) {
+            it->Seek(*above);
+            if (it->Valid() && it->key() == *above) it->Next();
+        } else {
+            it->SeekToFirst();
+        }
+        for (; it->Valid(); it->Next()) {
+            const std::string_view key = it->key();
+            if (below && key.compare(*below) >= 0) return;
+            const std::string_view value = it->value();
+            callback(context, (int32_t) key.size(), (int32_t) value.size(), key.data(),
+                     value.data());
+        }
+        return;
+    }
+    vector<string> kv_pairs;
+    kv->ListAllKeyValuePairs(kv_pairs);
+    for (size_t i = 0; i + 1 < kv_pairs.size(); i += 2) {
+        auto& key = kv_pairs[i];
+        auto& value = kv_pairs[i + 1];
+        if ((above && key.compare(*above) <= 0) || (below && key.compare(*below) >= 0)) continue;
+        callback(context, (int32_t) key.size(), (int32_t) value.size(), key.data(), value.data());
+    }
+}
+
+void KVEngine::Each(void* context, KVEachCallback* callback) {
+    EachInRange(this, nullptr, nullptr, context, callback);
+}
+
+void KVEngine::EachAbove(void* context, const string& key, KVEachCallback* callback) {
+    EachInRange(this, &key, nullptr, context, callback);
+}
+
+void KVEngine::EachBelow(void* context, const string& key, KVEachCallback* callback) {
+    EachInRange(this, nullptr, &key, context, callback);
+}
+
+void KVEngine::EachBetween(void* context, const string& key1, const string& key2,
+                           KVEachCallback* callback) {
+    EachInRange(this, &key1, &key2, context, callback);
+}
+
 extern "C" KVEngine* kvengine_open(const char* engine, const char* path, const size_t size) {
     return KVEngine::Open(engine, path, size);
 };
@@ -141,6 +251,11 @@ extern "C" int8_t kvengine_get(KVEngine* kv, const int32_t limit, const int32_t
     return kv->Get(limit, keybytes, valuebytes, key, value);
 }
 
+extern "C" int8_t kvengine_get_in_place(KVEngine* kv, void* context, const int32_t keybytes,
+                                        const char* key, KVGetCallback* callback) {
+    return kv->Get(context, string(key, (size_t) keybytes), callback);
+}
+
 extern "C" int8_t kvengine_put(KVEngine* kv, const int32_t keybytes, int32_t* valuebytes,
                                const char* key, const char* value) {
     return kv->Put(string(key, (size_t) keybytes), string(value, (size_t) *valuebytes));
@@ -150,6 +265,52 @@ extern "C" int8_t kvengine_remove(KVEngine* kv, const int32_t keybytes, const ch
     return kv->Remove(string(key, (size_t) keybytes));
 };
 
+extern "C" KVWriteBatch* kvwritebatch_new() {
+    return new KVWriteBatch();
+}
+
+extern "C" void kvwritebatch_put(KVWriteBatch* batch, const int32_t keybytes, const int32_t valuebytes,
+                                 const char* key, const char* value) {
+    batch->Put(string(key, (size_t) keybytes), string(value, (size_t) valuebytes));
+}
+
+extern "C" void kvwritebatch_remove(KVWriteBatch* batch, const int32_t keybytes, const char* key) {
+    batch->Remove(string(key, (size_t) keybytes));
+}
+
+extern "C" void kvwritebatch_clear(KVWriteBatch* batch) {
+    batch->Clear();
+}
+
+extern "C" void kvwritebatch_delete(KVWriteBatch* batch) {
+    delete batch;
+}
+
+extern "C" int8_t kvengine_write(KVEngine* kv, const KVWriteBatch* batch) {
+    return kv->Write(*batch);
+}
+
+extern "C" void kvengine_each(KVEngine* kv, void* context, KVEachCallback* callback) {
+    kv->Each(context, callback);
+}
+
+extern "C" void kvengine_each_above(KVEngine* kv, void* context, const int32_t keybytes,
+                                    const char* key, KVEachCallback* callback) {
+    kv->EachAbove(context, string(key, (size_t) keybytes), callback);
+}
+
+extern "C" void kvengine_each_below(KVEngine* kv, void* context, const int32_t keybytes,
+                                    const char* key, KVEachCallback* callback) {
+    kv->EachBelow(context, string(key, (size_t) keybytes), callback);
+}
+
+extern "C" void kvengine_each_between(KVEngine* kv, void* context, const int32_t keybytes1,
+                                      const char* key1, const int32_t keybytes2, const char* key2,
+                                      KVEachCallback* callback) {
+    kv->EachBetween(context, string(key1, (size_t) keybytes1), string(key2, (size_t) keybytes2),
+                    callback);
+}
+
 extern "C" int8_t kvengine_get_ffi(FFIBuffer* buf) {
     return buf->kv->Get(buf->limit, buf->keybytes, &buf->valuebytes,
                         buf->data, buf->data + buf->keybytes);
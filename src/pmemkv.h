@@ -32,12 +32,25 @@
 
 #pragma once
 
+#include <stdint.h>
+
 typedef enum {                                             // status enumeration
     FAILED = -1,                                           // operation failed
     NOT_FOUND = 0,                                         // key not located
     OK = 1                                                 // successful completion
 } KVStatus;
 
+typedef void(KVEachCallback)(void* context,                // called with pair in place
+                             int32_t keybytes,
+                             int32_t valuebytes,
+                             const char* key,
+                             const char* value);
+
+// A Get callback may run while the engine holds the value, so it must not call the engine.
+typedef void(KVGetCallback)(void* context,                 // called with value in place
+                            int32_t valuebytes,
+                            const char* value);
+
 #ifdef __cplusplus
 
 #include <string>
@@ -48,6 +61,7 @@ typedef enum {                                             // status enumeration
 #include <libpmemobj++/transaction.hpp>
 #include <libpmemobj++/make_persistent_atomic.hpp>
 
+#include <string_view>
 #include <vector>
 
 
@@ -59,6 +73,39 @@ namespace pmemkv {
 
 const string LAYOUT = "pmemkv";                            // pool layout identifier
 
+class KVWriteBatch {                                       // puts & removes applied together
+  public:
+    struct Op {                                            // single batched operation
+        bool remove;                                       // remove key instead of putting value
+        string key;                                        // key to put or remove
+        string value;                                      // value to put
+    };
+    void Put(const string& key, const string& value) {     // add put of value for key
+        ops.push_back({false, key, value});
+    }
+    void Remove(const string& key) {                       // add remove of key
+        ops.push_back({true, key, string()});
+    }
+    void Clear() { ops.clear(); }                          // drop all operations
+    size_t Count() const { return ops.size(); }            // count of operations
+    const vector<Op>& Ops() const { return ops; }          // operations in order added
+  private:
+    vector<Op> ops;                                        // operations in order added
+};
+
+class KVIterator {                                         // ordered cursor over key/value pairs
+  public:
+    virtual ~KVIterator() = default;
+    virtual bool Valid() = 0;                              // positioned at a pair
+    virtual void SeekToFirst() = 0;                        // position at lowest key
+    virtual void SeekToLast() = 0;                         // position at highest key
+    virtual void Seek(const string& key) = 0;              // position at first key not below key
+    virtual void Next() = 0;                               // move to next higher key
+    virtual void Prev() = 0;                               // move to next lower key
+    virtual std::string_view key() = 0;                    // key, valid until moved or changed
+    virtual std::string_view value() = 0;                  // value, valid until moved or changed
+};
+
 class KVEngine {                                           // storage engine implementations
   public:
     // Open a pmemobj_root based KVEngine
@@ -94,9 +141,16 @@ class KVEngine {                                           // storage engine imp
                          char* value) = 0;
     virtual KVStatus Get(const string& key,                // append value to std::string
                          string* value) = 0;
+    virtual KVStatus Get(void* context,                    // pass value in place to callback
+                         const string& key,
+                         KVGetCallback* callback);
+    virtual void MultiGet(const vector<string>& keys,      // get values for many keys at once
+                          vector<string>& values,
+                          vector<KVStatus>& statuses);
     virtual KVStatus Put(const string& key,                // copy value from std::string
                          const string& value) = 0;
     virtual KVStatus Remove(const string& key) = 0;        // remove value for key
+    virtual KVStatus Write(const KVWriteBatch& batch);     // apply batch, atomically if supported
     virtual void Free() = 0;        // remove value for key
 
     virtual PMEMoid GetRootOid() = 0;
@@ -106,8 +160,29 @@ class KVEngine {                                           // storage engine imp
 
     virtual void ListAllKeys(vector<string>& keys) = 0; // list all keys
 
+    // list pairs with from <= key < to, in ascending key order
+    virtual void ListKeyValuePairsBetween(const string& from, const string& to,
+                                          vector<string>& kv_pairs);
+
     virtual size_t TotalNumKeys() = 0; // get total number of keys.
 
+    virtual KVIterator* NewIterator();                     // new cursor (null if unordered)
+
+    virtual void Each(void* context,                       // pass every pair to callback
+                      KVEachCallback* callback);
+    virtual void EachAbove(void* context,                  // pass pairs with key above given key
+                           const string& key,
+                           KVEachCallback* callback);
+    virtual void EachBelow(void* context,                  // pass pairs with key below given key
+                           const string& key,
+                           KVEachCallback* callback);
+    virtual void EachBetween(void* context,                // pass pairs with key1 < key < key2
+                             const string& key1,
+                             const string& key2,
+                             KVEachCallback* callback);
+
+    virtual double RecoveryProgress() { return 1; }        // share of index rebuilt since open
+
 };
 
 #pragma pack(push, 1)
@@ -130,6 +205,8 @@ struct KVEngine;                                           // define types as si
 typedef struct KVEngine KVEngine;
 struct FFIBuffer;
 typedef struct FFIBuffer FFIBuffer;
+struct KVWriteBatch;
+typedef struct KVWriteBatch KVWriteBatch;
 
 KVEngine* kvengine_open(const char* engine,                // open storage engine
                         const char* path,
@@ -158,6 +235,12 @@ int8_t kvengine_get(KVEngine* kv,                          // copy value to fixe
                     const char* key,
                     char* value);
 
+int8_t kvengine_get_in_place(KVEngine* kv,                 // pass value in place to callback
+                             void* context,
+                             int32_t keybytes,
+                             const char* key,
+                             KVGetCallback* callback);
+
 int8_t kvengine_put(KVEngine* kv,                          // copy value from fixed-size buffer
                     int32_t keybytes,
                     int32_t* valuebytes,
@@ -168,6 +251,49 @@ int8_t kvengine_remove(KVEngine* kv,                       // remove value for k
                        int32_t keybytes,
                        const char* key);
 
+KVWriteBatch* kvwritebatch_new();                          // create empty write batch
+
+void kvwritebatch_put(KVWriteBatch* batch,                 // add put to write batch
+                      int32_t keybytes,
+                      int32_t valuebytes,
+                      const char* key,
+                      const char* value);
+
+void kvwritebatch_remove(KVWriteBatch* batch,              // add remove to write batch
+                         int32_t keybytes,
+                         const char* key);
+
+void kvwritebatch_clear(KVWriteBatch* batch);              // drop all operations from batch
+
+void kvwritebatch_delete(KVWriteBatch* batch);             // release write batch
+
+int8_t kvengine_write(KVEngine* kv,                        // apply write batch
+                      const KVWriteBatch* batch);
+
+void kvengine_each(KVEngine* kv,                           // pass every pair to callback
+                   void* context,
+                   KVEachCallback* callback);
+
+void kvengine_each_above(KVEngine* kv,                     // pass pairs with key above given key
+                         void* context,
+                         int32_t keybytes,
+                         const char* key,
+                         KVEachCallback* callback);
+
+void kvengine_each_below(KVEngine* kv,                     // pass pairs with key below given key
+                         void* context,
+                         int32_t keybytes,
+                         const char* key,
+                         KVEachCallback* callback);
+
+void kvengine_each_between(KVEngine* kv,                   // pass pairs with key1 < key < key2
+                           void* context,
+                           int32_t keybytes1,
+                           const char* key1,
+                           int32_t keybytes2,
+                           const char* key2,
+                           KVEachCallback* callback);
+
 int8_t kvengine_get_ffi(FFIBuffer* buf);                   // FFI optimized methods
 int8_t kvengine_put_ffi(const FFIBuffer* buf);
 int8_t kvengine_remove_ffi(const FFIBuffer* buf);
@@ -60,11 +60,12 @@ static const string USAGE =
         "    readrandom             (read N values in random key order)\n"
         "    readmissing            (read N missing values in random key order)\n"
         "    deleteseq              (delete N values in sequential key order)\n"
-        "    deleterandom           (delete N values in random key order)\n";
+        "    deleterandom           (delete N values in random key order)\n"
+        "    reopen                 (close and reopen the database, recovering it)\n";
 
 // Default list of comma-separated operations to run
 static const char *FLAGS_benchmarks =
-        "fillrandom,overwrite,fillseq,readrandom,readseq,readrandom,readmissing,readrandom,deleteseq";
+        "fillrandom,overwrite,fillseq,reopen,readrandom,readseq,readrandom,readmissing,readrandom,deleteseq";
 
 // Default engine name
 static const char *FLAGS_engine = "kvtree2";
@@ -362,6 +363,7 @@ public:
 
             void (Benchmark::*method)(ThreadState *) = NULL;
             bool fresh_db = false;
+            bool reopen = false;
             int num_threads = FLAGS_threads;
 
             if (name == Slice("fillseq")) {
@@ -382,12 +384,19 @@ public:
                 method = &Benchmark::DeleteSeq;
             } else if (name == Slice("deleterandom")) {
                 method = &Benchmark::DeleteRandom;
+            } else if (name == Slice("reopen")) {
+                reopen = true;
             } else {
                 if (name != Slice()) {  // No error message for empty name
                     fprintf(stderr, "unknown benchmark '%s'\n", name.ToString().c_str());
                 }
             }
 
+            if (reopen && kv_ != NULL) {
+                pmemkv::KVEngine::Close(kv_);
+                kv_ = NULL;
+            }
+
             if (fresh_db) {
                 if (kv_ != NULL) {
                     pmemkv::KVEngine::Close(kv_);
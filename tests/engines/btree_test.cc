@@ -36,6 +36,7 @@
 using namespace pmemkv::btree;
 
 const string PATH = "/dev/shm/pmemkv";
+const string LAYOUT = "pmemkv";
 const size_t SIZE = 1024ull * 1024ull * 512ull;
 const size_t LARGE_SIZE = 1024ull * 1024ull * 1024ull * 2ull;
 
@@ -60,7 +61,7 @@ public:
 
 protected:
     void Open() {
-        kv = new BTreeEngine(PATH, POOL_SIZE);
+        kv = new BTreeEngine(PATH, POOL_SIZE, LAYOUT);
     }
 };
 
@@ -124,6 +125,21 @@ TEST_F(BTreeEngineTest, GetAppendToExternalValueTest) {
     ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "supercool");
 }
 
+static void AppendValue(void* context, int32_t valuebytes, const char* value) {
+    ((string*) context)->append(value, (size_t) valuebytes);
+}
+
+TEST_F(BTreeEngineTest, GetInPlaceTest) {
+    ASSERT_TRUE(kv->Put("key1", "cool") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", string(MAX_VALUE_SIZE, '!')) == OK) << pmemobj_errormsg();
+    string value = "super";
+    ASSERT_TRUE(kv->Get(&value, "key1", AppendValue) == OK && value == "supercool");
+    string value2;
+    ASSERT_TRUE(kv->Get(&value2, "key2", AppendValue) == OK && value2 == string(MAX_VALUE_SIZE, '!'));
+    string value3;
+    ASSERT_TRUE(kv->Get(&value3, "waldo", AppendValue) == NOT_FOUND && value3.empty());
+}
+
 TEST_F(BTreeEngineTest, GetHeadlessTest) {
     string value;
     ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
@@ -556,6 +572,21 @@ TEST_F(BTreeEngineTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
     }
 }
 
+TEST_F(BTreeEngineTest, TotalNumKeysAfterRecoveryTest) {
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    for (int i = 1; i <= SINGLE_INNER_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Put("1", "updated") == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT);
+    ASSERT_TRUE(kv->Put("new", "!") == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT + 1);
+}
+
+
 // TODO: enable this test when remove operation is implemented in versiond B tree
 /*
 TEST_F(BTreeEngineTest, UsePreallocAfterMultipleLeafRecoveryTest) {
@@ -574,6 +605,96 @@ TEST_F(BTreeEngineTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(kv->Put(to_string(LEAF_ENTRIES + 1), "!"), OK) << pmemobj_errormsg();
 }*/
 
+// =============================================================================================
+// TEST CURSORS
+// =============================================================================================
+
+const int CURSOR_LIMIT = LEAF_ENTRIES * 10;                // several linked leaves
+
+static string CursorKey(int i) {                           // fixed width sorts numerically
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08d", i);
+    return string(buf);
+}
+
+TEST_F(BTreeEngineTest, CursorTest) {
+    for (int i = 0; i < CURSOR_LIMIT; i++) {
+        const int k = (int) (((int64_t) i * 7919) % CURSOR_LIMIT) * 2;  // even keys, scattered
+        ASSERT_TRUE(kv->Put(CursorKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    std::unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    int k = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next(), k += 2) {
+        ASSERT_EQ(it->key(), CursorKey(k));
+        ASSERT_EQ(it->value(), to_string(k));
+    }
+    ASSERT_EQ(k, CURSOR_LIMIT * 2);
+    for (it->SeekToLast(); it->Valid(); it->Prev()) ASSERT_EQ(it->key(), CursorKey(k -= 2));
+    ASSERT_EQ(k, 0);
+    it->Seek(CursorKey(999));                              // missing, so next higher
+    ASSERT_EQ(it->key(), CursorKey(1000));
+    it->Prev();
+    ASSERT_EQ(it->key(), CursorKey(998));
+    it->Seek(CursorKey(1000) + "longer than any stored key");
+    ASSERT_EQ(it->key(), CursorKey(1002));
+    it->Seek(CursorKey(CURSOR_LIMIT * 2));
+    ASSERT_FALSE(it->Valid());
+}
+
+TEST_F(BTreeEngineTest, CursorEmptyTest) {
+    std::unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    it->SeekToFirst();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key1");
+    ASSERT_FALSE(it->Valid());
+}
+
+static void CollectKey(void* context, int32_t keybytes, int32_t valuebytes,
+                       const char* key, const char* value) {
+    ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+}
+
+TEST_F(BTreeEngineTest, EachThroughCursorTest) {
+    for (int k = 0; k < CURSOR_LIMIT * 2; k += 2) {
+        ASSERT_TRUE(kv->Put(CursorKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    vector<string> keys;
+    kv->Each(&keys, CollectKey);
+    ASSERT_EQ(keys.size(), CURSOR_LIMIT);
+    for (int i = 0; i < CURSOR_LIMIT; i++) ASSERT_EQ(keys[i], CursorKey(i * 2));
+    keys.clear();
+    kv->EachBetween(&keys, CursorKey(1000), CursorKey(1010), CollectKey);
+    ASSERT_EQ(keys, vector<string>({CursorKey(1002), CursorKey(1004), CursorKey(1006),
+                                    CursorKey(1008)}));
+    keys.clear();
+    kv->EachAbove(&keys, CursorKey(CURSOR_LIMIT * 2 - 3), CollectKey);
+    ASSERT_EQ(keys, vector<string>({CursorKey(CURSOR_LIMIT * 2 - 2)}));
+    keys.clear();
+    kv->EachBelow(&keys, CursorKey(1), CollectKey);
+    ASSERT_EQ(keys, vector<string>({CursorKey(0)}));
+}
+
+TEST_F(BTreeEngineTest, ListBetweenThroughCursorTest) {
+    for (int k = 0; k < CURSOR_LIMIT * 2; k += 2) {
+        ASSERT_TRUE(kv->Put(CursorKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween(CursorKey(1001), CursorKey(1006), kv_pairs);
+    ASSERT_EQ(kv_pairs, vector<string>({CursorKey(1002), "1002", CursorKey(1004), "1004"}));
+    kv_pairs.clear();
+    kv->ListKeyValuePairsBetween(CursorKey(0), CursorKey(CURSOR_LIMIT * 2), kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), CURSOR_LIMIT * 2);
+    for (int i = 0; i < CURSOR_LIMIT; i++) {
+        ASSERT_EQ(kv_pairs[i * 2], CursorKey(i * 2));
+        ASSERT_EQ(kv_pairs[i * 2 + 1], to_string(i * 2));
+    }
+    kv_pairs.clear();
+    kv->ListKeyValuePairsBetween(CursorKey(600), CursorKey(500), kv_pairs);
+    ASSERT_TRUE(kv_pairs.empty());
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -38,6 +38,7 @@ using namespace pmemkv::kvtree2;
 
 const string PATH = "/dev/shm/pmemkv";
 const string PATH_CACHED = "/tmp/pmemkv";
+const string LAYOUT = "pmemkv";
 const size_t SIZE = ((size_t) (1024 * 1024 * 1104));
 
 class KVEmptyTest : public testing::Test {
@@ -72,7 +73,7 @@ public:
 
 private:
     void Open() {
-        kv = new KVTree(PATH, SIZE);
+        kv = new KVTree(PATH, SIZE, LAYOUT);
     }
 };
 
@@ -81,7 +82,7 @@ private:
 // =============================================================================================
 
 TEST_F(KVEmptyTest, CreateInstanceTest) {
-    KVTree *kv = new KVTree(PATH, PMEMOBJ_MIN_POOL);
+    KVTree *kv = new KVTree(PATH, PMEMOBJ_MIN_POOL, LAYOUT);
     KVTreeAnalysis analysis = {};
     kv->Analyze(analysis);
     ASSERT_EQ(analysis.leaf_empty, 0);
@@ -92,7 +93,7 @@ TEST_F(KVEmptyTest, CreateInstanceTest) {
 
 TEST_F(KVEmptyTest, FailsToCreateInstanceWithInvalidPath) {
     try {
-        new KVTree("/tmp/123/234/345/456/567/678/nope.nope", PMEMOBJ_MIN_POOL);
+        new KVTree("/tmp/123/234/345/456/567/678/nope.nope", PMEMOBJ_MIN_POOL, LAYOUT);
         FAIL();
     } catch (...) {
         // do nothing, expected to happen
@@ -101,7 +102,7 @@ TEST_F(KVEmptyTest, FailsToCreateInstanceWithInvalidPath) {
 
 TEST_F(KVEmptyTest, FailsToCreateInstanceWithHugeSize) {
     try {
-        new KVTree(PATH, 9223372036854775807);   // 9.22 exabytes
+        new KVTree(PATH, 9223372036854775807, LAYOUT);   // 9.22 exabytes
         FAIL();
     } catch (...) {
         // do nothing, expected to happen
@@ -110,7 +111,7 @@ TEST_F(KVEmptyTest, FailsToCreateInstanceWithHugeSize) {
 
 TEST_F(KVEmptyTest, FailsToCreateInstanceWithTinySize) {
     try {
-        new KVTree(PATH, PMEMOBJ_MIN_POOL - 1);  // too small
+        new KVTree(PATH, PMEMOBJ_MIN_POOL - 1, LAYOUT);  // too small
         FAIL();
     } catch (...) {
         // do nothing, expected to happen
@@ -188,6 +189,23 @@ TEST_F(KVTest, GetAppendToExternalValueTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+static void AppendValue(void* context, int32_t valuebytes, const char* value) {
+    ((string*) context)->append(value, (size_t) valuebytes);
+}
+
+TEST_F(KVTest, GetInPlaceTest) {
+    ASSERT_TRUE(kv->Put("key1", "cool") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", string(5000, '!')) == OK) << pmemobj_errormsg();
+    string value = "super";
+    ASSERT_TRUE(kv->Get(&value, "key1", AppendValue) == OK && value == "supercool");
+    string value2;
+    ASSERT_TRUE(kv->Get(&value2, "key2", AppendValue) == OK && value2 == string(5000, '!'));
+    string value3;
+    ASSERT_TRUE(kv->Get(&value3, "waldo", AppendValue) == NOT_FOUND && value3.empty());
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    ASSERT_TRUE(kv->Get(&value3, "key1", AppendValue) == NOT_FOUND && value3.empty());
+}
+
 TEST_F(KVTest, GetHeadlessTest) {
     string value;
     ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
@@ -313,6 +331,41 @@ TEST_F(KVTest, PutValuesOfDifferentSizesTest) {
     ASSERT_TRUE(kv->Get("E", &value5) == OK && value5 == "123456789ABCDEFGHI");
 }
 
+TEST_F(KVTest, PutOverwriteGrowAndShrinkTest) {
+    const size_t sizes[] = {100, 100, 90, 1000, 10, 10, 0, 100000, 99000};
+    char fill = 'a';
+    for (const size_t size : sizes) {                      // reuse, grow & shrink buffer
+        ASSERT_TRUE(kv->Put("key1", string(size, fill)) == OK) << pmemobj_errormsg();
+        ASSERT_TRUE(kv->Put("key2", to_string(size)) == OK) << pmemobj_errormsg();
+        string value;
+        ASSERT_TRUE(kv->Get("key1", &value) == OK && value == string(size, fill));
+        string value2;
+        ASSERT_TRUE(kv->Get("key2", &value2) == OK && value2 == to_string(size));
+        fill++;
+    }
+    char buffer[100000];
+    int32_t valuebytes = -1;
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 4, &valuebytes, "key1", buffer) == OK);
+    ASSERT_EQ(valuebytes, 99000);
+    ASSERT_EQ(string(buffer, valuebytes), string(99000, fill - 1));
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
+TEST_F(KVTest, PutWhenAllocationFailsTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Put("key2", string(LEAF_INLINE_SIZE + 1, '!')) == FAILED);     // new key in empty slot
+    ASSERT_TRUE(kv->Put("key1", string(LEAF_INLINE_SIZE + 1000, '?')) == FAILED);  // needs new buffer
+    tx_alloc_should_fail = false;
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    string value2;
+    ASSERT_TRUE(kv->Get("key2", &value2) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get("key2", &value2) == OK && value2 == "value2");
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
 TEST_F(KVTest, PutValuesOfMaximumSizeTest) {
     // todo finish this when max is decided (#61)
 }
@@ -343,6 +396,27 @@ TEST_F(KVTest, RemoveAndInsertTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(KVTest, RemoveAndInsertRepeatedlyTest) {
+    for (int i = 1; i <= LEAF_KEYS - 1; i++)
+        ASSERT_TRUE(kv->Put(to_string(i), to_string(i)) == OK) << pmemobj_errormsg();
+    for (int round = 0; round < 100; round++) {
+        const string key = "churn" + to_string(round);
+        ASSERT_TRUE(kv->Put(key, "!") == OK) << pmemobj_errormsg();
+        string value;
+        ASSERT_TRUE(kv->Get(key, &value) == OK && value == "!");
+        ASSERT_TRUE(kv->Remove(key) == OK);
+    }
+    for (int i = 1; i <= LEAF_KEYS - 1; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == to_string(i));
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_total, 1);
+    ASSERT_GT(analysis.dram_per_key, 0);
+}
+
 TEST_F(KVTest, RemoveExistingTest) {
     ASSERT_TRUE(kv->Put("tmpkey1", "tmpvalue1") == OK) << pmemobj_errormsg();
     ASSERT_TRUE(kv->Put("tmpkey2", "tmpvalue2") == OK) << pmemobj_errormsg();
@@ -464,6 +538,77 @@ TEST_F(KVTest, PutAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(KVTest, PutOverwriteAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("key1", string(100, 'a')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", string(100, 'b')) == OK) << pmemobj_errormsg();     // in place
+    ASSERT_TRUE(kv->Put("key2", "1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", string(5000, 'c')) == OK) << pmemobj_errormsg();    // new buffer
+    Reopen();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == string(100, 'b'));
+    string value2;
+    ASSERT_TRUE(kv->Get("key2", &value2) == OK && value2 == string(5000, 'c'));
+    ASSERT_TRUE(kv->Put("key2", string(4000, 'd')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", "e") == OK) << pmemobj_errormsg();
+    Reopen();
+    string value3;
+    ASSERT_TRUE(kv->Get("key1", &value3) == OK && value3 == "e");
+    string value4;
+    ASSERT_TRUE(kv->Get("key2", &value4) == OK && value4 == string(4000, 'd'));
+}
+
+TEST_F(KVTest, SlabClassesAfterRecoveryTest) {
+    for (int i = 0; i < 100; i++) {
+        ASSERT_TRUE(kv->Put(to_string(i), string(LEAF_INLINE_SIZE + i, '!')) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Put("large", string(SLAB_MAX_SIZE + 1, '?')) == OK) << pmemobj_errormsg();
+    Analyze();
+#if SLAB_MAX_SIZE > 0
+    ASSERT_EQ(analysis.slab_buffers, 100);                 // large value in default classes
+    ASSERT_GT(analysis.slab_fill_percent, 50);
+    ASSERT_LE(analysis.slab_fill_percent, 100);
+#else
+    ASSERT_EQ(analysis.slab_buffers, 0);
+#endif
+    const size_t slab_buffers = analysis.slab_buffers;
+    Reopen();
+    ASSERT_TRUE(kv->Put("100", string(LEAF_INLINE_SIZE + 100, '!')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("0", string(LEAF_INLINE_SIZE + 200, '?')) == OK) << pmemobj_errormsg();
+    Analyze();
+    ASSERT_EQ(analysis.slab_buffers, slab_buffers > 0 ? slab_buffers + 1 : 0);
+    for (int i = 1; i <= 100; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == string(LEAF_INLINE_SIZE + i, '!'));
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("0", &value) == OK && value == string(LEAF_INLINE_SIZE + 200, '?'));
+    string value2;
+    ASSERT_TRUE(kv->Get("large", &value2) == OK && value2 == string(SLAB_MAX_SIZE + 1, '?'));
+}
+
+TEST_F(KVTest, InlineRecordsAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("small", "1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("large", string(LEAF_INLINE_SIZE + 1, '2')) == OK) << pmemobj_errormsg();
+    Analyze();
+    ASSERT_EQ(analysis.inline_records, LEAF_INLINE_SIZE > 0 ? 1 : 0);
+    ASSERT_TRUE(kv->Put("small", string(LEAF_INLINE_SIZE + 1, '3')) == OK);  // moves out of slot
+    ASSERT_TRUE(kv->Put("large", "4") == OK);                                // moves into slot
+    Reopen();
+    Analyze();
+    ASSERT_EQ(analysis.inline_records, LEAF_INLINE_SIZE > 0 ? 1 : 0);
+    string value;
+    ASSERT_TRUE(kv->Get("small", &value) == OK && value == string(LEAF_INLINE_SIZE + 1, '3'));
+    string value2;
+    ASSERT_TRUE(kv->Get("large", &value2) == OK && value2 == "4");
+    ASSERT_TRUE(kv->Remove("large") == OK);
+    Reopen();
+    Analyze();
+    ASSERT_EQ(analysis.inline_records, 0);
+    string value3;
+    ASSERT_TRUE(kv->Get("large", &value3) == NOT_FOUND);
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
 TEST_F(KVTest, RemoveAllAfterRecoveryTest) {
     ASSERT_TRUE(kv->Put("tmpkey", "tmpvalue1") == OK) << pmemobj_errormsg();
     Reopen();
@@ -551,7 +696,7 @@ TEST_F(KVTest, UsePreallocAfterSingleLeafRecoveryTest) {
 // TEST TREE WITH SINGLE INNER NODE
 // =============================================================================================
 
-const int SINGLE_INNER_LIMIT = LEAF_KEYS * (INNER_KEYS - 1);
+const int SINGLE_INNER_LIMIT = LEAF_KEYS * 3;  // leaf splits stay within one inner node
 
 TEST_F(KVTest, SingleInnerNodeAscendingTest) {
     for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
@@ -569,6 +714,7 @@ TEST_F(KVTest, SingleInnerNodeAscendingTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(KVTest, SingleInnerNodeAscendingTest2) {
@@ -587,6 +733,7 @@ TEST_F(KVTest, SingleInnerNodeAscendingTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(KVTest, SingleInnerNodeDescendingTest) {
@@ -605,6 +752,7 @@ TEST_F(KVTest, SingleInnerNodeDescendingTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 6);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(KVTest, SingleInnerNodeDescendingTest2) {
@@ -623,6 +771,7 @@ TEST_F(KVTest, SingleInnerNodeDescendingTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 // =============================================================================================
@@ -644,6 +793,7 @@ TEST_F(KVTest, SingleInnerNodeAscendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(KVTest, SingleInnerNodeAscendingAfterRecoveryTest2) {
@@ -661,6 +811,7 @@ TEST_F(KVTest, SingleInnerNodeAscendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(KVTest, SingleInnerNodeDescendingAfterRecoveryTest) {
@@ -678,6 +829,7 @@ TEST_F(KVTest, SingleInnerNodeDescendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 6);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(KVTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
@@ -695,6 +847,7 @@ TEST_F(KVTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(KVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
@@ -709,7 +862,7 @@ TEST_F(KVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     for (int i = 1; i <= LEAF_KEYS; i++) ASSERT_EQ(kv->Remove(to_string(i)), OK);
     Analyze();
     ASSERT_EQ(analysis.leaf_empty, 1);
-    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, LEAF_MERGE ? 1 : 0);  // merged leaf reused at once
     ASSERT_EQ(analysis.leaf_total, 2);
     Reopen();
     Analyze();
@@ -741,6 +894,783 @@ TEST_F(KVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 2);
 }
 
+// =============================================================================================
+// TEST PARALLEL RECOVERY & BULK LOADING
+// =============================================================================================
+
+const int PARALLEL_LIMIT = LEAF_KEYS * RECOVERY_LEAVES_PER_THREAD * 2;    // several runs of leaves
+
+TEST_F(KVTest, ParallelRecoveryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        if (istr[0] == '1') ASSERT_TRUE(kv->Remove(istr) == OK);           // empties whole leaves
+    }
+    Analyze();
+    const size_t leaf_empty = analysis.leaf_empty;
+    const size_t leaf_total = analysis.leaf_total;
+    ASSERT_GT(leaf_empty, 0);
+    Reopen();
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        if (istr[0] == '1') {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, leaf_empty);
+    ASSERT_EQ(analysis.leaf_prealloc, leaf_empty);
+    ASSERT_EQ(analysis.leaf_total, leaf_total);
+}
+
+TEST_F(KVTest, PackedInnerNodesAfterRecoveryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    const size_t inner_total = analysis.inner_total;
+    Reopen();
+    Analyze();
+    const size_t fanout = INNER_KEYS * RECOVERY_FILL_PERCENT / 100 + 1;
+    size_t expected_depth = 0;
+    size_t expected_total = 0;
+    for (size_t nodes = leaf_total; nodes > 1; nodes = (nodes + fanout - 1) / fanout) {
+        expected_depth++;
+        expected_total += (nodes + fanout - 1) / fanout;
+    }
+    ASSERT_EQ(analysis.inner_depth, expected_depth);
+    ASSERT_EQ(analysis.inner_total, expected_total);
+    ASSERT_LT(analysis.inner_total, inner_total);
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    ASSERT_TRUE(kv->Put("extra", "!") == OK) << pmemobj_errormsg();
+}
+
+// =============================================================================================
+// TEST LEAF DIRECTORY SNAPSHOT
+// =============================================================================================
+
+TEST_F(KVTest, LeafDirectoryConsumedOnReopenTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    persistent_ptr<KVRoot> root = kv->GetRootOid();
+    ASSERT_TRUE(root->directory == nullptr);               // reopen without close must scan
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+}
+
+TEST_F(KVTest, RecoveryWithoutLeafDirectoryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        if (istr[0] == '1') ASSERT_TRUE(kv->Remove(istr) == OK);           // empties whole leaves
+    }
+    Analyze();
+    const size_t leaf_empty = analysis.leaf_empty;
+    const size_t leaf_total = analysis.leaf_total;
+    delete kv;
+    auto pop = pool<KVRoot>::open(PATH, LAYOUT);
+#if RECOVERY_SNAPSHOT
+    auto root = pop.get_root();
+    ASSERT_TRUE(root->directory != nullptr);               // written by clean close
+    ASSERT_EQ(root->directory->format, SNAPSHOT_FORMAT);
+#endif
+    pop.close();                                           // this open leaves it stale
+    kv = new KVTree(PATH, SIZE, LAYOUT);
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        if (istr[0] == '1') {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, leaf_empty);
+    ASSERT_EQ(analysis.leaf_prealloc, leaf_empty);
+    ASSERT_EQ(analysis.leaf_total, leaf_total);
+}
+
+TEST_F(KVTest, StaleLeafDirectoryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    delete kv;                                             // writes leaf directory
+    auto pop = pool<KVRoot>::open(PATH, LAYOUT);
+    auto root = pop.get_root();
+    persistent_ptr<KVDirectory> stale = root->directory;
+    transaction::exec_tx(pop, [&] { root->directory = nullptr; });  // kept for later
+    pop.close();
+    kv = new KVTree(PATH, SIZE, LAYOUT);
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        if (istr[0] == '1') ASSERT_TRUE(kv->Remove(istr) == OK);
+    }
+    ASSERT_TRUE(kv->Put("extra", "!") == OK) << pmemobj_errormsg();
+    delete kv;
+    pop = pool<KVRoot>::open(PATH, LAYOUT);
+    root = pop.get_root();
+    transaction::exec_tx(pop, [&] {                        // as if changed by older code
+        auto current = root->directory;
+        if (current) {
+            delete_persistent<char[]>(current->contents, current->size);
+            delete_persistent<KVDirectory>(current);
+        }
+        root->directory = stale;
+    });
+    pop.close();
+    kv = new KVTree(PATH, SIZE, LAYOUT);                   // must scan, not trust it
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        if (istr[0] == '1') {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("extra", &value) == OK && value == "!");
+    ASSERT_TRUE(root->directory == nullptr);               // discarded after use
+}
+
+TEST_F(KVTest, LeafDirectoryAfterFailedSplitTest) {
+    for (int i = 0; i <= LEAF_KEYS; i++) ASSERT_TRUE(kv->Put(to_string(i), "?") == OK);
+    for (int i = 0; i <= LEAF_KEYS; i++) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    Reopen();                                              // empty leaves are preallocated
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    ASSERT_TRUE(analysis.leaf_prealloc >= 2);
+    for (int i = 0; i < LEAF_KEYS; i++) {                  // fills head leaf
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    tx_alloc_should_fail = true;                           // split moves slots, then fails
+    const KVStatus status = kv->Put("new", string(LEAF_INLINE_SIZE + 100, '!'));
+    tx_alloc_should_fail = false;
+    ASSERT_TRUE(status == FAILED);
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS);
+    for (int pass = 0; pass < 2; pass++) {
+        Reopen();                                          // through leaf directory
+        for (int i = 0; i < LEAF_KEYS; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+        Analyze();
+        ASSERT_EQ(analysis.leaf_total, leaf_total);
+        ASSERT_EQ(analysis.leaf_prealloc, leaf_total - 1 - pass);  // none leaked
+        ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS + pass);
+        ASSERT_TRUE(kv->Put("new", "?") == OK) << pmemobj_errormsg();
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("new", &value) == OK && value == "?");
+}
+
+// =============================================================================================
+// TEST ORDERED RANGE SCANS
+// =============================================================================================
+
+const int RANGE_LIMIT = LEAF_KEYS * INNER_KEYS * 2;        // several inner levels
+
+static string RangeKey(int i) {                            // fixed width sorts numerically
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08d", i);
+    return string(buf);
+}
+
+static void PutRangeKeys(KVTree* kv) {                    // scattered order, every third removed
+    for (int i = 0; i < RANGE_LIMIT; i++) {
+        const int k = (int) (((int64_t) i * 7919) % RANGE_LIMIT);
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    for (int k = 0; k < RANGE_LIMIT; k += 3) ASSERT_TRUE(kv->Remove(RangeKey(k)) == OK);
+}
+
+static void CheckRangeKeys(KVTree* kv, int from, int to) { // pairs for from <= key < to
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween(RangeKey(from), RangeKey(to), kv_pairs);
+    size_t i = 0;
+    for (int k = std::max(from, 0); k < std::min(to, RANGE_LIMIT); k++) {
+        if (k % 3 == 0) continue;
+        ASSERT_LT(i + 1, kv_pairs.size());
+        ASSERT_EQ(kv_pairs[i++], RangeKey(k));
+        ASSERT_EQ(kv_pairs[i++], to_string(k));
+    }
+    ASSERT_EQ(i, kv_pairs.size());
+}
+
+TEST_F(KVTest, RangeScanTest) {
+    PutRangeKeys(kv);
+    CheckRangeKeys(kv, 0, RANGE_LIMIT);
+    CheckRangeKeys(kv, 1000, 1001);
+    CheckRangeKeys(kv, 1000, 1003);
+    CheckRangeKeys(kv, LEAF_KEYS, RANGE_LIMIT - LEAF_KEYS);
+    CheckRangeKeys(kv, RANGE_LIMIT - 10, RANGE_LIMIT + 10);
+    CheckRangeKeys(kv, 500, 500);
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween(RangeKey(600), RangeKey(500), kv_pairs);
+    ASSERT_TRUE(kv_pairs.empty());
+}
+
+TEST_F(KVTest, RangeScanAfterRecoveryTest) {
+    PutRangeKeys(kv);
+    Reopen();
+    CheckRangeKeys(kv, 0, RANGE_LIMIT);
+    CheckRangeKeys(kv, 777, 7777);
+    for (int k = 0; k < RANGE_LIMIT; k += 3) {                // splits leaves linked by recovery
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween(RangeKey(0), RangeKey(RANGE_LIMIT), kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), RANGE_LIMIT * 2);
+    for (int k = 0; k < RANGE_LIMIT; k++) ASSERT_EQ(kv_pairs[k * 2], RangeKey(k));
+}
+
+// =============================================================================================
+// TEST WRITE BATCHES
+// =============================================================================================
+
+const int BATCH_LIMIT = LEAF_KEYS * 10;  // batch spans several leaf splits
+
+TEST_F(KVTest, WriteBatchTest) {
+    ASSERT_TRUE(kv->Put("removed", "?") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("replaced", "?") == OK) << pmemobj_errormsg();
+    pmemkv::KVWriteBatch batch;
+    for (int i = 0; i < BATCH_LIMIT; i++) batch.Put(to_string(i), to_string(i));
+    batch.Remove("removed");
+    batch.Put("replaced", string(LEAF_INLINE_SIZE + 100, '!'));
+    batch.Remove("1");
+    batch.Put("1", "again");                               // applied in the order added
+    ASSERT_EQ(batch.Count(), BATCH_LIMIT + 4);
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 2; i < BATCH_LIMIT; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr);
+        }
+        string value;
+        ASSERT_TRUE(kv->Get("1", &value) == OK && value == "again");
+        string value2;
+        ASSERT_TRUE(kv->Get("removed", &value2) == NOT_FOUND);
+        string value3;
+        ASSERT_TRUE(kv->Get("replaced", &value3) == OK && value3 == string(LEAF_INLINE_SIZE + 100, '!'));
+        ASSERT_EQ(kv->TotalNumKeys(), BATCH_LIMIT + 1);
+        Reopen();
+    }
+}
+
+TEST_F(KVTest, WriteBatchWhenAllocationFailsTest) {
+    pmemkv::KVWriteBatch batch;
+    for (int i = 0; i < BATCH_LIMIT; i++) batch.Put(to_string(i), to_string(i));
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    batch.Clear();
+    for (int i = 0; i < BATCH_LIMIT; i += 2) batch.Remove(to_string(i));
+    batch.Put("1", "?");                                   // overwritten in place
+    batch.Put("new", string(LEAF_INLINE_SIZE + 100, '!'));  // needs new buffer
+    tx_alloc_should_fail = true;
+    const KVStatus status = kv->Write(batch);
+    tx_alloc_should_fail = false;
+    ASSERT_TRUE(status == FAILED);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < BATCH_LIMIT; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr);
+        }
+        string value;
+        ASSERT_TRUE(kv->Get("new", &value) == NOT_FOUND);
+        ASSERT_TRUE(kv->Put(to_string(BATCH_LIMIT + pass), "more") == OK) << pmemobj_errormsg();
+        ASSERT_EQ(kv->TotalNumKeys(), BATCH_LIMIT + pass + 1);
+        Reopen();
+    }
+}
+
+// =============================================================================================
+// TEST LEAF MERGING
+// =============================================================================================
+
+const int MERGE_LIMIT = LEAF_KEYS * INNER_KEYS;            // two inner levels
+
+TEST_F(KVTest, RemoveAllMergesLeavesTest) {
+    for (int i = 0; i < MERGE_LIMIT; i++) {
+        ASSERT_TRUE(kv->Put(RangeKey(i), to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_GE(analysis.inner_depth, 2);
+    for (int i = 0; i < MERGE_LIMIT; i++) ASSERT_TRUE(kv->Remove(RangeKey(i)) == OK);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, leaf_total);
+    ASSERT_EQ(analysis.leaf_total, leaf_total);
+#if LEAF_MERGE
+    ASSERT_EQ(analysis.leaf_prealloc, leaf_total - 1);     // all but top leaf reusable
+    ASSERT_EQ(analysis.inner_depth, 0);
+#endif
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+
+    for (int i = 0; i < MERGE_LIMIT; i++) {                // scattered inserts reuse leaves
+        const int k = (int) (((int64_t) i * 7919) % MERGE_LIMIT);
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < MERGE_LIMIT; i++) {
+            string value;
+            ASSERT_TRUE(kv->Get(RangeKey(i), &value) == OK && value == to_string(i));
+        }
+#if LEAF_MERGE
+        Analyze();
+        ASSERT_EQ(analysis.leaf_total, leaf_total);
+#endif
+        Reopen();
+    }
+}
+
+TEST_F(KVTest, RemoveMostMergesLeavesTest) {
+    for (int i = 0; i < MERGE_LIMIT; i++) {
+        const int k = (int) (((int64_t) i * 7919) % MERGE_LIMIT);
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    for (int i = 0; i < MERGE_LIMIT; i++) {                // every tenth key stays
+        if (i % 10 != 0) ASSERT_TRUE(kv->Remove(RangeKey(i)) == OK);
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        vector<string> kv_pairs;
+        kv->ListKeyValuePairsBetween(RangeKey(0), RangeKey(MERGE_LIMIT), kv_pairs);
+        ASSERT_EQ(kv_pairs.size(), (MERGE_LIMIT + 9) / 10 * 2);
+        for (int i = 0; i < MERGE_LIMIT; i++) {
+            string value;
+            if (i % 10 == 0) {
+                ASSERT_EQ(kv_pairs[i / 10 * 2], RangeKey(i));
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == OK && value == to_string(i));
+            } else {
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == NOT_FOUND);
+            }
+        }
+        Analyze();
+        ASSERT_EQ(analysis.leaf_total, leaf_total);
+#if LEAF_MERGE
+        ASSERT_LT(analysis.leaf_total - analysis.leaf_prealloc, leaf_total / 3);
+        ASSERT_LE(analysis.inner_depth, 1);
+#endif
+        Reopen();
+    }
+}
+
+TEST_F(KVTest, RemoveMergeAbortedTest) {
+    for (int i = 0; i < MERGE_LIMIT; i++) {
+        const int k = (int) (((int64_t) i * 7919) % MERGE_LIMIT);
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    const size_t leaf_prealloc = analysis.leaf_prealloc;
+    pmemkv::KVWriteBatch batch;                            // merges leaves, then fails
+    for (int i = 0; i < MERGE_LIMIT; i++) if (i % 10 != 0) batch.Remove(RangeKey(i));
+    batch.Put("new", string(LEAF_INLINE_SIZE + 100, '!'));
+    tx_alloc_should_fail = true;
+    const KVStatus status = kv->Write(batch);
+    tx_alloc_should_fail = false;
+    ASSERT_TRUE(status == FAILED);
+    for (int pass = 0; pass < 2; pass++) {
+        ASSERT_EQ(kv->TotalNumKeys(), MERGE_LIMIT);
+        for (int i = 0; i < MERGE_LIMIT; i++) {
+            string value;
+            ASSERT_TRUE(kv->Get(RangeKey(i), &value) == OK && value == to_string(i));
+        }
+        Analyze();
+        ASSERT_EQ(analysis.leaf_total, leaf_total);
+        ASSERT_EQ(analysis.leaf_prealloc, leaf_prealloc);  // none leaked or reused twice
+        Reopen();
+    }
+    for (int i = 0; i < MERGE_LIMIT; i++) {                // merges again, now for good
+        if (i % 10 != 0) ASSERT_TRUE(kv->Remove(RangeKey(i)) == OK);
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), (MERGE_LIMIT + 9) / 10);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), (MERGE_LIMIT + 9) / 10);
+}
+
+// =============================================================================================
+// TEST ONLINE COMPACTION
+// =============================================================================================
+
+const int COMPACT_LIMIT = LEAF_KEYS * 20;                 // several leaves of varied buffers
+
+static string CompactValue(int i) {                        // sizes spread over many classes
+    return string(LEAF_INLINE_SIZE + 1 + (i * 37) % 700, (char) ('a' + i % 26));
+}
+
+TEST_F(KVTest, CompactTest) {
+    for (int i = 0; i < COMPACT_LIMIT; i++) {
+        ASSERT_TRUE(kv->Put(RangeKey(i), CompactValue(i)) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < COMPACT_LIMIT; i++) {              // leave runs sparsely used
+        if (i % 4 != 0) ASSERT_TRUE(kv->Remove(RangeKey(i)) == OK);
+    }
+    Analyze();
+    ASSERT_EQ(analysis.compact_passes, 0);
+    const size_t fragmentation = analysis.fragmentation_percent;
+    ASSERT_GT(fragmentation, 0);
+    int steps = 0;
+    while (!kv->Compact(LEAF_KEYS)) {                      // writes go on between steps
+        const int i = COMPACT_LIMIT + steps++;
+        ASSERT_TRUE(kv->Put(RangeKey(i), CompactValue(i)) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_GT(steps, 1);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < COMPACT_LIMIT + steps; i++) {
+            string value;
+            if (i % 4 == 0 || i >= COMPACT_LIMIT) {
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == OK && value == CompactValue(i));
+            } else {
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == NOT_FOUND);
+            }
+        }
+        vector<string> kv_pairs;
+        kv->ListKeyValuePairsBetween(RangeKey(0), RangeKey(COMPACT_LIMIT), kv_pairs);
+        ASSERT_EQ(kv_pairs.size(), COMPACT_LIMIT / 4 * 2);
+        if (pass == 0) {
+            Analyze();
+            ASSERT_EQ(analysis.compact_passes, 1);
+            ASSERT_GT(analysis.compact_relocated, 0);
+            ASSERT_LE(analysis.fragmentation_percent, fragmentation);
+        }
+        Reopen();
+    }
+}
+
+TEST_F(KVTest, CompactEmptyTest) {
+    ASSERT_TRUE(kv->Compact());
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("key1") == OK);                 // top leaf stays, empty
+    ASSERT_TRUE(kv->Compact());
+    Analyze();
+    ASSERT_EQ(analysis.compact_passes, 2);
+    ASSERT_EQ(analysis.leaf_total, 1);
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "value2");
+}
+
+// =============================================================================================
+// TEST MULTIGET
+// =============================================================================================
+
+TEST_F(KVTest, MultiGetTest) {
+    PutRangeKeys(kv);
+    ASSERT_TRUE(kv->Put(RangeKey(1), string(5000, '!')) == OK) << pmemobj_errormsg();
+    vector<string> keys;
+    for (int i = 0; i < RANGE_LIMIT; i += 7) {              // scattered, some removed
+        keys.push_back(RangeKey((int) (((int64_t) i * 7919) % RANGE_LIMIT)));
+    }
+    keys.push_back("missing");
+    keys.push_back(RangeKey(1));                           // repeated in the same group
+    keys.push_back(RangeKey(1));
+    keys.push_back("");
+    vector<string> values;
+    vector<KVStatus> statuses;
+    kv->MultiGet(keys, values, statuses);
+    ASSERT_EQ(values.size(), keys.size());
+    ASSERT_EQ(statuses.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        string value;
+        const KVStatus status = kv->Get(keys[i], &value);
+        ASSERT_TRUE(statuses[i] == status) << keys[i];
+        ASSERT_EQ(values[i], value);
+    }
+    ASSERT_TRUE(statuses[keys.size() - 4] == NOT_FOUND);
+    ASSERT_EQ(values[keys.size() - 2], string(5000, '!'));
+    Reopen();
+    vector<string> reopened;
+    kv->MultiGet(keys, reopened, statuses);
+    ASSERT_EQ(reopened, values);
+}
+
+TEST_F(KVTest, MultiGetEmptyTest) {
+    vector<string> values{"stale"};
+    vector<KVStatus> statuses;
+    kv->MultiGet({"key1", "key2"}, values, statuses);
+    ASSERT_EQ(values, vector<string>({"", ""}));
+    ASSERT_TRUE(statuses.size() == 2 && statuses[0] == NOT_FOUND && statuses[1] == NOT_FOUND);
+    kv->MultiGet({}, values, statuses);
+    ASSERT_TRUE(values.empty() && statuses.empty());
+}
+
+// =============================================================================================
+// TEST KEY COUNTS
+// =============================================================================================
+
+TEST_F(KVTest, TotalNumKeysTest) {
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    PutRangeKeys(kv);
+    const size_t expected = RANGE_LIMIT - (RANGE_LIMIT + 2) / 3;
+    ASSERT_EQ(kv->TotalNumKeys(), expected);
+    ASSERT_TRUE(kv->Put(RangeKey(1), "overwritten") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put(RangeKey(2), string(1000, '!')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove(RangeKey(3)) == OK);            // already removed
+    ASSERT_TRUE(kv->Remove("missing") == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), expected);
+    ASSERT_TRUE(kv->Put(RangeKey(0), "0") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove(RangeKey(4)) == OK);
+    ASSERT_TRUE(kv->Remove(RangeKey(5)) == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), expected - 1);
+    pmemkv::KVWriteBatch batch;                            // aborted batch counts nothing
+    batch.Put(RangeKey(3), "3");
+    batch.Remove(RangeKey(7));
+    batch.Put("new", string(LEAF_INLINE_SIZE + 100, '!'));
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    ASSERT_EQ(kv->TotalNumKeys(), expected - 1);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), expected - 1);
+    for (int k = 0; k < RANGE_LIMIT; k++) ASSERT_TRUE(kv->Remove(RangeKey(k)) == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+}
+
+// =============================================================================================
+// TEST CURSORS
+// =============================================================================================
+
+TEST_F(KVTest, CursorTest) {
+    PutRangeKeys(kv);
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    int k = 1;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        ASSERT_EQ(it->key(), RangeKey(k));
+        ASSERT_EQ(it->value(), to_string(k));
+        k += (k % 3 == 1) ? 1 : 2;                         // every third key removed
+    }
+    ASSERT_GE(k, RANGE_LIMIT);
+    k = (RANGE_LIMIT - 1) % 3 == 0 ? RANGE_LIMIT - 2 : RANGE_LIMIT - 1;
+    for (it->SeekToLast(); it->Valid(); it->Prev()) {
+        ASSERT_EQ(it->key(), RangeKey(k));
+        k -= (k % 3 == 2) ? 1 : 2;
+    }
+    ASSERT_LE(k, 0);
+    it->Seek(RangeKey(999));                               // removed, so next higher
+    ASSERT_TRUE(it->Valid());
+    ASSERT_EQ(it->key(), RangeKey(1000));
+    it->Prev();
+    it->Prev();
+    ASSERT_EQ(it->key(), RangeKey(997));
+    it->Seek(RangeKey(0));
+    ASSERT_EQ(it->key(), RangeKey(1));
+    it->Prev();
+    ASSERT_FALSE(it->Valid());
+    it->Seek(RangeKey(RANGE_LIMIT));
+    ASSERT_FALSE(it->Valid());
+    it->Seek("");
+    ASSERT_EQ(it->key(), RangeKey(1));
+}
+
+TEST_F(KVTest, CursorWithChangesTest) {
+    PutRangeKeys(kv);
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    it->Seek(RangeKey(1000));
+    ASSERT_TRUE(kv->Remove(RangeKey(1000)) == OK);         // cursor moves to next higher key
+    ASSERT_TRUE(kv->Put(RangeKey(1002), "new") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(it->Valid());
+    ASSERT_EQ(it->key(), RangeKey(1001));
+    it->Next();
+    ASSERT_EQ(it->key(), RangeKey(1002));
+    ASSERT_EQ(it->value(), "new");
+    it->Seek(RangeKey(2000));
+    ASSERT_TRUE(kv->Remove(RangeKey(2000)) == OK);         // steps back from next higher key
+    it->Prev();
+    ASSERT_EQ(it->key(), RangeKey(1999));
+    int count = 0;                                         // remove all keys as they are passed
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        ASSERT_TRUE(kv->Remove(string(it->key())) == OK);
+        count++;
+    }
+    ASSERT_EQ(count, RANGE_LIMIT - (RANGE_LIMIT + 2) / 3 - 1);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    it->SeekToFirst();
+    ASSERT_FALSE(it->Valid());
+}
+
+TEST_F(KVTest, CursorWithCompactTest) {
+    PutRangeKeys(kv);
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    int k = 1;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        kv->Compact(LEAF_KEYS);                            // moves leaves between steps
+        ASSERT_EQ(it->key(), RangeKey(k));
+        ASSERT_EQ(it->value(), to_string(k));
+        k += (k % 3 == 1) ? 1 : 2;
+    }
+    ASSERT_GE(k, RANGE_LIMIT);
+    it->Seek(RangeKey(1000));
+    while (!kv->Compact());                                // finishes pass
+    it->Prev();
+    ASSERT_EQ(it->key(), RangeKey(998));
+    ASSERT_EQ(it->value(), "998");
+}
+
+TEST_F(KVTest, CursorAfterRecoveryTest) {
+    PutRangeKeys(kv);
+    Reopen();
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    int count = 0;
+    string last;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        ASSERT_LT(last, it->key());
+        last = string(it->key());
+        count++;
+    }
+    ASSERT_EQ(count, RANGE_LIMIT - (RANGE_LIMIT + 2) / 3);
+}
+
+TEST_F(KVTest, CursorEmptyTest) {
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    it->SeekToFirst();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key1");
+    ASSERT_FALSE(it->Valid());
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("key1") == OK);                 // top leaf stays, empty
+    it->SeekToLast();
+    ASSERT_FALSE(it->Valid());
+}
+
+// =============================================================================================
+// TEST EACH CALLBACKS
+// =============================================================================================
+
+static void CollectPair(void* context, int32_t keybytes, int32_t valuebytes,
+                        const char* key, const char* value) {
+    auto kv_pairs = (vector<string>*) context;
+    kv_pairs->push_back(string(key, (size_t) keybytes));
+    kv_pairs->push_back(string(value, (size_t) valuebytes));
+}
+
+static void CheckEachPairs(const vector<string>& kv_pairs, // above < key < below
+                           int above, int below) {
+    int k = above + 1;
+    for (size_t i = 0; i < kv_pairs.size(); i += 2) {
+        if (k % 3 == 0) k++;                               // every third key removed
+        ASSERT_EQ(kv_pairs[i], RangeKey(k));
+        ASSERT_EQ(kv_pairs[i + 1], to_string(k));
+        k++;
+    }
+    if (k % 3 == 0) k++;
+    ASSERT_GE(k, below);
+}
+
+TEST_F(KVTest, EachTest) {
+    PutRangeKeys(kv);
+    vector<string> kv_pairs;
+    kv->Each(&kv_pairs, CollectPair);
+    CheckEachPairs(kv_pairs, 0, RANGE_LIMIT);
+    kv_pairs.clear();
+    kv->EachAbove(&kv_pairs, RangeKey(1000), CollectPair);
+    CheckEachPairs(kv_pairs, 1000, RANGE_LIMIT);
+    kv_pairs.clear();
+    kv->EachBelow(&kv_pairs, RangeKey(1000), CollectPair);
+    CheckEachPairs(kv_pairs, 0, 1000);
+    kv_pairs.clear();
+    kv->EachBetween(&kv_pairs, RangeKey(999), RangeKey(2001), CollectPair); // removed low bound
+    CheckEachPairs(kv_pairs, 999, 2001);
+    kv_pairs.clear();
+    kv->EachBetween(&kv_pairs, RangeKey(1000), RangeKey(1001), CollectPair);
+    ASSERT_TRUE(kv_pairs.empty());
+    kv->EachAbove(&kv_pairs, RangeKey(RANGE_LIMIT), CollectPair);
+    ASSERT_TRUE(kv_pairs.empty());
+}
+
+TEST_F(KVTest, EachAfterRecoveryTest) {
+    PutRangeKeys(kv);
+    Reopen();
+    vector<string> kv_pairs;
+    kv->Each(&kv_pairs, CollectPair);
+    CheckEachPairs(kv_pairs, 0, RANGE_LIMIT);
+}
+
+TEST_F(KVTest, EachEmptyTest) {
+    vector<string> kv_pairs;
+    kv->Each(&kv_pairs, CollectPair);
+    kv->EachAbove(&kv_pairs, "key1", CollectPair);
+    kv->EachBelow(&kv_pairs, "key1", CollectPair);
+    kv->EachBetween(&kv_pairs, "key1", "key2", CollectPair);
+    ASSERT_TRUE(kv_pairs.empty());
+}
+
+// =============================================================================================
+// TEST TREE WITH SHARED KEY PREFIXES
+// =============================================================================================
+
+const int SHARED_PREFIX_LIMIT = LEAF_KEYS * INNER_KEYS;
+
+static string SharedPrefixKey(int i) {                     // long shared head, varied tails
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016d", i / 3);
+    string key(buf);
+    if (i % 3 == 1) key.push_back('\0');                   // sorts between key and key + "0"
+    if (i % 3 == 2) key.push_back('0');                    // extends both of the others
+    return key;
+}
+
+TEST_F(KVTest, SharedPrefixKeysTest) {
+    for (int i = 1; i <= SHARED_PREFIX_LIMIT; i++) {
+        string key = SharedPrefixKey(i);
+        ASSERT_TRUE(kv->Put(key, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= SHARED_PREFIX_LIMIT; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(SharedPrefixKey(i), &value) == OK && value == to_string(i));
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("0000000", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("00000000", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("9", &value) == NOT_FOUND);
+    Analyze();
+    ASSERT_GE(analysis.inner_depth, 2);
+}
+
+TEST_F(KVTest, SharedPrefixKeysAfterRecoveryTest) {
+    for (int i = SHARED_PREFIX_LIMIT; i >= 1; i--) {
+        string key = SharedPrefixKey(i);
+        ASSERT_TRUE(kv->Put(key, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    for (int i = SHARED_PREFIX_LIMIT; i >= 1; i--) {
+        string value;
+        ASSERT_TRUE(kv->Get(SharedPrefixKey(i), &value) == OK && value == to_string(i));
+    }
+    Analyze();
+    ASSERT_GE(analysis.inner_depth, 2);
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -838,7 +1768,7 @@ public:
 
     void Reopen() {
         delete kv;
-        kv = new KVTree(PATH, SIZE);
+        kv = new KVTree(PATH, SIZE, LAYOUT);
     }
 
     void Validate() {
@@ -870,7 +1800,7 @@ private:
             ASSERT_TRUE(std::system(("cp -f " + PATH_CACHED + " " + PATH).c_str()) == 0);
         } else {
             std::cout << "!!! creating cached copy at " << PATH_CACHED << "\n";
-            KVTree *kvt = new KVTree(PATH, SIZE);
+            KVTree *kvt = new KVTree(PATH, SIZE, LAYOUT);
             for (int i = 1; i <= LARGE_LIMIT; i++) {
                 string istr = to_string(i);
                 ASSERT_TRUE(kvt->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
@@ -878,7 +1808,7 @@ private:
             delete kvt;
             ASSERT_TRUE(std::system(("cp -f " + PATH + " " + PATH_CACHED).c_str()) == 0);
         }
-        kv = new KVTree(PATH, SIZE);
+        kv = new KVTree(PATH, SIZE, LAYOUT);
     }
 };
 
@@ -886,8 +1816,9 @@ const string LONGSTR = "123456789A123456789A123456789A123456789A123456789A123456
 
 TEST_F(KVFullTest, OutOfSpace1Test) {
     tx_alloc_should_fail = true;
-    ASSERT_TRUE(kv->Put("100", "?") == FAILED);
+    ASSERT_TRUE(kv->Put("100", "?") == OK);                // reuses buffer without allocating
     tx_alloc_should_fail = false;
+    ASSERT_TRUE(kv->Put("100", "100!") == OK) << pmemobj_errormsg();
     Validate();
 }
 
@@ -570,7 +570,7 @@ TEST_F(MVOidTest, UsePreallocAfterSingleLeafRecoveryTest) {
 // TEST TREE WITH SINGLE INNER NODE
 // =============================================================================================
 
-const int SINGLE_INNER_LIMIT = LEAF_KEYS * (INNER_KEYS - 1);
+const int SINGLE_INNER_LIMIT = LEAF_KEYS * 3;  // leaf splits stay within one inner node
 
 TEST_F(MVOidTest, SingleInnerNodeAscendingTest) {
     for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
@@ -588,6 +588,7 @@ TEST_F(MVOidTest, SingleInnerNodeAscendingTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVOidTest, SingleInnerNodeAscendingTest2) {
@@ -606,6 +607,7 @@ TEST_F(MVOidTest, SingleInnerNodeAscendingTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVOidTest, SingleInnerNodeDescendingTest) {
@@ -624,6 +626,7 @@ TEST_F(MVOidTest, SingleInnerNodeDescendingTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 6);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVOidTest, SingleInnerNodeDescendingTest2) {
@@ -642,6 +645,7 @@ TEST_F(MVOidTest, SingleInnerNodeDescendingTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 // =============================================================================================
@@ -663,6 +667,7 @@ TEST_F(MVOidTest, SingleInnerNodeAscendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVOidTest, SingleInnerNodeAscendingAfterRecoveryTest2) {
@@ -680,6 +685,7 @@ TEST_F(MVOidTest, SingleInnerNodeAscendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVOidTest, SingleInnerNodeDescendingAfterRecoveryTest) {
@@ -697,6 +703,7 @@ TEST_F(MVOidTest, SingleInnerNodeDescendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 6);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVOidTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
@@ -714,6 +721,7 @@ TEST_F(MVOidTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVOidTest, UsePreallocAfterMultipleLeafRecoveryTest) {
@@ -32,6 +32,7 @@
 
 #include <future>
 #include <map>
+#include <thread>
 #include "gtest/gtest.h"
 #include "../mock_tx_alloc.h"
 #include "../../src/engines/mvtree.h"
@@ -204,6 +205,23 @@ TEST_F(MVTest, GetAppendToExternalValueTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+static void AppendValue(void* context, int32_t valuebytes, const char* value) {
+    ((string*) context)->append(value, (size_t) valuebytes);
+}
+
+TEST_F(MVTest, GetInPlaceTest) {
+    ASSERT_TRUE(kv->Put("key1", "cool") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", string(5000, '!')) == OK) << pmemobj_errormsg();
+    string value = "super";
+    ASSERT_TRUE(kv->Get(&value, "key1", AppendValue) == OK && value == "supercool");
+    string value2;
+    ASSERT_TRUE(kv->Get(&value2, "key2", AppendValue) == OK && value2 == string(5000, '!'));
+    string value3;
+    ASSERT_TRUE(kv->Get(&value3, "waldo", AppendValue) == NOT_FOUND && value3.empty());
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    ASSERT_TRUE(kv->Get(&value3, "key1", AppendValue) == NOT_FOUND && value3.empty());
+}
+
 TEST_F(MVTest, GetHeadlessTest) {
     string value;
     ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
@@ -329,6 +347,41 @@ TEST_F(MVTest, PutValuesOfDifferentSizesTest) {
     ASSERT_TRUE(kv->Get("E", &value5) == OK && value5 == "123456789ABCDEFGHI");
 }
 
+TEST_F(MVTest, PutOverwriteGrowAndShrinkTest) {
+    const size_t sizes[] = {100, 100, 90, 1000, 10, 10, 0, 100000, 99000};
+    char fill = 'a';
+    for (const size_t size : sizes) {                      // reuse, grow & shrink buffer
+        ASSERT_TRUE(kv->Put("key1", string(size, fill)) == OK) << pmemobj_errormsg();
+        ASSERT_TRUE(kv->Put("key2", to_string(size)) == OK) << pmemobj_errormsg();
+        string value;
+        ASSERT_TRUE(kv->Get("key1", &value) == OK && value == string(size, fill));
+        string value2;
+        ASSERT_TRUE(kv->Get("key2", &value2) == OK && value2 == to_string(size));
+        fill++;
+    }
+    char buffer[100000];
+    int32_t valuebytes = -1;
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 4, &valuebytes, "key1", buffer) == OK);
+    ASSERT_EQ(valuebytes, 99000);
+    ASSERT_EQ(string(buffer, valuebytes), string(99000, fill - 1));
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
+TEST_F(MVTest, PutWhenAllocationFailsTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Put("key2", string(LEAF_INLINE_SIZE + 1, '!')) == FAILED);     // new key in empty slot
+    ASSERT_TRUE(kv->Put("key1", string(LEAF_INLINE_SIZE + 1000, '?')) == FAILED);  // needs new buffer
+    tx_alloc_should_fail = false;
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    string value2;
+    ASSERT_TRUE(kv->Get("key2", &value2) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get("key2", &value2) == OK && value2 == "value2");
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
 TEST_F(MVTest, PutValuesOfMaximumSizeTest) {
     // todo finish this when max is decided (#61)
 }
@@ -359,6 +412,27 @@ TEST_F(MVTest, RemoveAndInsertTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(MVTest, RemoveAndInsertRepeatedlyTest) {
+    for (int i = 1; i <= LEAF_KEYS - 1; i++)
+        ASSERT_TRUE(kv->Put(to_string(i), to_string(i)) == OK) << pmemobj_errormsg();
+    for (int round = 0; round < 100; round++) {
+        const string key = "churn" + to_string(round);
+        ASSERT_TRUE(kv->Put(key, "!") == OK) << pmemobj_errormsg();
+        string value;
+        ASSERT_TRUE(kv->Get(key, &value) == OK && value == "!");
+        ASSERT_TRUE(kv->Remove(key) == OK);
+    }
+    for (int i = 1; i <= LEAF_KEYS - 1; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == to_string(i));
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_total, 1);
+    ASSERT_GT(analysis.dram_per_key, 0);
+}
+
 TEST_F(MVTest, RemoveExistingTest) {
     ASSERT_TRUE(kv->Put("tmpkey1", "tmpvalue1") == OK) << pmemobj_errormsg();
     ASSERT_TRUE(kv->Put("tmpkey2", "tmpvalue2") == OK) << pmemobj_errormsg();
@@ -480,6 +554,77 @@ TEST_F(MVTest, PutAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(MVTest, PutOverwriteAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("key1", string(100, 'a')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", string(100, 'b')) == OK) << pmemobj_errormsg();     // in place
+    ASSERT_TRUE(kv->Put("key2", "1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", string(5000, 'c')) == OK) << pmemobj_errormsg();    // new buffer
+    Reopen();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == string(100, 'b'));
+    string value2;
+    ASSERT_TRUE(kv->Get("key2", &value2) == OK && value2 == string(5000, 'c'));
+    ASSERT_TRUE(kv->Put("key2", string(4000, 'd')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", "e") == OK) << pmemobj_errormsg();
+    Reopen();
+    string value3;
+    ASSERT_TRUE(kv->Get("key1", &value3) == OK && value3 == "e");
+    string value4;
+    ASSERT_TRUE(kv->Get("key2", &value4) == OK && value4 == string(4000, 'd'));
+}
+
+TEST_F(MVTest, SlabClassesAfterRecoveryTest) {
+    for (int i = 0; i < 100; i++) {
+        ASSERT_TRUE(kv->Put(to_string(i), string(LEAF_INLINE_SIZE + i, '!')) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Put("large", string(SLAB_MAX_SIZE + 1, '?')) == OK) << pmemobj_errormsg();
+    Analyze();
+#if SLAB_MAX_SIZE > 0
+    ASSERT_EQ(analysis.slab_buffers, 100);                 // large value in default classes
+    ASSERT_GT(analysis.slab_fill_percent, 50);
+    ASSERT_LE(analysis.slab_fill_percent, 100);
+#else
+    ASSERT_EQ(analysis.slab_buffers, 0);
+#endif
+    const size_t slab_buffers = analysis.slab_buffers;
+    Reopen();
+    ASSERT_TRUE(kv->Put("100", string(LEAF_INLINE_SIZE + 100, '!')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("0", string(LEAF_INLINE_SIZE + 200, '?')) == OK) << pmemobj_errormsg();
+    Analyze();
+    ASSERT_EQ(analysis.slab_buffers, slab_buffers > 0 ? slab_buffers + 1 : 0);
+    for (int i = 1; i <= 100; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == string(LEAF_INLINE_SIZE + i, '!'));
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("0", &value) == OK && value == string(LEAF_INLINE_SIZE + 200, '?'));
+    string value2;
+    ASSERT_TRUE(kv->Get("large", &value2) == OK && value2 == string(SLAB_MAX_SIZE + 1, '?'));
+}
+
+TEST_F(MVTest, InlineRecordsAfterRecoveryTest) {
+    ASSERT_TRUE(kv->Put("small", "1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("large", string(LEAF_INLINE_SIZE + 1, '2')) == OK) << pmemobj_errormsg();
+    Analyze();
+    ASSERT_EQ(analysis.inline_records, LEAF_INLINE_SIZE > 0 ? 1 : 0);
+    ASSERT_TRUE(kv->Put("small", string(LEAF_INLINE_SIZE + 1, '3')) == OK);  // moves out of slot
+    ASSERT_TRUE(kv->Put("large", "4") == OK);                                // moves into slot
+    Reopen();
+    Analyze();
+    ASSERT_EQ(analysis.inline_records, LEAF_INLINE_SIZE > 0 ? 1 : 0);
+    string value;
+    ASSERT_TRUE(kv->Get("small", &value) == OK && value == string(LEAF_INLINE_SIZE + 1, '3'));
+    string value2;
+    ASSERT_TRUE(kv->Get("large", &value2) == OK && value2 == "4");
+    ASSERT_TRUE(kv->Remove("large") == OK);
+    Reopen();
+    Analyze();
+    ASSERT_EQ(analysis.inline_records, 0);
+    string value3;
+    ASSERT_TRUE(kv->Get("large", &value3) == NOT_FOUND);
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
 TEST_F(MVTest, RemoveAllAfterRecoveryTest) {
     ASSERT_TRUE(kv->Put("tmpkey", "tmpvalue1") == OK) << pmemobj_errormsg();
     Reopen();
@@ -567,7 +712,7 @@ TEST_F(MVTest, UsePreallocAfterSingleLeafRecoveryTest) {
 // TEST TREE WITH SINGLE INNER NODE
 // =============================================================================================
 
-const int SINGLE_INNER_LIMIT = LEAF_KEYS * (INNER_KEYS - 1);
+const int SINGLE_INNER_LIMIT = LEAF_KEYS * 3;  // leaf splits stay within one inner node
 
 TEST_F(MVTest, SingleInnerNodeAscendingTest) {
     for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
@@ -585,6 +730,7 @@ TEST_F(MVTest, SingleInnerNodeAscendingTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVTest, SingleInnerNodeAscendingTest2) {
@@ -603,6 +749,7 @@ TEST_F(MVTest, SingleInnerNodeAscendingTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVTest, SingleInnerNodeDescendingTest) {
@@ -621,6 +768,7 @@ TEST_F(MVTest, SingleInnerNodeDescendingTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 6);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVTest, SingleInnerNodeDescendingTest2) {
@@ -639,6 +787,7 @@ TEST_F(MVTest, SingleInnerNodeDescendingTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 // =============================================================================================
@@ -660,6 +809,7 @@ TEST_F(MVTest, SingleInnerNodeAscendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVTest, SingleInnerNodeAscendingAfterRecoveryTest2) {
@@ -677,6 +827,7 @@ TEST_F(MVTest, SingleInnerNodeAscendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVTest, SingleInnerNodeDescendingAfterRecoveryTest) {
@@ -694,6 +845,7 @@ TEST_F(MVTest, SingleInnerNodeDescendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 6);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
@@ -711,6 +863,7 @@ TEST_F(MVTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_empty, 0);
     ASSERT_EQ(analysis.leaf_prealloc, 0);
     ASSERT_EQ(analysis.leaf_total, 5);
+    ASSERT_EQ(analysis.inner_depth, 1);
 }
 
 TEST_F(MVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
@@ -757,6 +910,1048 @@ TEST_F(MVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 2);
 }
 
+// =============================================================================================
+// TEST PARALLEL RECOVERY & BULK LOADING
+// =============================================================================================
+
+const int PARALLEL_LIMIT = LEAF_KEYS * RECOVERY_LEAVES_PER_THREAD * 2;    // several runs of leaves
+
+TEST_F(MVTest, ParallelRecoveryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        if (istr[0] == '1') ASSERT_TRUE(kv->Remove(istr) == OK);           // empties whole leaves
+    }
+    Analyze();
+    const size_t leaf_empty = analysis.leaf_empty;
+    const size_t leaf_total = analysis.leaf_total;
+    ASSERT_GT(leaf_empty, 0);
+    Reopen();
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        if (istr[0] == '1') {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, leaf_empty);
+    ASSERT_EQ(analysis.leaf_prealloc, leaf_empty);
+    ASSERT_EQ(analysis.leaf_total, leaf_total);
+}
+
+TEST_F(MVTest, PackedInnerNodesAfterRecoveryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    const size_t inner_total = analysis.inner_total;
+    Reopen();
+    Analyze();
+    const size_t fanout = INNER_KEYS * RECOVERY_FILL_PERCENT / 100 + 1;
+    size_t expected_depth = 0;
+    size_t expected_total = 0;
+    for (size_t nodes = leaf_total; nodes > 1; nodes = (nodes + fanout - 1) / fanout) {
+        expected_depth++;
+        expected_total += (nodes + fanout - 1) / fanout;
+    }
+    ASSERT_EQ(analysis.inner_depth, expected_depth);
+    ASSERT_EQ(analysis.inner_total, expected_total);
+    ASSERT_LT(analysis.inner_total, inner_total);
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    ASSERT_TRUE(kv->Put("extra", "!") == OK) << pmemobj_errormsg();
+}
+
+// =============================================================================================
+// TEST LEAF DIRECTORY SNAPSHOT
+// =============================================================================================
+
+TEST_F(MVTest, LeafDirectoryConsumedOnReopenTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    while (kv->RecoveryProgress() < 1) std::this_thread::yield();          // when RECOVERY_LAZY
+    persistent_ptr<MVPoolRoot> root = kv->GetRootOid();
+    ASSERT_TRUE(root->directory == nullptr);               // reopen without close must scan
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+}
+
+TEST_F(MVTest, RecoveryWithoutLeafDirectoryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        if (istr[0] == '1') ASSERT_TRUE(kv->Remove(istr) == OK);           // empties whole leaves
+    }
+    Analyze();
+    const size_t leaf_empty = analysis.leaf_empty;
+    const size_t leaf_total = analysis.leaf_total;
+    delete kv;
+    auto pop = pool<MVPoolRoot>::open(PATH, LAYOUT);
+#if RECOVERY_SNAPSHOT
+    auto root = pop.get_root();
+    ASSERT_TRUE(root->directory != nullptr);               // written by clean close
+    ASSERT_EQ(root->directory->format, SNAPSHOT_FORMAT);
+#endif
+    pop.close();                                           // this open leaves it stale
+    kv = new MVTree(PATH, SIZE, LAYOUT);
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        if (istr[0] == '1') {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, leaf_empty);
+    ASSERT_EQ(analysis.leaf_prealloc, leaf_empty);
+    ASSERT_EQ(analysis.leaf_total, leaf_total);
+}
+
+TEST_F(MVTest, StaleLeafDirectoryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    delete kv;                                             // writes leaf directory
+    auto pop = pool<MVPoolRoot>::open(PATH, LAYOUT);
+    auto root = pop.get_root();
+    persistent_ptr<MVDirectory> stale = root->directory;
+    transaction::exec_tx(pop, [&] { root->directory = nullptr; });  // kept for later
+    pop.close();
+    kv = new MVTree(PATH, SIZE, LAYOUT);
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        if (istr[0] == '1') ASSERT_TRUE(kv->Remove(istr) == OK);
+    }
+    ASSERT_TRUE(kv->Put("extra", "!") == OK) << pmemobj_errormsg();
+    delete kv;
+    pop = pool<MVPoolRoot>::open(PATH, LAYOUT);
+    root = pop.get_root();
+    transaction::exec_tx(pop, [&] {                        // as if changed by older code
+        auto current = root->directory;
+        if (current) {
+            delete_persistent<char[]>(current->contents, current->size);
+            delete_persistent<MVDirectory>(current);
+        }
+        root->directory = stale;
+    });
+    pop.close();
+    kv = new MVTree(PATH, SIZE, LAYOUT);                   // must scan, not trust it
+    while (kv->RecoveryProgress() < 1) std::this_thread::yield();          // when RECOVERY_LAZY
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        if (istr[0] == '1') {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("extra", &value) == OK && value == "!");
+    ASSERT_TRUE(root->directory == nullptr);               // discarded after use
+}
+
+TEST_F(MVTest, LeafDirectoryAfterFailedSplitTest) {
+    for (int i = 0; i <= LEAF_KEYS; i++) ASSERT_TRUE(kv->Put(to_string(i), "?") == OK);
+    for (int i = 0; i <= LEAF_KEYS; i++) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    Reopen();                                              // empty leaves are preallocated
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    ASSERT_TRUE(analysis.leaf_prealloc >= 2);
+    for (int i = 0; i < LEAF_KEYS; i++) {                  // fills head leaf
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    tx_alloc_should_fail = true;                           // split moves slots, then fails
+    const KVStatus status = kv->Put("new", string(LEAF_INLINE_SIZE + 100, '!'));
+    tx_alloc_should_fail = false;
+    ASSERT_TRUE(status == FAILED);
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS);
+    ASSERT_EQ(kv->RecoveryProgress(), 1);                  // rebuilt, not recovering again
+    for (int pass = 0; pass < 2; pass++) {
+        Reopen();                                          // through leaf directory
+        for (int i = 0; i < LEAF_KEYS; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+        Analyze();
+        ASSERT_EQ(analysis.leaf_total, leaf_total);
+        ASSERT_EQ(analysis.leaf_prealloc, leaf_total - 1 - pass);  // none leaked
+        ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS + pass);
+        ASSERT_TRUE(kv->Put("new", "?") == OK) << pmemobj_errormsg();
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("new", &value) == OK && value == "?");
+}
+
+// =============================================================================================
+// TEST LAZY RECOVERY
+// =============================================================================================
+
+TEST_F(MVTest, ReadsAndWritesDuringRecoveryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    auto reader = std::async(std::launch::async, [this] {
+        for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+            string istr = to_string(i);
+            string value;
+            if (kv->Get(istr, &value) != OK || value != (istr + "!")) return false;
+        }
+        return true;
+    });
+    ASSERT_TRUE(kv->Put("extra", "!") == OK) << pmemobj_errormsg();        // waits for index
+    ASSERT_EQ(kv->RecoveryProgress(), 1);
+    ASSERT_TRUE(reader.get());
+    string value;
+    ASSERT_TRUE(kv->Get("extra", &value) == OK && value == "!");
+    char buffer[8];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 1, &valuebytes, "1", buffer) == OK);
+    ASSERT_EQ(string(buffer, valuebytes), "1!");
+}
+
+TEST_F(MVTest, ReadsDuringRecoveryWithoutLeafDirectoryTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        if (istr[0] == '1') ASSERT_TRUE(kv->Remove(istr) == OK);           // empties whole leaves
+    }
+    delete kv;
+    pool<MVPoolRoot>::open(PATH, LAYOUT).close();          // leaves leaf directory stale
+    kv = new MVTree(PATH, SIZE, LAYOUT);                   // scans leaves
+    auto reader = std::async(std::launch::async, [this] {
+        for (int i = PARALLEL_LIMIT; i >= 1; i--) {
+            string istr = to_string(i);
+            string value;
+            const KVStatus status = kv->Get(istr, &value);
+            if (istr[0] == '1' ? status != NOT_FOUND : status != OK || value != (istr + "!")) {
+                return false;
+            }
+        }
+        return true;
+    });
+    vector<string> keys{"2", "1", "3", "missing"};
+    vector<string> values;
+    vector<KVStatus> statuses;
+    kv->MultiGet(keys, values, statuses);
+    ASSERT_TRUE(statuses[0] == OK && values[0] == "2!");
+    ASSERT_TRUE(statuses[1] == NOT_FOUND && statuses[2] == OK && statuses[3] == NOT_FOUND);
+    ASSERT_TRUE(reader.get());
+    ASSERT_TRUE(kv->Put("extra", "!") == OK) << pmemobj_errormsg();        // waits for index
+    ASSERT_EQ(kv->RecoveryProgress(), 1);
+    string value;
+    ASSERT_TRUE(kv->Get("2", &value) == OK && value == "2!");
+}
+
+TEST_F(MVTest, RecoveryProgressTest) {
+    for (int i = 1; i <= PARALLEL_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (istr + "!")) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    double last = 0;
+    for (double progress; (progress = kv->RecoveryProgress()) < 1;) {
+        ASSERT_GE(progress, last);
+        last = progress;
+        std::this_thread::yield();
+    }
+    Analyze();
+    ASSERT_EQ(kv->RecoveryProgress(), 1);
+}
+
+// =============================================================================================
+// TEST ORDERED RANGE SCANS
+// =============================================================================================
+
+const int RANGE_LIMIT = LEAF_KEYS * INNER_KEYS * 2;        // several inner levels
+
+static string RangeKey(int i) {                            // fixed width sorts numerically
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08d", i);
+    return string(buf);
+}
+
+static void PutRangeKeys(MVTree* kv) {                    // scattered order, every third removed
+    for (int i = 0; i < RANGE_LIMIT; i++) {
+        const int k = (int) (((int64_t) i * 7919) % RANGE_LIMIT);
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    for (int k = 0; k < RANGE_LIMIT; k += 3) ASSERT_TRUE(kv->Remove(RangeKey(k)) == OK);
+}
+
+static void CheckRangeKeys(MVTree* kv, int from, int to) { // pairs for from <= key < to
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween(RangeKey(from), RangeKey(to), kv_pairs);
+    size_t i = 0;
+    for (int k = std::max(from, 0); k < std::min(to, RANGE_LIMIT); k++) {
+        if (k % 3 == 0) continue;
+        ASSERT_LT(i + 1, kv_pairs.size());
+        ASSERT_EQ(kv_pairs[i++], RangeKey(k));
+        ASSERT_EQ(kv_pairs[i++], to_string(k));
+    }
+    ASSERT_EQ(i, kv_pairs.size());
+}
+
+TEST_F(MVTest, RangeScanTest) {
+    PutRangeKeys(kv);
+    CheckRangeKeys(kv, 0, RANGE_LIMIT);
+    CheckRangeKeys(kv, 1000, 1001);
+    CheckRangeKeys(kv, 1000, 1003);
+    CheckRangeKeys(kv, LEAF_KEYS, RANGE_LIMIT - LEAF_KEYS);
+    CheckRangeKeys(kv, RANGE_LIMIT - 10, RANGE_LIMIT + 10);
+    CheckRangeKeys(kv, 500, 500);
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween(RangeKey(600), RangeKey(500), kv_pairs);
+    ASSERT_TRUE(kv_pairs.empty());
+}
+
+TEST_F(MVTest, ConcurrentRangeScanTest) {
+    PutRangeKeys(kv);
+    ASSERT_TRUE(kv->Put(RangeKey(0), "0") == OK) << pmemobj_errormsg();   // first leaf unsorted
+    ASSERT_TRUE(kv->Remove(RangeKey(0)) == OK);
+    vector<std::future<void>> scans;
+    for (int t = 0; t < 4; t++) {
+        scans.push_back(std::async(std::launch::async, [this] {
+            CheckRangeKeys(kv, 0, RANGE_LIMIT);
+        }));
+    }
+    for (auto& scan : scans) scan.get();
+}
+
+TEST_F(MVTest, RangeScanAfterRecoveryTest) {
+    PutRangeKeys(kv);
+    Reopen();
+    CheckRangeKeys(kv, 0, RANGE_LIMIT);
+    CheckRangeKeys(kv, 777, 7777);
+    for (int k = 0; k < RANGE_LIMIT; k += 3) {                // splits leaves linked by recovery
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween(RangeKey(0), RangeKey(RANGE_LIMIT), kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), RANGE_LIMIT * 2);
+    for (int k = 0; k < RANGE_LIMIT; k++) ASSERT_EQ(kv_pairs[k * 2], RangeKey(k));
+}
+
+// =============================================================================================
+// TEST WRITE BATCHES
+// =============================================================================================
+
+const int BATCH_LIMIT = LEAF_KEYS * 10;  // batch spans several leaf splits
+
+TEST_F(MVTest, WriteBatchTest) {
+    ASSERT_TRUE(kv->Put("removed", "?") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("replaced", "?") == OK) << pmemobj_errormsg();
+    pmemkv::KVWriteBatch batch;
+    for (int i = 0; i < BATCH_LIMIT; i++) batch.Put(to_string(i), to_string(i));
+    batch.Remove("removed");
+    batch.Put("replaced", string(LEAF_INLINE_SIZE + 100, '!'));
+    batch.Remove("1");
+    batch.Put("1", "again");                               // applied in the order added
+    ASSERT_EQ(batch.Count(), BATCH_LIMIT + 4);
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 2; i < BATCH_LIMIT; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr);
+        }
+        string value;
+        ASSERT_TRUE(kv->Get("1", &value) == OK && value == "again");
+        string value2;
+        ASSERT_TRUE(kv->Get("removed", &value2) == NOT_FOUND);
+        string value3;
+        ASSERT_TRUE(kv->Get("replaced", &value3) == OK && value3 == string(LEAF_INLINE_SIZE + 100, '!'));
+        ASSERT_EQ(kv->TotalNumKeys(), BATCH_LIMIT + 1);
+        Reopen();
+    }
+}
+
+TEST_F(MVTest, WriteBatchWhenAllocationFailsTest) {
+    pmemkv::KVWriteBatch batch;
+    for (int i = 0; i < BATCH_LIMIT; i++) batch.Put(to_string(i), to_string(i));
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    batch.Clear();
+    for (int i = 0; i < BATCH_LIMIT; i += 2) batch.Remove(to_string(i));
+    batch.Put("1", "?");                                   // overwritten in place
+    batch.Put("new", string(LEAF_INLINE_SIZE + 100, '!'));  // needs new buffer
+    tx_alloc_should_fail = true;
+    const KVStatus status = kv->Write(batch);
+    tx_alloc_should_fail = false;
+    ASSERT_TRUE(status == FAILED);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < BATCH_LIMIT; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr);
+        }
+        string value;
+        ASSERT_TRUE(kv->Get("new", &value) == NOT_FOUND);
+        ASSERT_TRUE(kv->Put(to_string(BATCH_LIMIT + pass), "more") == OK) << pmemobj_errormsg();
+        ASSERT_EQ(kv->TotalNumKeys(), BATCH_LIMIT + pass + 1);
+        Reopen();
+    }
+}
+
+// =============================================================================================
+// TEST COMBINED WRITES
+// =============================================================================================
+
+const int COMBINE_THREADS = 8;
+const int COMBINE_LIMIT = LEAF_KEYS * 20;  // writes per thread
+
+TEST_F(MVTest, CombinedWritesTest) {
+    vector<std::future<void>> writers;
+    for (int t = 0; t < COMBINE_THREADS; t++) {
+        writers.push_back(std::async(std::launch::async, [this, t] {
+            for (int i = 0; i < COMBINE_LIMIT; i++) {
+                string istr = to_string(t) + "-" + to_string(i);
+                ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+                if (i % 2) ASSERT_TRUE(kv->Remove(istr) == OK);
+            }
+        }));
+    }
+    for (auto& w : writers) w.wait();
+    Analyze();
+    ASSERT_EQ(analysis.combined_writes, COMBINE_THREADS * COMBINE_LIMIT * 3 / 2);
+    ASSERT_GE(analysis.combined_commits, 1);
+    ASSERT_LE(analysis.combined_commits, analysis.combined_writes);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int t = 0; t < COMBINE_THREADS; t++) {
+            for (int i = 0; i < COMBINE_LIMIT; i++) {
+                string istr = to_string(t) + "-" + to_string(i);
+                string value;
+                ASSERT_TRUE(kv->Get(istr, &value) == (i % 2 ? NOT_FOUND : OK));
+                if (i % 2 == 0) ASSERT_EQ(value, istr);
+            }
+        }
+        ASSERT_EQ(kv->TotalNumKeys(), COMBINE_THREADS * COMBINE_LIMIT / 2);
+        Reopen();
+    }
+}
+
+TEST_F(MVTest, CombinedWritesWhenAllocationFailsTest) {
+    for (int i = 0; i < COMBINE_LIMIT; i++) {
+        ASSERT_TRUE(kv->Put(to_string(i), string(20, 'o')) == OK) << pmemobj_errormsg();
+    }
+    vector<std::future<void>> writers;
+    for (int t = 0; t < COMBINE_THREADS; t++) {
+        writers.push_back(std::async(std::launch::async, [this, t] {
+            tx_alloc_should_fail = true;                   // per thread, any writer may combine
+            for (int i = t; i < COMBINE_LIMIT; i += COMBINE_THREADS) {
+                string istr = to_string(i);
+                ASSERT_TRUE(kv->Put(istr, string(20, 'n')) == OK);                      // in place
+                ASSERT_TRUE(kv->Put("x" + istr, string(LEAF_INLINE_SIZE + 100, '!')) == FAILED);
+            }
+        }));
+    }
+    for (auto& w : writers) w.wait();
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < COMBINE_LIMIT; i++) {
+            string value;
+            ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == string(20, 'n'));
+        }
+        ASSERT_EQ(kv->TotalNumKeys(), COMBINE_LIMIT);
+        Reopen();
+    }
+}
+
+// =============================================================================================
+// TEST LEAF LOCKING
+// =============================================================================================
+
+TEST_F(MVTest, ConcurrentLeafReadersAndWritersTest) {
+    for (int i = 0; i < COMBINE_LIMIT; i++) {
+        string istr = "r" + to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    vector<std::future<void>> workers;
+    for (int t = 0; t < COMBINE_THREADS; t++) {
+        workers.push_back(std::async(std::launch::async, [this, t] {
+            for (int i = 0; i < COMBINE_LIMIT; i++) {
+                string wstr = "w" + to_string(t) + "-" + to_string(i);         // splits leaves
+                ASSERT_TRUE(kv->Put(wstr, wstr) == OK) << pmemobj_errormsg();
+                string rstr = "r" + to_string((i * 7 + t) % COMBINE_LIMIT);  // never changes
+                string value;
+                ASSERT_TRUE(kv->Get(rstr, &value) == OK && value == rstr);
+            }
+        }));
+    }
+    workers.push_back(std::async(std::launch::async, [this] {
+        for (int pass = 0; pass < 20; pass++) {
+            vector<string> kv_pairs;
+            kv->ListKeyValuePairsBetween("r", "s", kv_pairs);
+            ASSERT_EQ(kv_pairs.size(), COMBINE_LIMIT * 2);
+            vector<string> keys;
+            kv->ListAllKeys(keys);                         // shares locks with writers
+            const auto unchanged = [](const string& k) { return k[0] == 'r'; };
+            ASSERT_EQ(std::count_if(keys.begin(), keys.end(), unchanged), COMBINE_LIMIT);
+        }
+    }));
+    for (auto& w : workers) w.wait();
+    ASSERT_EQ(kv->TotalNumKeys(), COMBINE_LIMIT * (COMBINE_THREADS + 1));
+    Reopen();
+    for (int t = 0; t < COMBINE_THREADS; t++) {
+        for (int i = 0; i < COMBINE_LIMIT; i++) {
+            string wstr = "w" + to_string(t) + "-" + to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(wstr, &value) == OK && value == wstr);
+        }
+    }
+}
+
+// =============================================================================================
+// TEST LOCK-FREE READERS
+// =============================================================================================
+
+TEST_F(MVTest, LockFreeReadersDuringOverwritesTest) {
+    const string small = "small";
+    const string large(LEAF_INLINE_SIZE + 500, 'L');       // moves between buffers
+    for (int i = 0; i < LEAF_KEYS * 4; i++) {
+        ASSERT_TRUE(kv->Put(to_string(i), small) == OK) << pmemobj_errormsg();
+    }
+    std::atomic<bool> writing{true};
+    vector<std::future<void>> workers;
+    for (int t = 0; t < COMBINE_THREADS; t++) {
+        workers.push_back(std::async(std::launch::async, [&, t] {
+            char buffer[1024];
+            for (int i = 0; writing; i = (i + t + 1) % (LEAF_KEYS * 4)) {
+                string value;
+                ASSERT_TRUE(kv->Get(to_string(i), &value) == OK);
+                ASSERT_TRUE(value == small || value == large);
+                int32_t valuebytes = -1;
+                ASSERT_TRUE(kv->Get(sizeof(buffer), to_string(i).size(), &valuebytes,
+                                    to_string(i).c_str(), buffer) == OK);
+                ASSERT_TRUE(string(buffer, valuebytes) == small || string(buffer, valuebytes) == large);
+                string in_place;                           // copied while callback runs
+                ASSERT_TRUE(kv->Get(&in_place, to_string(i), AppendValue) == OK);
+                ASSERT_TRUE(in_place == small || in_place == large);
+            }
+        }));
+    }
+    for (int pass = 0; pass < 20; pass++) {
+        for (int i = 0; i < LEAF_KEYS * 4; i++) {
+            ASSERT_TRUE(kv->Put(to_string(i), pass % 2 ? small : large) == OK) << pmemobj_errormsg();
+        }
+        ASSERT_TRUE(kv->Put("new" + to_string(pass), small) == OK) << pmemobj_errormsg();  // splits
+    }
+    writing = false;
+    for (auto& w : workers) w.wait();
+    for (int i = 0; i < LEAF_KEYS * 4; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == small);
+    }
+}
+
+// =============================================================================================
+// TEST ONLINE COMPACTION
+// =============================================================================================
+
+const int COMPACT_LIMIT = LEAF_KEYS * 20;                 // several leaves of varied buffers
+
+static string CompactValue(int i) {                        // sizes spread over many classes
+    return string(LEAF_INLINE_SIZE + 1 + (i * 37) % 700, (char) ('a' + i % 26));
+}
+
+TEST_F(MVTest, CompactTest) {
+    for (int i = 0; i < COMPACT_LIMIT; i++) {
+        ASSERT_TRUE(kv->Put(RangeKey(i), CompactValue(i)) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < COMPACT_LIMIT; i++) {              // leave runs sparsely used
+        if (i % 4 != 0) ASSERT_TRUE(kv->Remove(RangeKey(i)) == OK);
+    }
+    Analyze();
+    ASSERT_EQ(analysis.compact_passes, 0);
+    const size_t fragmentation = analysis.fragmentation_percent;
+    ASSERT_GT(fragmentation, 0);
+    int steps = 0;
+    while (!kv->Compact(LEAF_KEYS)) steps++;
+    ASSERT_GT(steps, 1);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < COMPACT_LIMIT; i++) {
+            string value;
+            if (i % 4 == 0) {
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == OK && value == CompactValue(i));
+            } else {
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == NOT_FOUND);
+            }
+        }
+        if (pass == 0) {
+            Analyze();
+            ASSERT_EQ(analysis.compact_passes, 1);
+            ASSERT_GT(analysis.compact_relocated, 0);
+            ASSERT_LE(analysis.fragmentation_percent, fragmentation);
+        }
+        Reopen();
+    }
+}
+
+TEST_F(MVTest, CompactInBackgroundTest) {
+    for (int i = 0; i < COMPACT_LIMIT; i++) {
+        ASSERT_TRUE(kv->Put(RangeKey(i), CompactValue(i)) == OK) << pmemobj_errormsg();
+    }
+    kv->CompactInBackground(COMPACT_STEP_OBJECTS * 1000);
+    vector<std::future<void>> workers;
+    for (int t = 0; t < COMBINE_THREADS; t++) {
+        workers.push_back(std::async(std::launch::async, [this, t] {
+            for (int i = t; i < COMPACT_LIMIT; i += COMBINE_THREADS) {
+                string value;
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == OK && value == CompactValue(i));
+                if (i % 4 != 0) ASSERT_TRUE(kv->Remove(RangeKey(i)) == OK);
+                const int k = COMPACT_LIMIT + i;
+                ASSERT_TRUE(kv->Put(RangeKey(k), CompactValue(k)) == OK) << pmemobj_errormsg();
+            }
+        }));
+    }
+    for (auto& w : workers) w.wait();
+    Analyze();
+    const size_t passes = analysis.compact_passes;
+    do {
+        Analyze();
+    } while (analysis.compact_passes < passes + 2);        // a whole pass after all writes
+    ASSERT_GT(analysis.compact_relocated, 0);
+    kv->CompactInBackground(0);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < COMPACT_LIMIT * 2; i++) {
+            string value;
+            if (i % 4 == 0 || i >= COMPACT_LIMIT) {
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == OK && value == CompactValue(i));
+            } else {
+                ASSERT_TRUE(kv->Get(RangeKey(i), &value) == NOT_FOUND);
+            }
+        }
+        ASSERT_EQ(kv->TotalNumKeys(), COMPACT_LIMIT / 4 + COMPACT_LIMIT);
+        Reopen();
+    }
+}
+
+// =============================================================================================
+// TEST MULTIGET
+// =============================================================================================
+
+TEST_F(MVTest, MultiGetTest) {
+    PutRangeKeys(kv);
+    ASSERT_TRUE(kv->Put(RangeKey(1), string(5000, '!')) == OK) << pmemobj_errormsg();
+    vector<string> keys;
+    for (int i = 0; i < RANGE_LIMIT; i += 7) {              // scattered, some removed
+        keys.push_back(RangeKey((int) (((int64_t) i * 7919) % RANGE_LIMIT)));
+    }
+    keys.push_back("missing");
+    keys.push_back(RangeKey(1));                           // repeated in the same group
+    keys.push_back(RangeKey(1));
+    keys.push_back("");
+    vector<string> values;
+    vector<KVStatus> statuses;
+    kv->MultiGet(keys, values, statuses);
+    ASSERT_EQ(values.size(), keys.size());
+    ASSERT_EQ(statuses.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        string value;
+        const KVStatus status = kv->Get(keys[i], &value);
+        ASSERT_TRUE(statuses[i] == status) << keys[i];
+        ASSERT_EQ(values[i], value);
+    }
+    ASSERT_TRUE(statuses[keys.size() - 4] == NOT_FOUND);
+    ASSERT_EQ(values[keys.size() - 2], string(5000, '!'));
+    Reopen();
+    vector<string> reopened;
+    kv->MultiGet(keys, reopened, statuses);
+    ASSERT_EQ(reopened, values);
+}
+
+TEST_F(MVTest, MultiGetEmptyTest) {
+    vector<string> values{"stale"};
+    vector<KVStatus> statuses;
+    kv->MultiGet({"key1", "key2"}, values, statuses);
+    ASSERT_EQ(values, vector<string>({"", ""}));
+    ASSERT_TRUE(statuses.size() == 2 && statuses[0] == NOT_FOUND && statuses[1] == NOT_FOUND);
+    kv->MultiGet({}, values, statuses);
+    ASSERT_TRUE(values.empty() && statuses.empty());
+}
+
+TEST_F(MVTest, ConcurrentMultiGetTest) {
+    PutRangeKeys(kv);
+    vector<string> keys;
+    for (int k = 1; k < RANGE_LIMIT; k += 3) keys.push_back(RangeKey(k));  // present before writes
+    std::atomic<bool> writing{true};
+    vector<std::future<void>> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.push_back(std::async(std::launch::async, [&] {
+            vector<string> values;
+            vector<KVStatus> statuses;
+            while (writing) {
+                kv->MultiGet(keys, values, statuses);
+                for (size_t i = 0; i < keys.size(); i++) {
+                    ASSERT_TRUE(statuses[i] == OK);
+                    ASSERT_EQ(values[i], to_string(stoi(keys[i])));
+                }
+            }
+        }));
+    }
+    for (int k = 0; k < RANGE_LIMIT; k += 3) {             // split leaves under the readers
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    writing = false;
+    for (auto& reader : readers) reader.get();
+}
+
+// =============================================================================================
+// TEST KEY COUNTS
+// =============================================================================================
+
+TEST_F(MVTest, TotalNumKeysTest) {
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    PutRangeKeys(kv);
+    const size_t expected = RANGE_LIMIT - (RANGE_LIMIT + 2) / 3;
+    ASSERT_EQ(kv->TotalNumKeys(), expected);
+    ASSERT_TRUE(kv->Put(RangeKey(1), "overwritten") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put(RangeKey(2), string(1000, '!')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove(RangeKey(3)) == OK);            // already removed
+    ASSERT_TRUE(kv->Remove("missing") == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), expected);
+    ASSERT_TRUE(kv->Put(RangeKey(0), "0") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove(RangeKey(4)) == OK);
+    ASSERT_TRUE(kv->Remove(RangeKey(5)) == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), expected - 1);
+    pmemkv::KVWriteBatch batch;                            // aborted batch counts nothing
+    batch.Put(RangeKey(3), "3");
+    batch.Remove(RangeKey(7));
+    batch.Put("new", string(LEAF_INLINE_SIZE + 100, '!'));
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    ASSERT_EQ(kv->TotalNumKeys(), expected - 1);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), expected - 1);
+    for (int k = 0; k < RANGE_LIMIT; k++) ASSERT_TRUE(kv->Remove(RangeKey(k)) == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+}
+
+// =============================================================================================
+// TEST CURSORS
+// =============================================================================================
+
+TEST_F(MVTest, CursorTest) {
+    PutRangeKeys(kv);
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    int k = 1;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        ASSERT_EQ(it->key(), RangeKey(k));
+        ASSERT_EQ(it->value(), to_string(k));
+        k += (k % 3 == 1) ? 1 : 2;                         // every third key removed
+    }
+    ASSERT_GE(k, RANGE_LIMIT);
+    k = (RANGE_LIMIT - 1) % 3 == 0 ? RANGE_LIMIT - 2 : RANGE_LIMIT - 1;
+    for (it->SeekToLast(); it->Valid(); it->Prev()) {
+        ASSERT_EQ(it->key(), RangeKey(k));
+        k -= (k % 3 == 2) ? 1 : 2;
+    }
+    ASSERT_LE(k, 0);
+    it->Seek(RangeKey(999));                               // removed, so next higher
+    ASSERT_TRUE(it->Valid());
+    ASSERT_EQ(it->key(), RangeKey(1000));
+    it->Prev();
+    it->Prev();
+    ASSERT_EQ(it->key(), RangeKey(997));
+    it->Seek(RangeKey(0));
+    ASSERT_EQ(it->key(), RangeKey(1));
+    it->Prev();
+    ASSERT_FALSE(it->Valid());
+    it->Seek(RangeKey(RANGE_LIMIT));
+    ASSERT_FALSE(it->Valid());
+}
+
+TEST_F(MVTest, ConcurrentCursorTest) {
+    PutRangeKeys(kv);
+    std::atomic<bool> writing{true};
+    vector<std::future<void>> scans;
+    for (int t = 0; t < 4; t++) {
+        scans.push_back(std::async(std::launch::async, [&] {
+            unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+            while (writing) {
+                int expected = 1;                          // pairs present before writes began
+                string last;
+                for (it->SeekToFirst(); it->Valid(); it->Next()) {
+                    ASSERT_LT(last, it->key());
+                    last = string(it->key());
+                    if (last == RangeKey(expected)) expected += (expected % 3 == 1) ? 1 : 2;
+                }
+                ASSERT_GE(expected, RANGE_LIMIT);
+            }
+        }));
+    }
+    for (int k = 0; k < RANGE_LIMIT; k += 3) {             // split leaves under the cursors
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    writing = false;
+    for (auto& scan : scans) scan.get();
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    int count = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) ASSERT_EQ(it->key(), RangeKey(count++));
+    ASSERT_EQ(count, RANGE_LIMIT);
+}
+
+TEST_F(MVTest, CursorEmptyTest) {
+    unique_ptr<pmemkv::KVIterator> it(kv->NewIterator());
+    it->SeekToFirst();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key1");
+    ASSERT_FALSE(it->Valid());
+}
+
+// =============================================================================================
+// TEST EACH CALLBACKS
+// =============================================================================================
+
+static void CollectPair(void* context, int32_t keybytes, int32_t valuebytes,
+                        const char* key, const char* value) {
+    auto kv_pairs = (vector<string>*) context;
+    kv_pairs->push_back(string(key, (size_t) keybytes));
+    kv_pairs->push_back(string(value, (size_t) valuebytes));
+}
+
+static void CheckEachPairs(const vector<string>& kv_pairs, // above < key < below
+                           int above, int below) {
+    int k = above + 1;
+    for (size_t i = 0; i < kv_pairs.size(); i += 2) {
+        if (k % 3 == 0) k++;                               // every third key removed
+        ASSERT_EQ(kv_pairs[i], RangeKey(k));
+        ASSERT_EQ(kv_pairs[i + 1], to_string(k));
+        k++;
+    }
+    if (k % 3 == 0) k++;
+    ASSERT_GE(k, below);
+}
+
+TEST_F(MVTest, EachTest) {
+    PutRangeKeys(kv);
+    vector<string> kv_pairs;
+    kv->Each(&kv_pairs, CollectPair);
+    CheckEachPairs(kv_pairs, 0, RANGE_LIMIT);
+    kv_pairs.clear();
+    kv->EachAbove(&kv_pairs, RangeKey(1000), CollectPair);
+    CheckEachPairs(kv_pairs, 1000, RANGE_LIMIT);
+    kv_pairs.clear();
+    kv->EachBelow(&kv_pairs, RangeKey(1000), CollectPair);
+    CheckEachPairs(kv_pairs, 0, 1000);
+    kv_pairs.clear();
+    kv->EachBetween(&kv_pairs, RangeKey(999), RangeKey(2001), CollectPair); // removed low bound
+    CheckEachPairs(kv_pairs, 999, 2001);
+    kv_pairs.clear();
+    kv->EachBetween(&kv_pairs, RangeKey(1000), RangeKey(1001), CollectPair);
+    ASSERT_TRUE(kv_pairs.empty());
+}
+
+TEST_F(MVTest, ConcurrentEachTest) {
+    PutRangeKeys(kv);
+    std::atomic<bool> writing{true};
+    vector<std::future<void>> scans;
+    for (int t = 0; t < 4; t++) {
+        scans.push_back(std::async(std::launch::async, [&] {
+            while (writing) {
+                vector<string> kv_pairs;
+                kv->Each(&kv_pairs, CollectPair);
+                size_t present = 0;                        // pairs present before writes began
+                for (size_t i = 0; i < kv_pairs.size(); i += 2) {
+                    if (i > 0) ASSERT_LT(kv_pairs[i - 2], kv_pairs[i]);
+                    if (stoi(kv_pairs[i]) % 3 != 0) present++;
+                }
+                ASSERT_EQ(present, RANGE_LIMIT - (RANGE_LIMIT + 2) / 3);
+            }
+        }));
+    }
+    for (int k = 0; k < RANGE_LIMIT; k += 3) {             // split leaves under the scans
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    writing = false;
+    for (auto& scan : scans) scan.get();
+    vector<string> kv_pairs;
+    kv->Each(&kv_pairs, CollectPair);
+    ASSERT_EQ(kv_pairs.size(), RANGE_LIMIT * 2);
+}
+
+struct PausedScan {                                        // scan paused on its first pair
+    std::atomic<bool> paused{false};
+    std::atomic<bool> written{false};
+    bool written_while_paused = false;
+    size_t pairs = 0;
+};
+
+static void PauseOnFirstPair(void* context, int32_t keybytes, int32_t valuebytes,
+                             const char* key, const char* value) {
+    auto scan = (PausedScan*) context;
+    if (scan->pairs++ > 0) return;
+    scan->paused = true;
+    for (int ms = 0; ms < 10000 && !scan->written; ms++) {  // gives up rather than deadlock
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    scan->written_while_paused = scan->written;
+}
+
+TEST_F(MVTest, SplitDuringPausedEachTest) {
+    PutRangeKeys(kv);
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    PausedScan scan;
+    auto scanning = std::async(std::launch::async, [&] { kv->Each(&scan, PauseOnFirstPair); });
+    while (!scan.paused) std::this_thread::yield();
+    for (int k = RANGE_LIMIT; k <= RANGE_LIMIT + LEAF_KEYS; k++) {    // splits highest leaf
+        ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    scan.written = true;
+    scanning.get();
+    ASSERT_TRUE(scan.written_while_paused);
+    ASSERT_EQ(scan.pairs, RANGE_LIMIT - (RANGE_LIMIT + 2) / 3 + LEAF_KEYS + 1);
+    Analyze();
+    ASSERT_GT(analysis.leaf_total, leaf_total);
+}
+
+struct EngineScan {                                        // scan calling back into its engine
+    MVTree* kv;
+    size_t pairs = 0;
+};
+
+static void CopyEachPairBelow(void* context, int32_t keybytes, int32_t valuebytes,
+                              const char* key, const char* value) {
+    auto scan = (EngineScan*) context;
+    const string k(key, (size_t) keybytes);
+    string v;
+    ASSERT_TRUE(scan->kv->Get(k, &v) == OK && v == string(value, (size_t) valuebytes));
+    ASSERT_GT(scan->kv->TotalNumKeys(), 0);
+    ASSERT_TRUE(scan->kv->Put("!" + k, v) == OK) << pmemobj_errormsg();  // sorts below scan
+    scan->pairs++;
+}
+
+TEST_F(MVTest, EachCallbackCallsEngineTest) {
+    PutRangeKeys(kv);
+    auto writing = std::async(std::launch::async, [&] {
+        for (int k = 0; k < RANGE_LIMIT; k += 3) {         // split leaves under the scan
+            ASSERT_TRUE(kv->Put(RangeKey(k), to_string(k)) == OK) << pmemobj_errormsg();
+        }
+    });
+    EngineScan scan{kv};
+    kv->EachAbove(&scan, RangeKey(0), CopyEachPairBelow);
+    writing.get();
+    ASSERT_GE(scan.pairs, RANGE_LIMIT - (RANGE_LIMIT + 2) / 3);
+    ASSERT_EQ(kv->TotalNumKeys(), RANGE_LIMIT + scan.pairs);
+    for (int k = 1; k < RANGE_LIMIT; k++) {
+        if (k % 3 == 0) continue;
+        string value;
+        ASSERT_TRUE(kv->Get("!" + RangeKey(k), &value) == OK && value == to_string(k));
+    }
+}
+
+struct PausedGet {                                         // Get paused in its callback
+    std::atomic<bool> paused{false};
+    std::atomic<bool> written{false};
+    bool written_while_paused = false;
+    string value;
+};
+
+static void PauseWithValue(void* context, int32_t valuebytes, const char* value) {
+    auto get = (PausedGet*) context;                       // touches nothing but its context
+    get->value.assign(value, (size_t) valuebytes);
+    get->paused = true;
+    for (int ms = 0; ms < 10000 && !get->written; ms++) {  // gives up rather than deadlock
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    get->written_while_paused = get->written;
+}
+
+TEST_F(MVTest, GetCallbackHoldsOnlyItsLeafTest) {
+    PutRangeKeys(kv);
+    PausedGet get;
+    auto getting = std::async(std::launch::async, [&] {
+        ASSERT_TRUE(kv->Get(&get, RangeKey(1), PauseWithValue) == OK);
+    });
+    while (!get.paused) std::this_thread::yield();
+    const string last = RangeKey(RANGE_LIMIT - 1);         // in another leaf, so not held back
+    ASSERT_TRUE(kv->Put(last, "new") == OK) << pmemobj_errormsg();
+    get.written = true;
+    getting.get();
+    ASSERT_TRUE(get.written_while_paused);
+    ASSERT_EQ(get.value, "1");
+    string value;                                          // engine called once callback returns
+    ASSERT_TRUE(kv->Get(last, &value) == OK && value == "new");
+}
+
+// =============================================================================================
+// TEST TREE WITH SHARED KEY PREFIXES
+// =============================================================================================
+
+const int SHARED_PREFIX_LIMIT = LEAF_KEYS * INNER_KEYS;
+
+static string SharedPrefixKey(int i) {                     // long shared head, varied tails
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%016d", i / 3);
+    string key(buf);
+    if (i % 3 == 1) key.push_back('\0');                   // sorts between key and key + "0"
+    if (i % 3 == 2) key.push_back('0');                    // extends both of the others
+    return key;
+}
+
+TEST_F(MVTest, SharedPrefixKeysTest) {
+    for (int i = 1; i <= SHARED_PREFIX_LIMIT; i++) {
+        string key = SharedPrefixKey(i);
+        ASSERT_TRUE(kv->Put(key, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 1; i <= SHARED_PREFIX_LIMIT; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(SharedPrefixKey(i), &value) == OK && value == to_string(i));
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("0000000", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("00000000", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("9", &value) == NOT_FOUND);
+    Analyze();
+    ASSERT_GE(analysis.inner_depth, 2);
+}
+
+TEST_F(MVTest, SharedPrefixKeysAfterRecoveryTest) {
+    for (int i = SHARED_PREFIX_LIMIT; i >= 1; i--) {
+        string key = SharedPrefixKey(i);
+        ASSERT_TRUE(kv->Put(key, to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    for (int i = SHARED_PREFIX_LIMIT; i >= 1; i--) {
+        string value;
+        ASSERT_TRUE(kv->Get(SharedPrefixKey(i), &value) == OK && value == to_string(i));
+    }
+    Analyze();
+    ASSERT_GE(analysis.inner_depth, 2);
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -918,6 +2113,9 @@ TEST_F(MVTest, LargeAscendingAfterRecoveryTest) {
     // ASSERT_EQ(analysis.leaf_total, 152455);
     ASSERT_LE(analysis.leaf_total, 153000);
     ASSERT_GE(analysis.leaf_total, 149000);
+    ASSERT_GE(analysis.inner_depth, 2);
+    ASSERT_LE(analysis.inner_depth, 4);
+    ASSERT_GE(analysis.inner_total, analysis.leaf_total / (INNER_KEYS + 1));
 
 
 }
@@ -939,6 +2137,9 @@ TEST_F(MVTest, LargeDescendingAfterRecoveryTest) {
     // ASSERT_EQ(analysis.leaf_total, 150000);
     ASSERT_LE(analysis.leaf_total, 151000);
     ASSERT_GE(analysis.leaf_total, 149000);
+    ASSERT_GE(analysis.inner_depth, 2);
+    ASSERT_LE(analysis.inner_depth, 4);
+    ASSERT_GE(analysis.inner_total, analysis.leaf_total / (INNER_KEYS + 1));
 
 
 }
@@ -1009,8 +2210,9 @@ const string LONGSTR = "123456789A123456789A123456789A123456789A123456789A123456
 
 TEST_F(MVFullTest, OutOfSpace1Test) {
     tx_alloc_should_fail = true;
-    ASSERT_TRUE(kv->Put("100", "?") == FAILED);
+    ASSERT_TRUE(kv->Put("100", "?") == OK);                // reuses buffer without allocating
     tx_alloc_should_fail = false;
+    ASSERT_TRUE(kv->Put("100", "100!") == OK) << pmemobj_errormsg();
     Validate();
 }
 
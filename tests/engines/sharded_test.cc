@@ -0,0 +1,270 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <future>
+#include "gtest/gtest.h"
+#include "../mock_tx_alloc.h"
+#include "../../src/engines/sharded.h"
+
+using namespace pmemkv::sharded;
+
+const string PATH = "/dev/shm/pmemkv";
+const string LAYOUT = "pmemkv";
+const size_t SIZE = ((size_t) (1024 * 1024 * 1104));
+
+class ShardedEmptyTest : public testing::Test {
+public:
+    ShardedEmptyTest() {
+        std::remove(PATH.c_str());
+    }
+};
+
+class ShardedTest : public testing::Test {
+public:
+    ShardedAnalysis analysis;
+    ShardedEngine *kv;
+
+    ShardedTest() {
+        std::remove(PATH.c_str());
+        Open();
+    }
+
+    ~ShardedTest() { delete kv; }
+
+    void Analyze() {
+        analysis = {};
+        kv->Analyze(analysis);
+        ASSERT_TRUE(analysis.path == PATH);
+    }
+
+    void Reopen() {
+        delete kv;
+        Open();
+    }
+
+private:
+    void Open() {
+        kv = new ShardedEngine(PATH, SIZE, LAYOUT);
+    }
+};
+
+// =============================================================================================
+// TEST EMPTY ENGINE
+// =============================================================================================
+
+TEST_F(ShardedEmptyTest, CreateInstanceTest) {
+    ShardedEngine *kv = new ShardedEngine(PATH, SIZE, LAYOUT);
+    ShardedAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_EQ(analysis.shard_count, SHARDED_SHARDS);
+    ASSERT_EQ(analysis.shard_keys_max, 0);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    delete kv;
+}
+
+TEST_F(ShardedEmptyTest, KeepsShardCountFromCreationTest) {
+    ShardedEngine *kv = new ShardedEngine(PATH, SIZE, LAYOUT, 3);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    delete kv;
+    kv = new ShardedEngine(PATH, SIZE, LAYOUT);            // count only applies when creating
+    ShardedAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_EQ(analysis.shard_count, 3);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    delete kv;
+}
+
+TEST_F(ShardedEmptyTest, FailsToCreateInstanceWithInvalidShardCount) {
+    try {
+        new ShardedEngine(PATH, SIZE, LAYOUT, SHARDED_SHARDS_MAX + 1);
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+TEST_F(ShardedEmptyTest, FailsToCreateInstanceWithInvalidPath) {
+    try {
+        new ShardedEngine("/tmp/123/234/345/456/567/678/nope.nope", SIZE, LAYOUT);
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+// =============================================================================================
+// TEST KEYS ACROSS SHARDS
+// =============================================================================================
+
+const int SHARDED_LIMIT = 10000;
+
+TEST_F(ShardedTest, PutGetRemoveTest) {
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < SHARDED_LIMIT; i += 2) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < SHARDED_LIMIT; i++) {
+            string istr = to_string(i);
+            string value;
+            ASSERT_TRUE(kv->Get(istr, &value) == (i % 2 ? OK : NOT_FOUND));
+            if (i % 2) ASSERT_EQ(value, istr + "!");
+        }
+        char buffer[16];
+        int32_t valuebytes = -1;
+        ASSERT_TRUE(kv->Get(sizeof(buffer), 1, &valuebytes, "1", buffer) == OK);
+        ASSERT_EQ(string(buffer, valuebytes), "1!");
+        ASSERT_EQ(kv->TotalNumKeys(), SHARDED_LIMIT / 2);
+        Reopen();
+    }
+    Analyze();
+    ASSERT_GT(analysis.shard_keys_min, 0);                 // every shard gets a share of keys
+    ASSERT_LT(analysis.shard_keys_max, analysis.shard_keys_min * 2);
+}
+
+TEST_F(ShardedTest, ConcurrentWritersTest) {
+    vector<std::future<void>> writers;
+    for (int t = 0; t < 8; t++) {
+        writers.push_back(std::async(std::launch::async, [this, t] {
+            for (int i = t; i < SHARDED_LIMIT; i += 8) {
+                string istr = to_string(i);
+                ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+                string value;
+                ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr);
+            }
+        }));
+    }
+    for (auto& w : writers) w.wait();
+    ASSERT_EQ(kv->TotalNumKeys(), SHARDED_LIMIT);
+    vector<string> keys;
+    kv->ListAllKeys(keys);
+    ASSERT_EQ(keys.size(), SHARDED_LIMIT);
+}
+
+TEST_F(ShardedTest, RangeScanMergesShardsInOrderTest) {
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    vector<string> kv_pairs;
+    kv->ListKeyValuePairsBetween("2", "3", kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), 1111 * 2);                  // "2" and "20".."2999"
+    for (size_t i = 0; i < kv_pairs.size(); i += 2) {
+        ASSERT_EQ(kv_pairs[i], kv_pairs[i + 1]);
+        if (i > 0) ASSERT_LT(kv_pairs[i - 2], kv_pairs[i]);
+    }
+    ASSERT_EQ(kv_pairs.front(), "2");
+    ASSERT_EQ(kv_pairs[kv_pairs.size() - 2], "2999");
+}
+
+static void CountPair(void* context, int32_t keybytes, int32_t valuebytes,
+                      const char* key, const char* value) {
+    ASSERT_EQ(string(key, (size_t) keybytes), string(value, (size_t) valuebytes));
+    (*(int*) context)++;
+}
+
+TEST_F(ShardedTest, EachVisitsEveryShardTest) {
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    int count = 0;
+    kv->Each(&count, CountPair);
+    ASSERT_EQ(count, SHARDED_LIMIT);
+    count = 0;
+    kv->EachBetween(&count, "2", "3", CountPair);
+    ASSERT_EQ(count, 1110);                                // "20".."2999"
+    count = 0;
+    kv->EachBelow(&count, "1", CountPair);
+    ASSERT_EQ(count, 1);                                   // "0"
+    count = 0;
+    kv->EachAbove(&count, "9998", CountPair);
+    ASSERT_EQ(count, 1);                                   // "9999"
+}
+
+TEST_F(ShardedTest, MultiGetAcrossShardsTest) {
+    for (int i = 0; i < SHARDED_LIMIT; i += 2) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    vector<string> keys;
+    for (int i = 0; i < 1000; i++) keys.push_back(to_string(i));
+    vector<string> values;
+    vector<KVStatus> statuses;
+    kv->MultiGet(keys, values, statuses);
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_TRUE(statuses[i] == (i % 2 ? NOT_FOUND : OK));
+        ASSERT_EQ(values[i], i % 2 ? "" : keys[i]);
+    }
+}
+
+TEST_F(ShardedTest, WriteBatchTest) {
+    pmemkv::KVWriteBatch batch;
+    for (int i = 0; i < 1000; i++) batch.Put(to_string(i), to_string(i));
+    batch.Remove("7");
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 999);
+    string value;
+    ASSERT_TRUE(kv->Get("7", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("8", &value) == OK && value == "8");
+}
+
+TEST_F(ShardedTest, FreeTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    kv->Free();
+    persistent_ptr<ShardedRoot> root = kv->GetRootOid();
+    ASSERT_EQ(root->shard_count, 0);
+    for (size_t i = 0; i < SHARDED_SHARDS; i++) ASSERT_TRUE(root->shards[i] == nullptr);
+    Reopen();                                              // makes new shards
+    Analyze();
+    ASSERT_EQ(analysis.shard_count, SHARDED_SHARDS);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+}
+
+TEST_F(ShardedTest, FreeInterruptedTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    delete kv;
+    auto pop = pool<ShardedRoot>::open(PATH, LAYOUT);
+    auto root = pop.get_root();
+    transaction::exec_tx(pop, [&] { root->shard_count = 0; });  // as if Free stopped there
+    pop.close();
+    kv = new ShardedEngine(PATH, SIZE, LAYOUT);            // makes new shards
+    Analyze();
+    ASSERT_EQ(analysis.shard_count, SHARDED_SHARDS);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    ASSERT_TRUE(kv->Put("key1", "value2") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value2");
+}
@@ -30,6 +30,7 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <libpmemobj/action_base.h>
 #include <libpmemobj/tx_base.h>
 #include <dlfcn.h>
 #include <cstdlib>
@@ -54,3 +55,37 @@ PMEMoid pmemobj_tx_alloc(size_t size, uint64_t type_num) {
 
     return real(size, type_num);
 }
+
+extern "C" PMEMoid pmemobj_tx_xalloc(size_t size, uint64_t type_num, uint64_t flags);
+
+PMEMoid pmemobj_tx_xalloc(size_t size, uint64_t type_num, uint64_t flags) {
+    static auto real = (decltype(pmemobj_tx_xalloc)*)dlsym(RTLD_NEXT, "pmemobj_tx_xalloc");
+
+    if (real == nullptr)
+        abort();
+
+    if (tx_alloc_should_fail) {
+        errno = ENOMEM;
+        return OID_NULL;
+    }
+
+    return real(size, type_num, flags);
+}
+
+extern "C" PMEMoid pmemobj_xreserve(PMEMobjpool* pop, struct pobj_action* act,
+                                    size_t size, uint64_t type_num, uint64_t flags);
+
+PMEMoid pmemobj_xreserve(PMEMobjpool* pop, struct pobj_action* act, size_t size, uint64_t type_num,
+                         uint64_t flags) {
+    static auto real = (decltype(pmemobj_xreserve)*)dlsym(RTLD_NEXT, "pmemobj_xreserve");
+
+    if (real == nullptr)
+        abort();
+
+    if (tx_alloc_should_fail) {
+        errno = ENOMEM;
+        return OID_NULL;
+    }
+
+    return real(pop, act, size, type_num, flags);
+}